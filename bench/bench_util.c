@@ -0,0 +1,103 @@
+#include "bench_util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "../util.h"
+
+const char *syllables[SYLLABLES] = { "ka", "lo", "mi", "ne", "ra", "to", "su", "vi", "be", "da", "ge", "ho", "ju", "po", "qui", "ze", "an", "el", "or", "us", "tri", "sha", "mon", "dre" };
+
+// the directory bench_config_start made
+static char dir[] = "/tmp/minstrel-bench-XXXXXX";
+
+double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void phrase(char *dst, int words) {
+	static const char *common[] = { "love", "the", "night", "beatles", "help", "blue", "heart" };
+	*dst = '\0';
+	for (int i = 0; i < words; ++i) {
+		if (i > 0) strcat(dst, " ");
+		if (rand() % 10 == 0) {
+			strcat(dst, common[rand() % 7]);
+			continue;
+		}
+		for (int s = 2 + rand() % 3; s > 0; --s) {
+			strcat(dst, syllables[rand() % SYLLABLES]);
+		}
+	}
+	dst[0] = dst[0] - 'a' + 'A';
+}
+
+void fill(sqlite3 *index_db, int n, void (*make_phrase)(char *dst, int words)) {
+	sqlite3_stmt *insert;
+	char filename[64], artist[128], album[128], title[128];
+
+	if (make_phrase == NULL) make_phrase = phrase;
+
+	sqlite3_exec(index_db, "BEGIN;", NULL, NULL, NULL);
+	if (sqlite3_prepare_v2(index_db, "insert into tunes(artist, album, title, filename, sort_artist, sort_album, track_key) values (?1, ?2, ?3, ?4, lower(?1), lower(?2), track_key(?4))", -1, &insert, NULL) != SQLITE_OK) goto fill_failure;
+
+	for (int i = 0; i < n; ++i) {
+		if (i % 60 == 0) make_phrase(artist, 1 + rand() % 3);
+		if (i % 10 == 0) make_phrase(album, 1 + rand() % 4);
+		make_phrase(title, 1 + rand() % 5);
+		snprintf(filename, sizeof(filename), "file:///music/%d.mp3", i);
+
+		if (sqlite3_reset(insert) != SQLITE_OK) goto fill_failure;
+		if (sqlite3_bind_text(insert, 1, artist, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fill_failure;
+		if (sqlite3_bind_text(insert, 2, album, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fill_failure;
+		if (sqlite3_bind_text(insert, 3, title, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fill_failure;
+		if (sqlite3_bind_text(insert, 4, filename, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fill_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto fill_failure;
+	}
+
+	sqlite3_finalize(insert);
+	sqlite3_exec(index_db, "COMMIT;", NULL, NULL, NULL);
+	return;
+
+fill_failure:
+
+	fprintf(stderr, "Sqlite3 error filling index: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+void bench_config_start(void) {
+	strcpy(dir, "/tmp/minstrel-bench-XXXXXX");
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	setenv("XDG_CONFIG_HOME", dir, 1);
+
+	char *config_dir = config_path("");
+	mkdir(config_dir, 0700);
+	free(config_dir);
+}
+
+void bench_config_end(void) {
+	char *config_dir = config_path("");
+
+	// the index, the ratings, the shuffle bag and whatever else was made
+	DIR *d = opendir(config_dir);
+	struct dirent *e;
+	while ((d != NULL) && ((e = readdir(d)) != NULL)) {
+		if ((strcmp(e->d_name, ".") == 0) || (strcmp(e->d_name, "..") == 0)) continue;
+		char *path = config_path(e->d_name);
+		unlink(path);
+		free(path);
+	}
+	if (d != NULL) closedir(d);
+
+	rmdir(config_dir);
+	rmdir(dir);
+	free(config_dir);
+}
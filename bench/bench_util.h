@@ -0,0 +1,29 @@
+#ifndef __BENCH_UTIL__
+#define __BENCH_UTIL__
+
+#include <sqlite3.h>
+
+// What the benchmarks share: a clock, made up tags and a throwaway
+// configuration directory to build an index in.
+
+#define SYLLABLES 24
+
+extern const char *syllables[SYLLABLES];
+
+// Seconds on CLOCK_MONOTONIC
+double now(void);
+// Words of two to four syllables, a few common english ones among them,
+// capitalized
+void phrase(char *dst, int words);
+// Inserts n tunes, albums of ten tunes and artists of six albums, their tags
+// made by make_phrase (phrase if NULL), the filename of tune i is
+// file:///music/<i>.mp3
+void fill(sqlite3 *index_db, int n, void (*make_phrase)(char *dst, int words));
+
+// Points XDG_CONFIG_HOME to a new temporary directory with an empty
+// configuration directory in it
+void bench_config_start(void);
+// Removes the temporary directory and everything in it
+void bench_config_end(void);
+
+#endif
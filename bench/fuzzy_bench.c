@@ -0,0 +1,158 @@
+// Times the lookups of search --fuzzy as the library grows: misspelt words
+// of the library looked up by their trigrams, against reading every term of
+// the vocabulary, the least a scan comparing them all would do.
+//
+//    bench/fuzzy_bench [number of tunes...]
+//
+// Builds a throwaway index of each size (100000 and 500000 tunes by default)
+// with made up tags in a temporary configuration directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../util.h"
+#include "../stmt.h"
+#include "../fuzzy.h"
+#include "bench_util.h"
+
+#define LOOKUPS 200
+
+// The words of the tags are drawn from a vocabulary that grows with the
+// square root of the library, like the vocabulary of a real one does, the
+// first words far more often than the last
+static char **vocabulary;
+static int vocabulary_size;
+
+static void make_vocabulary(int n) {
+	vocabulary_size = 100 * sqrt(n);
+	vocabulary = malloc(vocabulary_size * sizeof(char *));
+	oomp(vocabulary);
+
+	for (int i = 0; i < vocabulary_size; ++i) {
+		char word[32] = "";
+		for (int s = 2 + rand() % 4; s > 0; --s) {
+			strcat(word, syllables[rand() % SYLLABLES]);
+		}
+		vocabulary[i] = strdup(word);
+		oomp(vocabulary[i]);
+	}
+}
+
+static void free_vocabulary(void) {
+	for (int i = 0; i < vocabulary_size; ++i) {
+		free(vocabulary[i]);
+	}
+	free(vocabulary);
+}
+
+static void vocabulary_phrase(char *dst, int words) {
+	*dst = '\0';
+	for (int i = 0; i < words; ++i) {
+		if (i > 0) strcat(dst, " ");
+		strcat(dst, vocabulary[rand() % (1 + rand() % vocabulary_size)]);
+	}
+	dst[0] = dst[0] - 'a' + 'A';
+}
+
+// random terms of the vocabulary with two adjacent letters swapped
+static char **misspelt(sqlite3 *index_db) {
+	char **words = malloc(LOOKUPS * sizeof(char *));
+	oomp(words);
+
+	sqlite3_stmt *select = stmt_get(index_db, "select term from fuzzy_term where len >= 5 order by random() limit ?");
+	if ((select == NULL) || (sqlite3_bind_int(select, 1, LOOKUPS) != SQLITE_OK)) {
+		fprintf(stderr, "Sqlite3 error picking words: %s\n", sqlite3_errmsg(index_db));
+		exit(EXIT_FAILURE);
+	}
+
+	int n = 0;
+	while ((n < LOOKUPS) && (sqlite3_step(select) == SQLITE_ROW)) {
+		char *w = strdup((const char *)sqlite3_column_text(select, 0));
+		oomp(w);
+		int i = 1 + rand() % (strlen(w) - 2);
+		char c = w[i];
+		w[i] = w[i+1];
+		w[i+1] = c;
+		words[n++] = w;
+	}
+	sqlite3_reset(select);
+
+	for (; n < LOOKUPS; ++n) {
+		words[n] = strdup("kalomine");
+		oomp(words[n]);
+	}
+	return words;
+}
+
+static void run(int n) {
+	bench_config_start();
+
+	sqlite3 *index_db = open_or_create_index_db();
+	make_vocabulary(n);
+	fill(index_db, n, vocabulary_phrase);
+	free_vocabulary();
+
+	double start = now();
+	sqlite3_exec(index_db, "BEGIN;", NULL, NULL, NULL);
+	fuzzy_refresh(index_db);
+	sqlite3_exec(index_db, "COMMIT;", NULL, NULL, NULL);
+	double refresh = now() - start;
+
+	int terms = 0;
+	sqlite3_stmt *count = stmt_get(index_db, "select count(*) from fuzzy_term");
+	if ((count != NULL) && (sqlite3_step(count) == SQLITE_ROW)) terms = sqlite3_column_int(count, 0);
+	sqlite3_reset(count);
+
+	printf("%d tunes, %d terms, fuzzy_refresh %.3f ms\n", n, terms, refresh * 1000);
+
+	char **words = misspelt(index_db);
+	GString *match = g_string_new(NULL), *found = g_string_new(NULL);
+
+	// twice, the first warms the page cache
+	for (int pass = 0; pass < 2; ++pass) {
+		double total = 0, worst = 0;
+		int corrected = 0;
+		for (int i = 0; i < LOOKUPS; ++i) {
+			g_string_truncate(match, 0);
+			g_string_truncate(found, 0);
+			start = now();
+			if (fuzzy_match(index_db, words[i], match, found) > 0) ++corrected;
+			double elapsed = now() - start;
+			total += elapsed;
+			if (elapsed > worst) worst = elapsed;
+		}
+		if (pass == 1) printf("  %-14s %8.3f ms per word, %8.3f ms at worst (%d of %d corrected)\n", "fuzzy_match", total * 1000 / LOOKUPS, worst * 1000, corrected, LOOKUPS);
+	}
+
+	sqlite3_stmt *scan = stmt_get(index_db, "select term from fidx_vocab");
+	start = now();
+	int scanned = 0;
+	while ((scan != NULL) && (sqlite3_step(scan) == SQLITE_ROW)) ++scanned;
+	sqlite3_reset(scan);
+	printf("  %-14s %8.3f ms per word (%d terms read)\n", "vocabulary", (now() - start) * 1000, scanned);
+
+	g_string_free(match, TRUE);
+	g_string_free(found, TRUE);
+	for (int i = 0; i < LOOKUPS; ++i) {
+		free(words[i]);
+	}
+	free(words);
+	close_db(index_db);
+
+	bench_config_end();
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			run(atoi(argv[i]));
+		}
+	} else {
+		run(100000);
+		run(500000);
+	}
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+// Times the keystrokes of minstrel find: every prefix of a few queries
+// looked up in the prefix index, against the fts prefix query of search.
+//
+//    bench/prefix_bench [number of tunes]
+//
+// Builds a throwaway index of that many tunes (500000 by default) with made
+// up tags in a temporary configuration directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "../util.h"
+#include "../stmt.h"
+#include "../prefix.h"
+#include "bench_util.h"
+
+#define RESULTS 50
+
+static const char *queries[] = { "love", "kalo mine", "beatles help", "tri sha", "zequi", "the night", "an el or" };
+
+// the first RESULTS tunes matching every word of query as a prefix, like
+// search artist:w* OR album:w* OR title:w* would
+static int fts_find(sqlite3 *index_db, const char *query) {
+	char *match = malloc(strlen(query) * 2 + 64);
+	oomp(match);
+	char *q = strdup(query);
+	oomp(q);
+
+	strcpy(match, "{artist album title} : (");
+	for (char *w = strtok(q, " "); w != NULL; w = strtok(NULL, " ")) {
+		strcat(match, w);
+		strcat(match, "* ");
+	}
+	strcat(match, ")");
+
+	sqlite3_stmt *select = stmt_get(index_db, "select tunes.id from fidx join tunes on tunes.id = fidx.rowid where fidx match ? order by sort_artist, sort_album, disc_no, track_no limit 50");
+	int n = 0;
+	if ((select != NULL) && (sqlite3_bind_text(select, 1, match, -1, SQLITE_TRANSIENT) == SQLITE_OK)) {
+		while (sqlite3_step(select) == SQLITE_ROW) ++n;
+		sqlite3_reset(select);
+	}
+
+	free(q);
+	free(match);
+	return n;
+}
+
+static void keystrokes(const char *name, sqlite3 *index_db, int (*find)(sqlite3 *index_db, const char *query)) {
+	double total = 0, worst = 0;
+	int strokes = 0;
+	char typed[64];
+
+	for (int i = 0; i < sizeof(queries)/sizeof(const char *); ++i) {
+		for (size_t len = 1; len <= strlen(queries[i]); ++len) {
+			if (queries[i][len-1] == ' ') continue;
+			memcpy(typed, queries[i], len);
+			typed[len] = '\0';
+
+			double start = now();
+			find(index_db, typed);
+			double elapsed = now() - start;
+
+			total += elapsed;
+			if (elapsed > worst) worst = elapsed;
+			++strokes;
+		}
+	}
+
+	printf("%-14s %8.3f ms per keystroke, %8.3f ms at worst (%d keystrokes)\n", name, total * 1000 / strokes, worst * 1000, strokes);
+}
+
+static int prefix_find_db(sqlite3 *index_db, const char *query) {
+	int64_t ids[RESULTS];
+	return prefix_find(query, ids, RESULTS);
+}
+
+int main(int argc, char *argv[]) {
+	int n = (argc > 1) ? atoi(argv[1]) : 500000;
+
+	bench_config_start();
+
+	sqlite3 *index_db = open_or_create_index_db();
+	fill(index_db, n, NULL);
+
+	double start = now();
+	prefix_init(index_db);
+	printf("prefix_init:   %8.3f ms\n", (now() - start) * 1000);
+
+	for (int i = 0; i < sizeof(queries)/sizeof(const char *); ++i) {
+		int64_t ids[RESULTS];
+		printf("  %-14s %d matches\n", queries[i], prefix_find(queries[i], ids, RESULTS));
+	}
+
+	// once to warm the page cache
+	keystrokes("fts", index_db, fts_find);
+	keystrokes("fts", index_db, fts_find);
+	keystrokes("prefix_find", index_db, prefix_find_db);
+
+	prefix_close();
+	close_db(index_db);
+
+	bench_config_end();
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+// Times round trips to the running player: connecting to its rpc socket,
+// sending a request and reading the whole answer.
+//
+//    bench/rpc_bench [round trips]
+//
+// Runs status, queue and a search for a word that isn't in the library,
+// 1000 times each by default, then reads the now playing page a thousand
+// times as often, what minstrel now does in place of status.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "../conn.h"
+#include "../now.h"
+#include "bench_util.h"
+
+static int double_compare(const void *a, const void *b) {
+	double da = *(const double *)a, db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+static void round_trips(const char *name, int64_t code, char *args[], int n, int count, FILE *sink) {
+	double *times = malloc(count * sizeof(double));
+	if (times == NULL) {
+		perror("Out of memory");
+		exit(EXIT_FAILURE);
+	}
+
+	double total = 0;
+	for (int i = 0; i < count; ++i) {
+		double start = now();
+
+		int fd = rpc_conn();
+		if (fd < 0) {
+			fprintf(stderr, "The player isn't running\n");
+			exit(EXIT_FAILURE);
+		}
+		if (!rpc_send_request(fd, code, args, n)) {
+			fprintf(stderr, "Couldn't send the request\n");
+			exit(EXIT_FAILURE);
+		}
+		rpc_relay(fd, sink, sink);
+		close(fd);
+
+		times[i] = now() - start;
+		total += times[i];
+	}
+
+	qsort(times, count, sizeof(double), double_compare);
+	printf("%-8s %8.3f ms mean, %8.3f ms median, %8.3f ms p99, %8.3f ms worst\n", name, total * 1000 / count, times[count / 2] * 1000, times[count * 99 / 100] * 1000, times[count - 1] * 1000);
+
+	free(times);
+}
+
+static void now_reads(int count) {
+	const struct now_page *page = now_map();
+	if (page == NULL) {
+		fprintf(stderr, "The player didn't publish a now playing page\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct now_page snapshot;
+	int failed = 0;
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		if (!now_read(page, &snapshot)) ++failed;
+	}
+	double total = now() - start;
+
+	printf("%-8s %8.3f us mean (%d of %d reads failed)\n", "now", total * 1e6 / count, failed, count);
+}
+
+int main(int argc, char *argv[]) {
+	int count = (argc > 1) ? atoi(argv[1]) : 1000;
+	if (count <= 0) count = 1000;
+
+	FILE *sink = fopen("/dev/null", "w");
+	if (sink == NULL) {
+		perror("/dev/null");
+		exit(EXIT_FAILURE);
+	}
+
+	char *search_args[] = { "zzzzzzzz" };
+
+	// a few first, to warm up the player's connections and statements
+	round_trips("warm-up", CMD_STATUS, NULL, 0, 10, sink);
+	round_trips("status", CMD_STATUS, NULL, 0, count, sink);
+	round_trips("queue", CMD_QUEUE, NULL, 0, count, sink);
+	round_trips("search", CMD_SEARCH, search_args, 1, count, sink);
+	now_reads(count * 1000);
+
+	fclose(sink);
+	return 0;
+}
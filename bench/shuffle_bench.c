@@ -0,0 +1,130 @@
+// Compares picking the next random tune with the shuffle bag against the
+// query it replaced, then measures the weighted mode.
+//
+//    bench/shuffle_bench [number of tunes]
+//
+// Builds a throwaway index of that many tunes (1000000 by default), one in
+// ten of them rated, in a temporary configuration directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "../util.h"
+#include "../stats.h"
+#include "../shuffle.h"
+#include "bench_util.h"
+
+#define QUERY_RUNS 20
+#define RATING_UPDATES 100000
+
+static void fill_ratings(int n) {
+	sqlite3_stmt *insert;
+	char filename[64];
+	int64_t now = time(NULL);
+
+	sqlite3_exec(rating_db, "BEGIN;", NULL, NULL, NULL);
+	if (sqlite3_prepare_v2(rating_db, "insert into rating(track_key, filename, listened, added, skipped, last_played) values (track_key(?1), ?1, ?2, ?3, ?4, ?5)", -1, &insert, NULL) != SQLITE_OK) goto fill_ratings_failure;
+
+	for (int i = 0; i < n; i += 10) {
+		snprintf(filename, sizeof(filename), "file:///music/%d.mp3", i);
+		if (sqlite3_reset(insert) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_bind_text(insert, 1, filename, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_bind_int(insert, 2, rand() % 50) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_bind_int(insert, 3, rand() % 5) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_bind_int(insert, 4, rand() % 5) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_bind_int64(insert, 5, now - rand() % (30 * 86400)) != SQLITE_OK) goto fill_ratings_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto fill_ratings_failure;
+	}
+
+	sqlite3_finalize(insert);
+	sqlite3_exec(rating_db, "COMMIT;", NULL, NULL, NULL);
+	return;
+
+fill_ratings_failure:
+
+	fprintf(stderr, "Sqlite3 error filling ratings: %s\n", sqlite3_errmsg(rating_db));
+	exit(EXIT_FAILURE);
+}
+
+static int64_t random_query(sqlite3 *index_db) {
+	sqlite3_stmt *random_id;
+	int64_t id = 0;
+
+	if (sqlite3_prepare_v2(index_db, "select id from tunes order by random() limit 1", -1, &random_id, NULL) != SQLITE_OK) return 0;
+	if (sqlite3_step(random_id) == SQLITE_ROW) id = sqlite3_column_int64(random_id, 0);
+	sqlite3_finalize(random_id);
+
+	return id;
+}
+
+int main(int argc, char *argv[]) {
+	int n = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	bench_config_start();
+
+	sqlite3 *index_db = open_or_create_index_db();
+	fill(index_db, n, NULL);
+
+	double start = now();
+	for (int i = 0; i < QUERY_RUNS; ++i) {
+		random_query(index_db);
+	}
+	printf("order by random() limit 1: %10.3f ms per pick\n", (now() - start) * 1000 / QUERY_RUNS);
+
+	start = now();
+	shuffle_init(index_db);
+	printf("shuffle_init:              %10.3f ms\n", (now() - start) * 1000);
+
+	// a whole round, no id can come up twice
+	int64_t max_id = n + 1;
+	char *picked = calloc(max_id + 1, 1);
+	oomp(picked);
+	int repeats = 0;
+
+	start = now();
+	for (int i = 0; i < n; ++i) {
+		int64_t id = shuffle_next(index_db);
+		if ((id <= max_id) && picked[id]++) ++repeats;
+	}
+	double elapsed = now() - start;
+	printf("shuffle_next:              %10.3f us per pick (%d picks, %d repeats)\n", elapsed * 1e6 / n, n, repeats);
+
+	shuffle_close();
+
+	rating_init();
+	fill_ratings(n);
+	stats_start(index_db);
+	setting_set(index_db, "shuffle", "weighted");
+
+	start = now();
+	shuffle_init(index_db);
+	printf("shuffle_init (weighted):   %10.3f ms\n", (now() - start) * 1000);
+
+	start = now();
+	for (int i = 0; i < n; ++i) {
+		shuffle_next(index_db);
+	}
+	elapsed = now() - start;
+	printf("shuffle_next (weighted):   %10.3f us per pick (%d picks)\n", elapsed * 1e6 / n, n);
+
+	// what happens when a tune is listened, added or skipped, rating lookups included
+	start = now();
+	for (int i = 0; i < RATING_UPDATES; ++i) {
+		shuffle_rating_changed(index_db, 1 + rand() % n);
+	}
+	elapsed = now() - start;
+	printf("shuffle_rating_changed:    %10.3f us per update (%d updates)\n", elapsed * 1e6 / RATING_UPDATES, RATING_UPDATES);
+
+	shuffle_close();
+	stats_stop();
+	close_db(rating_db);
+	close_db(index_db);
+	free(picked);
+
+	bench_config_end();
+
+	return 0;
+}
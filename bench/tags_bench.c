@@ -0,0 +1,132 @@
+// Compares the native tag readers in tags.c with libavformat.
+//
+//    bench/tags_bench <directory or file> ...
+//
+// Every file is read once by each path, single threaded. Bytes read are taken
+// from /proc/self/io so they include everything libavformat reads while
+// probing. Drop the page cache between runs to measure cold reads
+// (echo 3 > /proc/sys/vm/drop_caches).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <libavformat/avformat.h>
+
+#include "../tags.h"
+#include "../util.h"
+#include "bench_util.h"
+
+static const char *TAG_KEYS[] = { "album", "artist", "album_artist", "comment", "composer", "copyright", "date", "disc", "encoder", "genre", "performer", "publisher", "title", "track" };
+
+static char **files = NULL;
+static int nfiles = 0, files_size = 0;
+
+static void collect(const char *path) {
+	struct stat st;
+	if (stat(path, &st) != 0) return;
+
+	if (S_ISREG(st.st_mode)) {
+		if (nfiles >= files_size) {
+			files_size = (files_size == 0) ? 1024 : files_size * 2;
+			files = realloc(files, sizeof(char *) * files_size);
+			oomp(files);
+		}
+		files[nfiles] = strdup(path);
+		oomp(files[nfiles]);
+		++nfiles;
+		return;
+	}
+
+	if (!S_ISDIR(st.st_mode)) return;
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) return;
+
+	for (struct dirent *curent = readdir(dir); curent != NULL; curent = readdir(dir)) {
+		if (curent->d_name[0] == '.') continue;
+		char *sub;
+		asprintf(&sub, "%s/%s", path, curent->d_name);
+		oomp(sub);
+		collect(sub);
+		free(sub);
+	}
+
+	closedir(dir);
+}
+
+static int64_t rchar(void) {
+	FILE *f = fopen("/proc/self/io", "r");
+	if (f == NULL) return 0;
+
+	int64_t r = 0;
+	char line[128];
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (strstart(line, "rchar: ")) {
+			r = strtoll(line + strlen("rchar: "), NULL, 10);
+			break;
+		}
+	}
+
+	fclose(f);
+	return r;
+}
+
+static bool read_native(const char *filename) {
+	struct tags t;
+	bool r = tags_read(filename, &t, NULL);
+	tags_free(&t);
+	return r;
+}
+
+static bool read_avformat(const char *filename) {
+	AVFormatContext *fmt_ctx = NULL;
+	if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) != 0) return false;
+
+	// same lookups index_file does
+	for (int i = 0; i < sizeof(TAG_KEYS)/sizeof(const char *); ++i) {
+		av_dict_get(fmt_ctx->metadata, TAG_KEYS[i], NULL, 0);
+	}
+
+	avformat_close_input(&fmt_ctx);
+	return true;
+}
+
+static void run(const char *name, bool (*read_tags)(const char *)) {
+	int ok = 0;
+	int64_t start_bytes = rchar();
+	double start = now();
+
+	for (int i = 0; i < nfiles; ++i) {
+		if (read_tags(files[i])) ++ok;
+	}
+
+	double elapsed = now() - start;
+	int64_t bytes = rchar() - start_bytes;
+
+	printf("%-10s %6d files (%d read) in %.3fs, %.1f files/s, %.1f KiB read, %.1f KiB/file\n",
+		name, nfiles, ok, elapsed, (elapsed > 0) ? nfiles / elapsed : 0,
+		bytes / 1024.0, (nfiles > 0) ? bytes / 1024.0 / nfiles : 0);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s <directory or file> ...\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 1; i < argc; ++i) {
+		collect(argv[i]);
+	}
+
+	av_register_all();
+	av_log_set_level(AV_LOG_QUIET);
+
+	run("native", read_native);
+	run("avformat", read_avformat);
+
+	return 0;
+}
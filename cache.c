@@ -0,0 +1,177 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <glib.h>
+
+#include "util.h"
+#include "stmt.h"
+
+// an entry and its strings are a single allocation
+struct cache_entry {
+	struct tune tune;
+	struct cache_entry *newer, *older;
+	char strings[];
+};
+
+// at most this many ids in a query, old sqlite versions limit variables to 999
+#define CACHE_LOAD_MAX 512
+
+#define ID_KEY(id) ((gpointer)(intptr_t)(id))
+
+static sqlite3 *cache_db = NULL;
+// id -> struct cache_entry
+static GHashTable *entries = NULL;
+static struct cache_entry *newest = NULL, *oldest = NULL;
+
+static void entry_unlink(struct cache_entry *e) {
+	if (e->newer != NULL) e->newer->older = e->older; else newest = e->older;
+	if (e->older != NULL) e->older->newer = e->newer; else oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+static void entry_push(struct cache_entry *e) {
+	e->newer = NULL;
+	e->older = newest;
+	if (newest != NULL) newest->newer = e; else oldest = e;
+	newest = e;
+}
+
+static void entry_drop(struct cache_entry *e) {
+	entry_unlink(e);
+	g_hash_table_remove(entries, ID_KEY(e->tune.id));
+	free(e);
+}
+
+// copies column col of the current row of select to *dst, advancing it
+static const char *entry_string(sqlite3_stmt *select, int col, char **dst) {
+	const char *s = (const char *)sqlite3_column_text(select, col);
+	if (s == NULL) return NULL;
+	int len = sqlite3_column_bytes(select, col);
+	char *r = *dst;
+	memcpy(r, s, len);
+	r[len] = '\0';
+	*dst += len + 1;
+	return r;
+}
+
+// select returns id, album, artist, title, track, filename, track_key
+static void cache_insert(sqlite3_stmt *select) {
+	int64_t id = sqlite3_column_int64(select, 0);
+	if (g_hash_table_contains(entries, ID_KEY(id))) return;
+
+	size_t len = 0;
+	for (int col = 1; col <= 5; ++col) {
+		sqlite3_column_text(select, col);
+		len += sqlite3_column_bytes(select, col) + 1;
+	}
+
+	struct cache_entry *e = malloc(sizeof(struct cache_entry) + len);
+	oomp(e);
+
+	char *dst = e->strings;
+	e->tune.id = id;
+	e->tune.album = entry_string(select, 1, &dst);
+	e->tune.artist = entry_string(select, 2, &dst);
+	e->tune.title = entry_string(select, 3, &dst);
+	e->tune.track = entry_string(select, 4, &dst);
+	e->tune.filename = entry_string(select, 5, &dst);
+	e->tune.track_key = sqlite3_column_int64(select, 6);
+
+	g_hash_table_insert(entries, ID_KEY(id), e);
+	entry_push(e);
+
+	if (g_hash_table_size(entries) > CACHE_SIZE) entry_drop(oldest);
+}
+
+// The query is built for a power of two number of ids, padded repeating the
+// last one, so the registry holds at most ten of them
+static void cache_load_missing(const int64_t *ids, int n) {
+	int slots = 1;
+	while (slots < n) slots *= 2;
+
+	char *query = malloc(strlen("select id, album, artist, title, track, filename, track_key from tunes where id in ()") + 2 * slots + 1);
+	oomp(query);
+	char *p = stpcpy(query, "select id, album, artist, title, track, filename, track_key from tunes where id in (");
+	for (int i = 0; i < slots; ++i) {
+		if (i > 0) *p++ = ',';
+		*p++ = '?';
+	}
+	strcpy(p, ")");
+
+	sqlite3_stmt *select = stmt_get(cache_db, query);
+	free(query);
+	if (select == NULL) goto cache_load_failure;
+
+	for (int i = 0; i < slots; ++i) {
+		if (sqlite3_bind_int64(select, i + 1, ids[(i < n) ? i : n - 1]) != SQLITE_OK) goto cache_load_failure;
+	}
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		cache_insert(select);
+	}
+	if (r != SQLITE_DONE) goto cache_load_failure;
+
+	sqlite3_reset(select);
+	return;
+
+cache_load_failure:
+
+	fprintf(stderr, "Sqlite error loading tunes: %s\n", sqlite3_errmsg(cache_db));
+	exit(EXIT_FAILURE);
+}
+
+void cache_init(sqlite3 *index_db) {
+	cache_db = index_db;
+	entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+}
+
+void cache_load(const int64_t *ids, int n) {
+	int64_t missing[CACHE_LOAD_MAX];
+	int m = 0;
+
+	for (int i = 0; i < n; ++i) {
+		struct cache_entry *e = g_hash_table_lookup(entries, ID_KEY(ids[i]));
+		if (e != NULL) {
+			entry_unlink(e);
+			entry_push(e);
+			continue;
+		}
+
+		missing[m++] = ids[i];
+		if (m == CACHE_LOAD_MAX) {
+			cache_load_missing(missing, m);
+			m = 0;
+		}
+	}
+
+	if (m > 0) cache_load_missing(missing, m);
+}
+
+const struct tune *cache_get(int64_t id) {
+	struct cache_entry *e = g_hash_table_lookup(entries, ID_KEY(id));
+	if (e == NULL) {
+		cache_load_missing(&id, 1);
+		e = g_hash_table_lookup(entries, ID_KEY(id));
+		if (e == NULL) return NULL;
+	}
+
+	entry_unlink(e);
+	entry_push(e);
+	return &e->tune;
+}
+
+void cache_forget(int64_t id) {
+	struct cache_entry *e = g_hash_table_lookup(entries, ID_KEY(id));
+	if (e != NULL) entry_drop(e);
+}
+
+void cache_close(void) {
+	while (oldest != NULL) entry_drop(oldest);
+	g_hash_table_destroy(entries);
+	entries = NULL;
+	cache_db = NULL;
+}
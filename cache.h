@@ -0,0 +1,30 @@
+#ifndef __CACHE__
+#define __CACHE__
+
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+// The columns of a row of tunes the player shows, NULL if the tag is missing
+struct tune {
+	int64_t id;
+	const char *album, *artist, *title, *track;
+	const char *filename;
+	int64_t track_key;
+};
+
+// LRU cache of the last CACHE_SIZE tunes looked up. A tune returned by
+// cache_get stays valid until CACHE_SIZE other tunes are looked up or it is
+// forgotten.
+#define CACHE_SIZE 1024
+
+void cache_init(sqlite3 *index_db);
+// Loads the tunes among ids that aren't cached with one query
+void cache_load(const int64_t *ids, int n);
+// Returns NULL if id isn't in the index
+const struct tune *cache_get(int64_t id);
+// To be called when the row of id changed or was deleted
+void cache_forget(int64_t id);
+void cache_close(void);
+
+#endif
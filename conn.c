@@ -4,20 +4,25 @@
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdbool.h>
 
-static void setaddr(struct sockaddr_un *address) {
+// the largest request, the arguments of a command line
+#define RPC_REQUEST_MAX 65536
+
+static void setaddr(struct sockaddr_un *address, const char *suffix) {
 	bzero(address, sizeof(*address));
 
 	//printf("Size of path: %zd\n", sizeof(address.sun_path) / sizeof(char) - sizeof(char));
 	address->sun_family = AF_UNIX;
-	snprintf(address->sun_path, sizeof(address->sun_path) / sizeof(char) - sizeof(char), "/tmp/minstrel.%d", getuid());
+	snprintf(address->sun_path, sizeof(address->sun_path) / sizeof(char) - sizeof(char), "/tmp/minstrel.%d%s", getuid(), suffix);
 }
 
 int conn(void) {
 	struct sockaddr_un address;
-	setaddr(&address);
+	setaddr(&address, "");
 
 	int fd = socket(PF_UNIX, SOCK_DGRAM, 0);
 	if (fd < 0) {
@@ -25,6 +30,14 @@ int conn(void) {
 		exit(EXIT_FAILURE);
 	}
 
+	// an address for the acknowledgements of batches, binding to no name
+	// picks an unused abstract one
+	sa_family_t family = AF_UNIX;
+	if (bind(fd, (struct sockaddr *)&family, sizeof(family)) != 0) {
+		perror("Couldn't bind the control socket");
+		exit(EXIT_FAILURE);
+	}
+
 	if (connect(fd, (struct sockaddr *) &address, sizeof(struct sockaddr_un)) != 0) {
 		close(fd);
 		return -1;
@@ -32,7 +45,7 @@ int conn(void) {
 
 	// Handshake
 
-	int64_t hs[2] = { CMD_HANDSHAKE, 0 };
+	int64_t hs[COMMAND_WORDS] = { CMD_HANDSHAKE, 0, 0 };
 	int r = send(fd, (void *)hs, sizeof(hs), 0);
 	if (r != sizeof(hs)) {
 		fprintf(stderr, "Couldn't send handshake %d\n", r);
@@ -45,7 +58,7 @@ int conn(void) {
 
 int serve(void) {
 	struct sockaddr_un address;
-	setaddr(&address);
+	setaddr(&address, "");
 
 	unlink(address.sun_path);
 
@@ -63,15 +76,213 @@ int serve(void) {
 	return fd;
 }
 
-void conn_and_send(int64_t cmd[2]) {
+void conn_and_send(int64_t cmd[COMMAND_WORDS]) {
 	int fd = conn();
 	if (fd == -1) return;
-	send(fd, (void *)cmd, sizeof(int64_t)*2, 0);
+	send(fd, (void *)cmd, sizeof(int64_t)*COMMAND_WORDS, 0);
 	close(fd);
 }
 
-void send_add(int fd, int64_t idx) {
-	int64_t cmd[] = { CMD_ADD, idx };
+void send_command(int fd, int64_t code, int64_t arg1, int64_t arg2) {
+	int64_t cmd[COMMAND_WORDS] = { code, arg1, arg2 };
 	send(fd, (void *)cmd, sizeof(cmd), 0);
-	return;
+}
+
+void send_add(int fd, int64_t idx) {
+	send_command(fd, CMD_ADD, idx, 0);
+}
+
+bool send_batch(int fd, int64_t code, const int64_t *ids, int n) {
+	int64_t message[COMMAND_WORDS + BATCH_MAX] = { code, BATCH_VERSION, n };
+	memcpy(message + COMMAND_WORDS, ids, n * sizeof(int64_t));
+
+	size_t len = (COMMAND_WORDS + n) * sizeof(int64_t);
+	if (send(fd, (void *)message, len, 0) != (ssize_t)len) {
+		perror("Couldn't send to the player");
+		return false;
+	}
+
+	struct timeval timeout = { BATCH_ACK_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	int64_t ack;
+	if (recv(fd, &ack, sizeof(ack), 0) != sizeof(ack)) {
+		fprintf(stderr, "The player did not acknowledge the batch\n");
+		return false;
+	}
+	if (ack != n) {
+		fprintf(stderr, "The player refused the batch\n");
+		return false;
+	}
+	return true;
+}
+
+int rpc_conn(void) {
+	struct sockaddr_un address;
+	setaddr(&address, ".rpc");
+
+	int fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Couldn't create a unix domain socket\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (connect(fd, (struct sockaddr *) &address, sizeof(struct sockaddr_un)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int rpc_serve(void) {
+	struct sockaddr_un address;
+	setaddr(&address, ".rpc");
+
+	unlink(address.sun_path);
+
+	int fd = socket(PF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Couldn't create a unix domain socket\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if ((bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0) || (listen(fd, 16) != 0)) {
+		perror("Couldn't open rpc socket");
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+bool rpc_send_request(int fd, int64_t code, char *args[], int n) {
+	size_t len = sizeof(int64_t);
+	for (int i = 0; i < n; ++i) {
+		len += strlen(args[i]) + 1;
+	}
+	if (len > RPC_REQUEST_MAX) return false;
+
+	char *request = malloc(len);
+	if (request == NULL) return false;
+
+	memcpy(request, &code, sizeof(int64_t));
+	char *p = request + sizeof(int64_t);
+	for (int i = 0; i < n; ++i) {
+		p = stpcpy(p, args[i]) + 1;
+	}
+
+	ssize_t r = send(fd, request, len, MSG_NOSIGNAL);
+	free(request);
+	return r == (ssize_t)len;
+}
+
+char **rpc_recv_request(int fd, int64_t *code, int *n) {
+	char *request = malloc(RPC_REQUEST_MAX);
+	if (request == NULL) return NULL;
+
+	ssize_t len = recv(fd, request, RPC_REQUEST_MAX, MSG_TRUNC);
+	if ((len < (ssize_t)sizeof(int64_t)) || (len > RPC_REQUEST_MAX) || ((len > (ssize_t)sizeof(int64_t)) && (request[len-1] != '\0'))) {
+		free(request);
+		return NULL;
+	}
+
+	memcpy(code, request, sizeof(int64_t));
+	size_t strings_len = len - sizeof(int64_t);
+
+	*n = 0;
+	for (size_t i = 0; i < strings_len; ++i) {
+		if (request[sizeof(int64_t) + i] == '\0') ++*n;
+	}
+
+	// the pointers are followed by the strings they point to
+	char **args = malloc(sizeof(char *) * (*n + 1) + strings_len);
+	if (args != NULL) {
+		char *strings = (char *)(args + *n + 1);
+		memcpy(strings, request + sizeof(int64_t), strings_len);
+		for (int i = 0; i < *n; ++i) {
+			args[i] = strings;
+			strings += strlen(strings) + 1;
+		}
+		args[*n] = NULL;
+	}
+
+	free(request);
+	return args;
+}
+
+struct rpc_cookie {
+	int fd;
+	enum rpc_tag tag;
+};
+
+static ssize_t rpc_write(void *cookie, const char *buf, size_t size) {
+	struct rpc_cookie *c = cookie;
+	char packet[RPC_PACKET];
+	size_t done = 0;
+
+	while (done < size) {
+		size_t len = size - done;
+		if (len > RPC_PACKET - 1) len = RPC_PACKET - 1;
+
+		packet[0] = c->tag;
+		memcpy(packet + 1, buf + done, len);
+		// a client that went away mustn't kill the player with SIGPIPE
+		if (send(c->fd, packet, len + 1, MSG_NOSIGNAL) != (ssize_t)(len + 1)) {
+			return (done > 0) ? (ssize_t)done : -1;
+		}
+
+		done += len;
+	}
+
+	return done;
+}
+
+static int rpc_close(void *cookie) {
+	free(cookie);
+	return 0;
+}
+
+FILE *rpc_stream(int fd, enum rpc_tag tag) {
+	struct rpc_cookie *c = malloc(sizeof(struct rpc_cookie));
+	if (c == NULL) return NULL;
+	c->fd = fd;
+	c->tag = tag;
+
+	cookie_io_functions_t io = { NULL, rpc_write, NULL, rpc_close };
+	FILE *f = fopencookie(c, "w", io);
+	if (f == NULL) {
+		free(c);
+		return NULL;
+	}
+
+	// each flush of the buffer is a packet
+	setvbuf(f, NULL, _IOFBF, RPC_PACKET - 1);
+	return f;
+}
+
+void rpc_exit(int fd, int status) {
+	char packet[2] = { RPC_EXIT, status };
+	send(fd, packet, sizeof(packet), MSG_NOSIGNAL);
+}
+
+int rpc_relay(int fd, FILE *out, FILE *err) {
+	char packet[RPC_PACKET];
+	ssize_t len;
+
+	while ((len = recv(fd, packet, sizeof(packet), 0)) > 0) {
+		switch (packet[0]) {
+		case RPC_OUT:
+			fwrite(packet + 1, 1, len - 1, out);
+			break;
+		case RPC_ERR:
+			fflush(out);
+			fwrite(packet + 1, 1, len - 1, err);
+			break;
+		case RPC_EXIT:
+			return (len > 1) ? (unsigned char)packet[1] : EXIT_FAILURE;
+		}
+	}
+
+	fprintf(err, "The player closed the connection without answering\n");
+	return EXIT_FAILURE;
 }
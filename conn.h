@@ -2,12 +2,30 @@
 #define __CONN__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 int conn(void);
 int serve(void);
-void conn_and_send(int64_t cmd[2]);
+// commands are a code followed by two arguments
+#define COMMAND_WORDS 3
+
+void conn_and_send(int64_t cmd[COMMAND_WORDS]);
+void send_command(int fd, int64_t code, int64_t arg1, int64_t arg2);
 void send_add(int fd, int64_t idx);
 
+// A batch of ids is one datagram: the command words, the code, BATCH_VERSION
+// and the number of ids, followed by the ids. The player queues them all at
+// once and answers the sender with a single word, the number of ids queued
+// or -1 if it could not read the batch.
+#define BATCH_VERSION 1
+#define BATCH_MAX 4096
+#define BATCH_ACK_TIMEOUT 10
+
+// Waits for the acknowledgement, false if there is none or the player
+// refused the batch
+bool send_batch(int fd, int64_t code, const int64_t *ids, int n);
+
 enum command_code {
 	CMD_HANDSHAKE = 0,
 	CMD_PLAY_PAUSE = 10,
@@ -16,6 +34,44 @@ enum command_code {
 	CMD_PREV = 13,
 	CMD_REWIND = 14,
 	CMD_ADD = 20,
+	CMD_INSERT = 21, // insert an id after the current tune
+	CMD_REMOVE = 22, // remove the tune at a position
+	CMD_MOVE = 23, // move the tune at a position to another
+	CMD_ADD_BATCH = 24,
+	CMD_INSERT_BATCH = 25, // insert ids after the current tune, in their order
+	CMD_SEARCH = 30,
+	CMD_WHERE = 31,
+	CMD_MOST_ADDED = 32,
+	CMD_MOST_LISTENED = 33,
+	CMD_FIND = 34,
+	CMD_STATUS = 35,
+	CMD_QUEUE = 36,
+	CMD_WATCH = 37, // subscribes to the events of events.h
 };
 
+// Commands with an answer go through a second, SOCK_SEQPACKET, socket: the
+// request is one packet with a code followed by its arguments as NUL
+// terminated strings, the reply is packets of output each starting with the
+// stream it goes to and ends with an RPC_EXIT packet carrying the status.
+#define RPC_PACKET 4096
+
+enum rpc_tag {
+	RPC_OUT = 1,
+	RPC_ERR = 2,
+	RPC_EXIT = 3,
+};
+
+// Returns -1 if the player isn't running
+int rpc_conn(void);
+int rpc_serve(void);
+bool rpc_send_request(int fd, int64_t code, char *args[], int n);
+// Returns the arguments of the request, a single allocation to free, or
+// NULL if the client sent something else
+char **rpc_recv_request(int fd, int64_t *code, int *n);
+// A stream sending what is written to it as packets tagged with tag
+FILE *rpc_stream(int fd, enum rpc_tag tag);
+void rpc_exit(int fd, int status);
+// Copies the reply to out and err, returns its status
+int rpc_relay(int fd, FILE *out, FILE *err);
+
 #endif
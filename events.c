@@ -0,0 +1,215 @@
+#include "events.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "conn.h"
+
+struct subscriber {
+	int fd;
+	int tick_ms;
+	GIOChannel *channel;
+	GQueue pending; // packets not sent yet, as GStrings
+	size_t pending_bytes;
+	int64_t lost; // events dropped since the subscriber fell behind
+	guint gone_source_id, out_source_id, tick_source_id;
+};
+
+static GList *subscribers = NULL;
+static void (*events_snapshot)(GString *events) = NULL;
+static bool (*events_position)(GString *event) = NULL;
+// subscriptions handed to the main loop and not added yet
+static gint joining = 0;
+
+static void subscriber_free(struct subscriber *s) {
+	subscribers = g_list_remove(subscribers, s);
+
+	if (s->gone_source_id != 0) g_source_remove(s->gone_source_id);
+	if (s->out_source_id != 0) g_source_remove(s->out_source_id);
+	if (s->tick_source_id != 0) g_source_remove(s->tick_source_id);
+	g_io_channel_unref(s->channel);
+
+	GString *p;
+	while ((p = g_queue_pop_head(&s->pending)) != NULL) {
+		g_string_free(p, TRUE);
+	}
+
+	close(s->fd);
+	free(s);
+}
+
+// Makes a packet of each line of events, bounded drops them once the
+// subscriber has EVENTS_BUFFER bytes pending, and everything after until it
+// catches up
+static void subscriber_queue(struct subscriber *s, const char *events, bool bounded) {
+	const char *line = events;
+	while (*line != '\0') {
+		const char *end = strchr(line, '\n');
+		size_t len = (end != NULL) ? end + 1 - line : strlen(line);
+
+		if (bounded && ((s->lost > 0) || (s->pending_bytes + len + 1 > EVENTS_BUFFER))) {
+			++s->lost;
+		} else {
+			// a packet longer than the client reads would be cut anyway
+			size_t kept = (len < RPC_PACKET - 1) ? len : RPC_PACKET - 1;
+			GString *p = g_string_sized_new(kept + 1);
+			g_string_append_c(p, RPC_OUT);
+			g_string_append_len(p, line, kept);
+			if (kept < len) p->str[kept] = '\n';
+			g_queue_push_tail(&s->pending, p);
+			s->pending_bytes += p->len;
+		}
+
+		line += len;
+	}
+}
+
+static gboolean subscriber_writable(GIOChannel *source, GIOCondition condition, gpointer data);
+
+// Sends what is pending until the socket is full, then watches for room in
+// it. Returns false if the subscriber went away.
+static bool subscriber_send(struct subscriber *s) {
+	for (;;) {
+		GString *p;
+		while ((p = g_queue_peek_head(&s->pending)) != NULL) {
+			if (send(s->fd, p->str, p->len, MSG_NOSIGNAL) < 0) {
+				if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) return false;
+				if (s->out_source_id == 0) s->out_source_id = g_io_add_watch(s->channel, G_IO_OUT, subscriber_writable, s);
+				return true;
+			}
+			s->pending_bytes -= p->len;
+			g_string_free(g_queue_pop_head(&s->pending), TRUE);
+		}
+
+		if (s->lost == 0) break;
+
+		// caught up after dropping events, what they would have said
+		GString *events = g_string_new(NULL);
+		g_string_printf(events, "lost\t%" PRId64 "\n", s->lost);
+		events_snapshot(events);
+		s->lost = 0;
+		subscriber_queue(s, events->str, false);
+		g_string_free(events, TRUE);
+	}
+
+	if (s->out_source_id != 0) {
+		g_source_remove(s->out_source_id);
+		s->out_source_id = 0;
+	}
+	return true;
+}
+
+static gboolean subscriber_writable(GIOChannel *source, GIOCondition condition, gpointer data) {
+	struct subscriber *s = data;
+	// added again if the socket fills up
+	s->out_source_id = 0;
+	if (!subscriber_send(s)) subscriber_free(s);
+	return FALSE;
+}
+
+// the client sends nothing after its request, anything readable is the end
+// of the connection
+static gboolean subscriber_gone(GIOChannel *source, GIOCondition condition, gpointer data) {
+	struct subscriber *s = data;
+	s->gone_source_id = 0;
+	subscriber_free(s);
+	return FALSE;
+}
+
+static gboolean subscriber_tick(gpointer data) {
+	struct subscriber *s = data;
+
+	GString *event = g_string_new(NULL);
+	bool gone = false;
+	if (events_position(event)) {
+		subscriber_queue(s, event->str, true);
+		gone = !subscriber_send(s);
+	}
+	g_string_free(event, TRUE);
+
+	if (gone) {
+		s->tick_source_id = 0;
+		subscriber_free(s);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean subscriber_add(gpointer data) {
+	struct subscriber *s = data;
+
+	// neither the events nor the end of the subscription wait for the client
+	fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+	s->channel = g_io_channel_unix_new(s->fd);
+	s->gone_source_id = g_io_add_watch(s->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, subscriber_gone, s);
+	if (s->tick_ms > 0) s->tick_source_id = g_timeout_add(s->tick_ms, subscriber_tick, s);
+	subscribers = g_list_append(subscribers, s);
+
+	GString *events = g_string_new(NULL);
+	events_snapshot(events);
+	subscriber_queue(s, events->str, false);
+	g_string_free(events, TRUE);
+	if (!subscriber_send(s)) subscriber_free(s);
+
+	g_atomic_int_add(&joining, -1);
+	return G_SOURCE_REMOVE;
+}
+
+void events_start(void (*snapshot)(GString *events), bool (*position)(GString *event)) {
+	events_snapshot = snapshot;
+	events_position = position;
+}
+
+void events_stop(void) {
+	// the main loop has stopped, the subscriptions on their way to it need
+	// it to run
+	while (g_atomic_int_get(&joining) > 0) {
+		if (!g_main_context_iteration(NULL, FALSE)) g_usleep(1000);
+	}
+
+	while (subscribers != NULL) {
+		struct subscriber *s = subscribers->data;
+		rpc_exit(s->fd, EXIT_SUCCESS);
+		subscriber_free(s);
+	}
+}
+
+void events_subscribe(int fd, int tick_ms) {
+	struct subscriber *s = calloc(1, sizeof(struct subscriber));
+	oomp(s);
+	s->fd = fd;
+	s->tick_ms = tick_ms;
+	g_queue_init(&s->pending);
+
+	g_atomic_int_inc(&joining);
+	g_main_context_invoke(NULL, subscriber_add, s);
+}
+
+bool events_subscribed(void) {
+	return subscribers != NULL;
+}
+
+void events_emit(const char *events) {
+	GList *l = subscribers;
+	while (l != NULL) {
+		struct subscriber *s = l->data;
+		l = l->next;
+
+		subscriber_queue(s, events, true);
+		if (!subscriber_send(s)) subscriber_free(s);
+	}
+}
+
+void events_field(GString *event, const char *s) {
+	g_string_append_c(event, '\t');
+	for (; (s != NULL) && (*s != '\0'); ++s) {
+		g_string_append_c(event, ((*s == '\t') || (*s == '\n') || (*s == '\r')) ? ' ' : *s);
+	}
+}
@@ -0,0 +1,42 @@
+#ifndef __EVENTS__
+#define __EVENTS__
+
+#include <stdbool.h>
+#include <glib.h>
+
+// Clients subscribe with a CMD_WATCH request on the rpc socket and stay
+// connected, each event is an RPC_OUT packet holding a line of tab separated
+// fields, the name of the event first:
+//
+//    track <position> <id> <title> <artist> <album>
+//    state playing|paused|stopped
+//    queue <first> <current> <end>
+//    position <seconds> [<duration>]
+//    lost <events>
+//
+// A subscriber gets the track, state and queue of the player when it
+// subscribes, position every tick while playing if it asked for ticks. The
+// player never waits for a subscriber: the events one doesn't take at once
+// are kept for it, up to EVENTS_BUFFER bytes, past that they are dropped
+// and once it catches up it gets lost, with how many, then the track, state
+// and queue again.
+
+#define EVENTS_BUFFER 65536
+// shortest interval between ticks, in milliseconds
+#define EVENTS_TICK_MIN 100
+
+// snapshot appends the track, state and queue events of the player as it is,
+// position the position event and returns false when there is none to send
+void events_start(void (*snapshot)(GString *events), bool (*position)(GString *event));
+// Ends every subscription
+void events_stop(void);
+// Hands fd to the main loop, from any thread, tick_ms is 0 for no ticks
+void events_subscribe(int fd, int tick_ms);
+// False when nobody would get an event, not worth making one
+bool events_subscribed(void);
+// Sends each line of events to every subscriber, main loop only
+void events_emit(const char *events);
+// Appends \t and s, with the tabs and line breaks in it made spaces
+void events_field(GString *event, const char *s);
+
+#endif
@@ -0,0 +1,216 @@
+#include "fuzzy.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "util.h"
+#include "stmt.h"
+
+// the trigrams of the terms of table, each padded with a $ at both ends
+#define FUZZY_GRAMS(table) \
+	"WITH RECURSIVE g(term, len, i) AS (" \
+		"SELECT term, len, 1 FROM " table " " \
+		"UNION ALL SELECT term, len, i + 1 FROM g WHERE i < len" \
+	") SELECT substr('$' || term || '$', i, 3), len, term FROM g"
+
+struct fuzzy_candidate {
+	char *term;
+	int distance;
+};
+
+bool fuzzy_refresh(sqlite3 *index_db) {
+	// the vocabulary is read once into fuzzy_new and fuzzy_gone, numbers
+	// are left out
+	int r = sqlite3_exec(index_db,
+		"DROP TABLE IF EXISTS temp.fuzzy_gone; DROP TABLE IF EXISTS temp.fuzzy_new; "
+		"CREATE TEMP TABLE fuzzy_new AS SELECT term, length(term) AS len FROM fidx_vocab "
+			"WHERE length(term) >= " G_STRINGIFY(FUZZY_MIN_LEN) " AND term GLOB '*[^0-9]*'; "
+		"CREATE TEMP TABLE fuzzy_gone AS SELECT term, len FROM fuzzy_term WHERE term NOT IN (SELECT term FROM temp.fuzzy_new); "
+		"DELETE FROM temp.fuzzy_new WHERE term IN (SELECT term FROM fuzzy_term); "
+		"DELETE FROM fuzzy_trigram WHERE (gram, len, term) IN (" FUZZY_GRAMS("temp.fuzzy_gone") "); "
+		"DELETE FROM fuzzy_term WHERE term IN (SELECT term FROM temp.fuzzy_gone); "
+		"INSERT INTO fuzzy_term(term, len) SELECT term, len FROM temp.fuzzy_new; "
+		"INSERT OR IGNORE INTO fuzzy_trigram(gram, len, term) " FUZZY_GRAMS("temp.fuzzy_new") "; "
+		"DROP TABLE temp.fuzzy_gone; DROP TABLE temp.fuzzy_new;", NULL, NULL, NULL);
+	return r == SQLITE_OK;
+}
+
+// word lowered and without diacritics like unicode61 makes the terms of
+// fidx, NULL if it is not valid utf-8
+static gunichar *fuzzy_fold(const char *word, glong *len) {
+	if (!g_utf8_validate(word, -1, NULL)) return NULL;
+
+	char *lower = g_utf8_strdown(word, -1);
+	char *nfd = g_utf8_normalize(lower, -1, G_NORMALIZE_NFD);
+	g_free(lower);
+	if (nfd == NULL) return NULL;
+
+	gunichar *chars = g_utf8_to_ucs4_fast(nfd, -1, len);
+	g_free(nfd);
+
+	glong n = 0;
+	for (glong i = 0; i < *len; ++i) {
+		if (!g_unichar_ismark(chars[i])) chars[n++] = chars[i];
+	}
+	*len = n;
+	return chars;
+}
+
+// edit distance counting the swap of two adjacent letters as one edit, the
+// table is kept three rows at a time
+static int fuzzy_distance(const gunichar *a, glong n, const gunichar *b, glong m) {
+	int *rows = malloc(3 * (m + 1) * sizeof(int));
+	oomp(rows);
+	int *before = rows, *previous = rows + m + 1, *current = rows + 2 * (m + 1);
+
+	for (glong j = 0; j <= m; ++j) previous[j] = j;
+
+	for (glong i = 1; i <= n; ++i) {
+		current[0] = i;
+		for (glong j = 1; j <= m; ++j) {
+			int d = previous[j-1] + (a[i-1] != b[j-1]);
+			if (previous[j] + 1 < d) d = previous[j] + 1;
+			if (current[j-1] + 1 < d) d = current[j-1] + 1;
+			if ((i > 1) && (j > 1) && (a[i-1] == b[j-2]) && (a[i-2] == b[j-1]) && (before[j-2] + 1 < d)) d = before[j-2] + 1;
+			current[j] = d;
+		}
+
+		int *t = before;
+		before = previous;
+		previous = current;
+		current = t;
+	}
+
+	int d = previous[m];
+	free(rows);
+	return d;
+}
+
+// the distinct trigrams of chars padded with $, as a json array
+static char *fuzzy_grams(const gunichar *chars, glong len) {
+	gunichar *padded = malloc((len + 2) * sizeof(gunichar));
+	oomp(padded);
+	padded[0] = padded[len + 1] = '$';
+	memcpy(padded + 1, chars, len * sizeof(gunichar));
+
+	GString *json = g_string_new("[");
+	for (glong i = 0; i < len; ++i) {
+		bool seen = false;
+		for (glong j = 0; (j < i) && !seen; ++j) {
+			seen = memcmp(padded + i, padded + j, 3 * sizeof(gunichar)) == 0;
+		}
+		if (seen) continue;
+
+		if (json->len > 1) g_string_append_c(json, ',');
+		g_string_append_c(json, '"');
+		for (int k = 0; k < 3; ++k) {
+			if ((padded[i+k] == '"') || (padded[i+k] == '\\')) g_string_append_c(json, '\\');
+			g_string_append_unichar(json, padded[i+k]);
+		}
+		g_string_append_c(json, '"');
+	}
+	g_string_append_c(json, ']');
+
+	free(padded);
+	return g_string_free(json, FALSE);
+}
+
+// keeps the FUZZY_TERMS closest candidates sorted by distance then term
+static void fuzzy_keep(struct fuzzy_candidate *best, int *n, const char *term, int distance) {
+	int i = *n;
+	while ((i > 0) && ((best[i-1].distance > distance) || ((best[i-1].distance == distance) && (strcmp(best[i-1].term, term) > 0)))) --i;
+	if (i == FUZZY_TERMS) return;
+
+	if (*n == FUZZY_TERMS) {
+		free(best[FUZZY_TERMS-1].term);
+	} else {
+		++*n;
+	}
+	memmove(best + i + 1, best + i, (*n - i - 1) * sizeof(struct fuzzy_candidate));
+	best[i].term = strdup(term);
+	oomp(best[i].term);
+	best[i].distance = distance;
+}
+
+int fuzzy_match(sqlite3 *index_db, const char *word, GString *match, GString *terms) {
+	glong len;
+	gunichar *chars = fuzzy_fold(word, &len);
+	if ((chars == NULL) || (len == 0)) {
+		g_free(chars);
+		return 0;
+	}
+
+	// short words stand for themselves, any edit would make another word
+	int allowed = (len < 4) ? 0 : (len < 8) ? 1 : 2;
+	if (allowed == 0) {
+		char *folded = g_ucs4_to_utf8(chars, len, NULL, NULL, NULL);
+		g_string_append_printf(match, "\"%s\"", folded);
+		g_string_append(terms, folded);
+		g_free(folded);
+		g_free(chars);
+		return 1;
+	}
+
+	char *grams = fuzzy_grams(chars, len);
+	int ngrams = 0;
+	for (const char *p = grams; *p != '\0'; ++p) {
+		if (*p == ',') ++ngrams;
+	}
+	++ngrams;
+
+	struct fuzzy_candidate best[FUZZY_TERMS];
+	int n = 0;
+
+	// an edit changes at most three trigrams, a swap four
+	int shared = ngrams - 4 * allowed;
+	if (shared < 1) shared = 1;
+
+	sqlite3_stmt *select = stmt_get(index_db, "select term from fuzzy_trigram where gram in (select value from json_each(?1)) and len between ?2 and ?3 group by term having count(*) >= ?4");
+	if (select == NULL) goto fuzzy_match_failure;
+	if (sqlite3_bind_text(select, 1, grams, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto fuzzy_match_failure;
+	if (sqlite3_bind_int(select, 2, len - allowed) != SQLITE_OK) goto fuzzy_match_failure;
+	if (sqlite3_bind_int(select, 3, len + allowed) != SQLITE_OK) goto fuzzy_match_failure;
+	if (sqlite3_bind_int(select, 4, shared) != SQLITE_OK) goto fuzzy_match_failure;
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		const char *term = (const char *)sqlite3_column_text(select, 0);
+		glong term_len;
+		gunichar *term_chars = g_utf8_to_ucs4_fast(term, -1, &term_len);
+		int distance = fuzzy_distance(chars, len, term_chars, term_len);
+		g_free(term_chars);
+
+		if (distance <= allowed) fuzzy_keep(best, &n, term, distance);
+	}
+	sqlite3_reset(select);
+	if (r != SQLITE_DONE) goto fuzzy_match_failure;
+
+	// the closest terms only, a word that is in the library stands for itself
+	while ((n > 1) && (best[n-1].distance > best[0].distance)) free(best[--n].term);
+
+	if (n > 1) g_string_append_c(match, '(');
+	for (int i = 0; i < n; ++i) {
+		if (i > 0) {
+			g_string_append(match, " OR ");
+			g_string_append_c(terms, ' ');
+		}
+		g_string_append_printf(match, "\"%s\"", best[i].term);
+		g_string_append(terms, best[i].term);
+		free(best[i].term);
+	}
+	if (n > 1) g_string_append_c(match, ')');
+
+	g_free(grams);
+	g_free(chars);
+	return n;
+
+fuzzy_match_failure:
+
+	for (int i = 0; i < n; ++i) {
+		free(best[i].term);
+	}
+	g_free(grams);
+	g_free(chars);
+	return -1;
+}
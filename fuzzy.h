@@ -0,0 +1,32 @@
+#ifndef __FUZZY__
+#define __FUZZY__
+
+#include <stdbool.h>
+
+#include <sqlite3.h>
+#include <glib.h>
+
+// Typo tolerant search. The distinct terms of fidx, as fidx_vocab lists them
+// (lowered, without diacritics), are indexed by their trigrams in
+// fuzzy_trigram, with a $ added at each end of the term. A word of a query
+// stands for the terms sharing enough trigrams with it to be within the
+// edit distance allowed for its length, one edit in words of 4 to 7 letters,
+// two in longer ones, and of those the closest ones.
+//
+// A lookup reads the trigrams of the word among the terms of about the same
+// length, it grows with the vocabulary and not with the number of tunes.
+
+// terms shorter than this have no trigrams, they only match exactly
+#define FUZZY_MIN_LEN 3
+// a word stands for at most this many terms, the closest
+#define FUZZY_TERMS 8
+
+// Brings fuzzy_term and fuzzy_trigram up to date with the terms of fidx, in
+// the caller's transaction. Returns false on sqlite errors.
+bool fuzzy_refresh(sqlite3 *index_db);
+// Appends to match an fts5 query for the terms close to word, as ("term" OR
+// "term" ...), and the terms to terms, separated by spaces. Returns how many
+// there are, appending nothing if none, or -1 on sqlite errors.
+int fuzzy_match(sqlite3 *index_db, const char *word, GString *match, GString *terms);
+
+#endif
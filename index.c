@@ -1,50 +1,57 @@
 #include "index.h"
 
-#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <strings.h>
 #include <libavformat/avformat.h>
 #include <glib.h>
 
 #include "util.h"
+#include "stmt.h"
+#include "tags.h"
+#include "walk.h"
+#include "fuzzy.h"
 
-const char *KNOWN_AUDIO_EXTENSIONS[] = { "aif", "aiff", "m4a", "mid", "mp3", "mpa", "ra", "wav", "wma", "aac", "mp4", "m4p", "m4r", "3gp", "ogg", "oga", "au", "3ga", "aifc", "aifr", "alac", "caf", "caff", "opus" };
+// sorted, should_autoindex_file does a binary search
+static const char *KNOWN_AUDIO_EXTENSIONS[] = { "3ga", "3gp", "aac", "aif", "aifc", "aiff", "aifr", "alac", "au", "caf", "caff", "flac", "m4a", "m4p", "m4r", "mid", "mp3", "mp4", "mpa", "oga", "ogg", "opus", "ra", "wav", "wma" };
+
+static int extension_compare(const void *ext, const void *known) {
+	return strcasecmp(ext, *(const char **)known);
+}
 
 static bool should_autoindex_file(const char *full_file_name) {
-	char *dot = strrchr(full_file_name, '.');
+	const char *dot = strrchr(full_file_name, '.');
 	if (dot == NULL) return false;
 
-	char *ext = strdup(dot+1);
-	oomp(ext);
-
-	for (char *c = ext; *c != '\0'; ++c) {
-		*c = tolower(*c);
-	}
-
-	//printf("Checking extension: %s\n", ext);
-
-	bool r = false;
-
-	for (int i = 0; i < sizeof(KNOWN_AUDIO_EXTENSIONS)/sizeof(const char *); ++i) {
-		if (strcmp(KNOWN_AUDIO_EXTENSIONS[i], ext) == 0) {
-			r = true;
-			break;
-		}
-	}
-
-	free(ext);
-	return r;
+	return bsearch(dot+1, KNOWN_AUDIO_EXTENSIONS, sizeof(KNOWN_AUDIO_EXTENSIONS)/sizeof(const char *), sizeof(const char *), extension_compare) != NULL;
 }
 
+// fidx follows tunes through triggers
 typedef struct _insert_statements {
 	sqlite3_stmt *insert;
-	sqlite3_stmt *rinsert;
-	sqlite3_stmt *check;
 } insert_statements;
 
-static void index_file_ex(sqlite3 *index_db, insert_statements s, const char *filename,
+// stat data used to decide whether a file changed since it was indexed
+struct file_stamp {
+	int64_t mtime; // nanoseconds
+	int64_t size;
+	int64_t inode;
+};
+
+static void file_stamp_from_stat(struct file_stamp *stamp, const struct stat *st) {
+	stamp->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	stamp->size = st->st_size;
+	stamp->inode = st->st_ino;
+}
+
+// id is the row to replace, or 0 to add a new row, returns the id of the row written
+static int64_t index_file_ex(sqlite3 *index_db, insert_statements s, const char *fileuri,
+		int64_t id, const struct file_stamp *stamp,
 		const char *album, const char *artist, const char *album_artist,
 		const char *comment, const char *composer, const char *copyright,
 		const char *date, const char *disc, const char *encoder,
@@ -52,54 +59,41 @@ static void index_file_ex(sqlite3 *index_db, insert_statements s, const char *fi
 		const char *title, const char *track) {
 
 	if (sqlite3_reset(s.insert) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_reset(s.rinsert) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_reset(s.check) != SQLITE_OK) goto index_file_ex_failure;
-	
-	GError *error = NULL;
-	char *fileuri = g_filename_to_uri(filename, NULL, &error);
-	if (fileuri == NULL) {
-		fprintf(stderr, "Error converting filename [%s] into uri: %s\n", filename, error->message);
-		g_error_free(error);
-		exit(EXIT_FAILURE);
-	}
-	
-	if (sqlite3_bind_text(s.check, 1, fileuri, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	
-	if (sqlite3_step(s.check) != SQLITE_DONE) {
-		return;
-	}
-
-	if (sqlite3_bind_text(s.insert, 1, album, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 2, artist, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 3, album_artist, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 4, comment, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 5, composer, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 6, copyright, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 7, date, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 8, disc, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 9, encoder, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 10, genre, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 11, performer, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 12, publisher, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 13, title, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.insert, 14, track, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-
-	if (sqlite3_bind_text(s.insert, 15, fileuri, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
 
-	if (sqlite3_step(s.insert) != SQLITE_DONE) goto index_file_ex_failure;
-	g_free(fileuri);
+	if (id != 0) {
+		if (sqlite3_bind_int64(s.insert, 1, id) != SQLITE_OK) goto index_file_ex_failure;
+	} else {
+		if (sqlite3_bind_null(s.insert, 1) != SQLITE_OK) goto index_file_ex_failure;
+	}
 
-	char *text;
-	asprintf(&text, "%s %s %s %s %s %s %s %s %s %s %s %s %s", album, artist, album_artist, comment, composer, copyright, date, disc, encoder, performer, publisher, title, track);
-	oomp(text);
+	if (sqlite3_bind_text(s.insert, 2, album, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 3, artist, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 4, album_artist, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 5, comment, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 6, composer, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 7, copyright, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 8, date, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 9, disc, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 10, encoder, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 11, genre, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 12, performer, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 13, publisher, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 14, title, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_text(s.insert, 15, track, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+
+	if (sqlite3_bind_text(s.insert, 16, fileuri, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
+
+	if (sqlite3_bind_int64(s.insert, 17, stamp->mtime) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_int64(s.insert, 18, stamp->size) != SQLITE_OK) goto index_file_ex_failure;
+	if (sqlite3_bind_int64(s.insert, 19, stamp->inode) != SQLITE_OK) goto index_file_ex_failure;
 
-	if (sqlite3_bind_int64(s.rinsert, 1, sqlite3_last_insert_rowid(index_db)) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_bind_text(s.rinsert, 2, text, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_file_ex_failure;
-	if (sqlite3_step(s.rinsert) != SQLITE_DONE) goto index_file_ex_failure;
+	if (sqlite3_step(s.insert) != SQLITE_DONE) goto index_file_ex_failure;
 
-	free(text);
+	if (id == 0) {
+		id = sqlite3_last_insert_rowid(index_db);
+	}
 
-	return;
+	return id;
 
 index_file_ex_failure:
 
@@ -107,155 +101,863 @@ index_file_ex_failure:
 	exit(EXIT_FAILURE);
 }
 
-static void index_file(sqlite3 *index_db, insert_statements s, const char *filename) {
+#define INDEX_QUEUE_LENGTH 1024
+#define INDEX_BATCH 4096
+
+// a bounded queue between the directory walker, the probing workers and the writer
+struct job_queue {
+	GMutex mutex;
+	GCond not_empty;
+	GCond not_full;
+	void **items;
+	int size, head, len;
+};
+
+// pushed once per worker to tell its consumer that no more items will come
+static char end_of_jobs;
+
+static void job_queue_init(struct job_queue *q, int size) {
+	g_mutex_init(&q->mutex);
+	g_cond_init(&q->not_empty);
+	g_cond_init(&q->not_full);
+	q->items = malloc(sizeof(void *) * size);
+	oomp(q->items);
+	q->size = size;
+	q->head = 0;
+	q->len = 0;
+}
+
+static void job_queue_free(struct job_queue *q) {
+	free(q->items);
+	g_cond_clear(&q->not_full);
+	g_cond_clear(&q->not_empty);
+	g_mutex_clear(&q->mutex);
+}
+
+static void job_queue_push(struct job_queue *q, void *item) {
+	g_mutex_lock(&q->mutex);
+	while (q->len >= q->size) g_cond_wait(&q->not_full, &q->mutex);
+	q->items[(q->head + q->len) % q->size] = item;
+	++q->len;
+	g_cond_signal(&q->not_empty);
+	g_mutex_unlock(&q->mutex);
+}
+
+static void *job_queue_pop(struct job_queue *q) {
+	g_mutex_lock(&q->mutex);
+	while (q->len <= 0) g_cond_wait(&q->not_empty, &q->mutex);
+	void *item = q->items[q->head];
+	q->head = (q->head + 1) % q->size;
+	--q->len;
+	g_cond_signal(&q->not_full);
+	g_mutex_unlock(&q->mutex);
+	return item;
+}
+
+// a file to index: created by the walker, filled with tags by a worker thread and
+// written by the writer thread
+struct index_job {
+	char *filename;
+	char *fileuri;
+	int64_t id;
+	struct file_stamp stamp;
+	struct tags tags;
+};
+
+// a row of tunes as it was before this run started
+struct known_file {
+	int64_t id;
+	struct file_stamp stamp;
+	bool seen;
+};
+
+struct indexer {
+	sqlite3 *index_db;
+	insert_statements s;
+	sqlite3_stmt *lookup; // finds a single file when known wasn't loaded in advance
+	struct job_queue paths; // files from the walker to the workers
+	struct job_queue jobs; // extracted tags from the workers to the writer
+	int nworkers;
+	GThread *writer;
+	GThread **workers;
+	bool update;
+	GHashTable *known; // file uri -> struct known_file
+	struct index_changes *changes; // if not NULL the writer records the ids it wrote here
+	int indexed;
+	int unchanged;
+	int walked; // files the walk found
+	GPtrArray *failed; // uris of the paths the walk couldn't read
+};
+
+static void index_changes_add(struct index_changes *changes, int64_t id, enum index_change_kind kind) {
+	if (changes->n >= changes->size) {
+		changes->size = (changes->size > 0) ? changes->size * 2 : 64;
+		changes->v = realloc(changes->v, sizeof(struct index_change) * changes->size);
+		oomp(changes->v);
+	}
+	changes->v[changes->n].id = id;
+	changes->v[changes->n].kind = kind;
+	++changes->n;
+}
+
+void index_changes_free(struct index_changes *changes) {
+	free(changes->v);
+	changes->v = NULL;
+	changes->n = changes->size = 0;
+}
+
+static char *strdup_or_null(const char *s) {
+	if (s == NULL) return NULL;
+	char *r = strdup(s);
+	oomp(r);
+	return r;
+}
+
+static void index_job_free(struct index_job *job) {
+	free(job->filename);
+	g_free(job->fileuri);
+	tags_free(&job->tags);
+	free(job);
+}
+
+static bool index_file_avformat(const char *filename, struct tags *t) {
 	AVFormatContext *fmt_ctx = NULL;
 	
 	int averr = avformat_open_input(&fmt_ctx, filename, NULL, NULL);
 
 	if (averr) {
 		fprintf(stderr, "Failed to open %s: %x\n", filename, (unsigned int)averr);
-		exit(EXIT_FAILURE);
+		return false;
 	}
 
 	//ff_metadata_conv(fmt_ctx, NULL, fmt_ctx->iformat->metadata_conv);
 
-	const char *album = tag_get(fmt_ctx, "album");
-	const char *artist = tag_get(fmt_ctx, "artist");
-	const char *album_artist = tag_get(fmt_ctx, "album_artist");
-	const char *comment = tag_get(fmt_ctx, "comment");
-	const char *composer = tag_get(fmt_ctx, "composer");
-	const char *copyright = tag_get(fmt_ctx, "copyright");
-	const char *date = tag_get(fmt_ctx, "date");
-	const char *disc = tag_get(fmt_ctx, "disc");
-	const char *encoder = tag_get(fmt_ctx, "encoder");
-	const char *genre = tag_get(fmt_ctx, "genre");
-	const char *performer = tag_get(fmt_ctx, "performer");
-	const char *publisher = tag_get(fmt_ctx, "publisher");
-	const char *title = tag_get(fmt_ctx, "title");
-	const char *track = tag_get(fmt_ctx, "track");
-
-	if (artist == NULL) artist = album_artist;
-	if (artist == NULL) artist = composer;
-	if (artist == NULL) artist = copyright;
-	if (artist == NULL) artist = performer;
-	if (artist == NULL) artist = publisher;
-
-	if (title == NULL) {
+	t->album = strdup_or_null(tag_get(fmt_ctx, "album"));
+	t->artist = strdup_or_null(tag_get(fmt_ctx, "artist"));
+	t->album_artist = strdup_or_null(tag_get(fmt_ctx, "album_artist"));
+	t->comment = strdup_or_null(tag_get(fmt_ctx, "comment"));
+	t->composer = strdup_or_null(tag_get(fmt_ctx, "composer"));
+	t->copyright = strdup_or_null(tag_get(fmt_ctx, "copyright"));
+	t->date = strdup_or_null(tag_get(fmt_ctx, "date"));
+	t->disc = strdup_or_null(tag_get(fmt_ctx, "disc"));
+	t->encoder = strdup_or_null(tag_get(fmt_ctx, "encoder"));
+	t->genre = strdup_or_null(tag_get(fmt_ctx, "genre"));
+	t->performer = strdup_or_null(tag_get(fmt_ctx, "performer"));
+	t->publisher = strdup_or_null(tag_get(fmt_ctx, "publisher"));
+	t->title = strdup_or_null(tag_get(fmt_ctx, "title"));
+	t->track = strdup_or_null(tag_get(fmt_ctx, "track"));
+
+	avformat_close_input(&fmt_ctx);
+
+	return true;
+}
+
+static bool index_file(struct index_job *job) {
+	const char *filename = job->filename;
+	struct tags *t = &job->tags;
+
+	// the native readers only look at the tag blocks, libavformat probes the whole container
+	if (!tags_read(filename, t, NULL) && !index_file_avformat(filename, t)) {
+		return false;
+	}
+
+	tags_trim(t);
+
+	if (t->artist == NULL) t->artist = strdup_or_null(t->album_artist);
+	if (t->artist == NULL) t->artist = strdup_or_null(t->composer);
+	if (t->artist == NULL) t->artist = strdup_or_null(t->copyright);
+	if (t->artist == NULL) t->artist = strdup_or_null(t->performer);
+	if (t->artist == NULL) t->artist = strdup_or_null(t->publisher);
+
+	if (t->title == NULL) {
 		char *slash = strrchr(filename, '/');
 		if (slash != NULL) {
-			title = slash+1;
+			t->title = strdup_or_null(slash+1);
 		}
 	}
 
 #ifdef SPAM_DURING_INDEX
 	printf("FILE %s:\n", filename);
-	printf("   album: %s\n", album);
-	printf("   artist: %s\n", artist);
-	printf("   album_artist: %s\n", album_artist);
-	printf("   comment: %s\n", comment);
-	printf("   composer: %s\n", composer);
-	printf("   copyright: %s\n", copyright);
-	printf("   date: %s\n", date);
-	printf("   disc: %s\n", disc);
-	printf("   encoder: %s\n", encoder);
-	printf("   genre: %s\n", genre);
-	printf("   performer: %s\n", performer);
-	printf("   publisher: %s\n", publisher);
-	printf("   title: %s\n", title);
-	printf("   track: %s\n", track);
+	printf("   album: %s\n", t->album);
+	printf("   artist: %s\n", t->artist);
+	printf("   album_artist: %s\n", t->album_artist);
+	printf("   comment: %s\n", t->comment);
+	printf("   composer: %s\n", t->composer);
+	printf("   copyright: %s\n", t->copyright);
+	printf("   date: %s\n", t->date);
+	printf("   disc: %s\n", t->disc);
+	printf("   encoder: %s\n", t->encoder);
+	printf("   genre: %s\n", t->genre);
+	printf("   performer: %s\n", t->performer);
+	printf("   publisher: %s\n", t->publisher);
+	printf("   title: %s\n", t->title);
+	printf("   track: %s\n", t->track);
 #endif
 
-	index_file_ex(index_db, s, filename,
-		album, artist, album_artist,
-		comment, composer, copyright,
-		date, disc, encoder,
-		genre, performer, publisher,
-		title, track);
+	return true;
+}
 
-	avformat_close_input(&fmt_ctx);
+static gpointer index_worker(gpointer data) {
+	struct indexer *ix = data;
+
+	for (;;) {
+		struct index_job *job = job_queue_pop(&ix->paths);
+		if (job == (struct index_job *)&end_of_jobs) break;
+
+		if (index_file(job)) {
+			job_queue_push(&ix->jobs, job);
+		} else {
+			index_job_free(job);
+		}
+	}
+
+	job_queue_push(&ix->jobs, &end_of_jobs);
+	return NULL;
 }
 
-static void index_directory(sqlite3 *index_db, insert_statements s, char *dir_name) {
-	DIR *dir = opendir(dir_name);
-	if (dir == NULL) {
-		fprintf(stderr, "Can not index %s, can not open directory\n", dir_name);
-		return;
+static void index_exec(sqlite3 *index_db, const char *sql) {
+	char *errmsg = NULL;
+	sqlite3_exec(index_db, sql, NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		fprintf(stderr, "Sqlite3 error in index writer: %s\n", errmsg);
+		exit(EXIT_FAILURE);
 	}
+}
 
-	for (struct dirent *curent = readdir(dir); curent != NULL; curent = readdir(dir)) {
-		if (curent->d_name[0] == '.') continue;
-		if (curent->d_type == DT_DIR) {
-			char *new_dir_name;
-			asprintf(&new_dir_name, "%s/%s", dir_name, curent->d_name);
-			oomp(new_dir_name);
-			index_directory(index_db, s, new_dir_name);
-			free(new_dir_name);
-		} else if (curent->d_type == DT_REG) {
-			char *full_file_name;
+// the trigrams of new terms for fuzzy search, the ones of vanished terms removed
+static void index_refresh_fuzzy(sqlite3 *index_db) {
+	index_exec(index_db, "BEGIN;");
+	if (!fuzzy_refresh(index_db)) {
+		fprintf(stderr, "Sqlite3 error refreshing fuzzy search: %s\n", sqlite3_errmsg(index_db));
+		exit(EXIT_FAILURE);
+	}
+	index_exec(index_db, "COMMIT;");
+}
 
-			asprintf(&full_file_name, "%s/%s", dir_name, curent->d_name);
-			oomp(full_file_name);
+static gpointer index_writer(gpointer data) {
+	struct indexer *ix = data;
+	int finished_workers = 0;
+	int batch = 0;
 
-			if (should_autoindex_file(full_file_name)) {
-				index_file(index_db, s, full_file_name);
-			} else {
-				fprintf(stderr, "Didn't add %s to index, add manually if desired\n", full_file_name);
-			}
+	index_exec(ix->index_db, "BEGIN;");
+
+	while (finished_workers < ix->nworkers) {
+		struct index_job *job = job_queue_pop(&ix->jobs);
+		if (job == (struct index_job *)&end_of_jobs) {
+			++finished_workers;
+			continue;
+		}
+
+		int64_t id = index_file_ex(ix->index_db, ix->s, job->fileuri,
+			job->id, &job->stamp,
+			job->tags.album, job->tags.artist, job->tags.album_artist,
+			job->tags.comment, job->tags.composer, job->tags.copyright,
+			job->tags.date, job->tags.disc, job->tags.encoder,
+			job->tags.genre, job->tags.performer, job->tags.publisher,
+			job->tags.title, job->tags.track);
 
-			free(full_file_name);
+		if (ix->changes != NULL) {
+			index_changes_add(ix->changes, id, (job->id != 0) ? INDEX_UPDATED : INDEX_ADDED);
+		}
+
+		index_job_free(job);
+		++ix->indexed;
+
+		if (++batch >= INDEX_BATCH) {
+			index_exec(ix->index_db, "COMMIT; BEGIN;");
+			batch = 0;
 		}
-		// things that are not regular files or directories are ignored
 	}
 
-	closedir(dir);
+	index_exec(ix->index_db, "COMMIT;");
+
+	return NULL;
 }
 
-void index_command(char *dirs[], int dircount) {
-	sqlite3 *index_db = open_or_create_index_db();
+static char *index_uri(const char *filename) {
+	GError *error = NULL;
+	char *fileuri = g_filename_to_uri(filename, NULL, &error);
+	if (fileuri == NULL) {
+		fprintf(stderr, "Error converting filename [%s] into uri: %s\n", filename, error->message);
+		g_error_free(error);
+		exit(EXIT_FAILURE);
+	}
+	return fileuri;
+}
 
-	av_register_all();
+static void known_file_from_row(struct known_file *known, sqlite3_stmt *select, int col) {
+	known->id = sqlite3_column_int64(select, col);
+	// rows indexed before stat data was recorded have NULLs here and never match
+	known->stamp.mtime = (sqlite3_column_type(select, col+1) == SQLITE_NULL) ? -1 : sqlite3_column_int64(select, col+1);
+	known->stamp.size = (sqlite3_column_type(select, col+2) == SQLITE_NULL) ? -1 : sqlite3_column_int64(select, col+2);
+	known->stamp.inode = (sqlite3_column_type(select, col+3) == SQLITE_NULL) ? -1 : sqlite3_column_int64(select, col+3);
+	known->seen = false;
+}
 
-	sqlite3_stmt *insert = NULL, *rinsert = NULL, *check = NULL;
+static struct known_file *index_lookup(struct indexer *ix, const char *fileuri) {
+	if (sqlite3_reset(ix->lookup) != SQLITE_OK) goto index_lookup_failure;
+	if (sqlite3_bind_text(ix->lookup, 1, fileuri, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_lookup_failure;
 
-	int r = sqlite3_prepare_v2(index_db, "insert into tunes(album, artist, album_artist, comment, composer, copyright, date, disc, encoder, genre, performer, publisher, title, track, filename) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &insert, NULL);
-	if (r != SQLITE_OK) {
-		fprintf(stderr, "Sqlite3 error preparing insert statement: %s\n", sqlite3_errmsg(index_db));
-		exit(EXIT_FAILURE);
+	int r = sqlite3_step(ix->lookup);
+	if (r == SQLITE_DONE) return NULL;
+	if (r != SQLITE_ROW) goto index_lookup_failure;
+
+	struct known_file *known = malloc(sizeof(struct known_file));
+	oomp(known);
+	known_file_from_row(known, ix->lookup, 0);
+	g_hash_table_insert(ix->known, g_strdup(fileuri), known);
+
+	return known;
+
+index_lookup_failure:
+
+	fprintf(stderr, "Sqlite3 error looking up %s: %s\n", fileuri, sqlite3_errmsg(ix->index_db));
+	exit(EXIT_FAILURE);
+}
+
+// Decides, from stat data alone, whether filename needs to be probed and
+// hands it to the workers if it does
+static void index_enqueue(struct indexer *ix, const char *filename, const struct stat *st) {
+	struct file_stamp stamp;
+	file_stamp_from_stat(&stamp, st);
+
+	char *fileuri = index_uri(filename);
+	int64_t id = 0;
+
+	struct known_file *known = g_hash_table_lookup(ix->known, fileuri);
+	if ((known == NULL) && (ix->lookup != NULL)) {
+		known = index_lookup(ix, fileuri);
+	}
+	if (known != NULL) {
+		if (known->seen) {
+			// already queued during this run
+			g_free(fileuri);
+			return;
+		}
+		known->seen = true;
+		if (!ix->update || (memcmp(&known->stamp, &stamp, sizeof(stamp)) == 0)) {
+			++ix->unchanged;
+			g_free(fileuri);
+			return;
+		}
+		id = known->id;
+	} else {
+		known = malloc(sizeof(struct known_file));
+		oomp(known);
+		known->id = 0;
+		known->stamp = stamp;
+		known->seen = true;
+		g_hash_table_insert(ix->known, g_strdup(fileuri), known);
 	}
 
-	r = sqlite3_prepare_v2(index_db, "insert into ridx(id, any) values (?, ?)", -1, &rinsert, NULL);
-	if (r != SQLITE_OK) {
-		fprintf(stderr, "Sqlite3 error preparing rinsert statement: %s\n", sqlite3_errmsg(index_db));
-		exit(EXIT_FAILURE);
+	struct index_job *job = calloc(1, sizeof(struct index_job));
+	oomp(job);
+	job->filename = strdup(filename);
+	oomp(job->filename);
+	job->fileuri = fileuri;
+	job->id = id;
+	job->stamp = stamp;
+
+	job_queue_push(&ix->paths, job);
+}
+
+static bool index_accept(void *data, const char *path) {
+	if (!should_autoindex_file(path)) {
+		fprintf(stderr, "Didn't add %s to index, add manually if desired\n", path);
+		return false;
 	}
-	
-	r = sqlite3_prepare_v2(index_db, "select * from tunes where filename = ?;", -1, &check, NULL);
-	if (r != SQLITE_OK) {
-		fprintf(stderr, "Sqlite3 error preparing chekc statement: %s\n", sqlite3_errmsg(index_db));
+	return true;
+}
+
+static void index_walk_file(void *data, const char *path, const struct stat *st) {
+	struct indexer *ix = data;
+	++ix->walked;
+	index_enqueue(ix, path, st);
+}
+
+static void index_walk_failed(void *data, const char *path) {
+	struct indexer *ix = data;
+	g_ptr_array_add(ix->failed, index_uri(path));
+}
+
+static void index_directory(struct indexer *ix, const char *dir_name) {
+	struct walk w = { ix, NULL, index_accept, index_walk_file, index_walk_failed };
+	walk_tree(&w, dir_name);
+}
+
+static void index_load_known(struct indexer *ix) {
+	sqlite3_stmt *select = NULL;
+
+	select = stmt_get(ix->index_db, "select id, mtime, size, inode, filename from tunes");
+	if (select == NULL) goto index_load_known_failure;
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		const char *fileuri = (const char *)sqlite3_column_text(select, 4);
+		if (fileuri == NULL) continue;
+
+		struct known_file *known = malloc(sizeof(struct known_file));
+		oomp(known);
+		known_file_from_row(known, select, 0);
+
+		g_hash_table_insert(ix->known, g_strdup(fileuri), known);
+	}
+
+	if (r != SQLITE_DONE) goto index_load_known_failure;
+
+	sqlite3_reset(select);
+	return;
+
+index_load_known_failure:
+
+	fprintf(stderr, "Sqlite3 error loading the index: %s\n", sqlite3_errmsg(ix->index_db));
+	exit(EXIT_FAILURE);
+}
+
+// True if uri is root or is under it
+static bool uri_under(const char *uri, const char *root) {
+	size_t n = strlen(root);
+	return strstart(uri, root) && ((uri[n] == '/') || (uri[n] == '\0') || (root[n-1] == '/'));
+}
+
+// Deletes, in one transaction, the rows under one of the roots whose file
+// wasn't found, except those under a path the walk couldn't read
+static int index_delete_vanished(struct indexer *ix, char *roots[], int rootcount) {
+	char **rooturis = malloc(sizeof(char *) * rootcount);
+	oomp(rooturis);
+	for (int i = 0; i < rootcount; ++i) {
+		rooturis[i] = index_uri(roots[i]);
+	}
+
+	sqlite3_stmt *insert = NULL;
+	int deleted = 0;
+
+	index_exec(ix->index_db, "BEGIN; CREATE TEMP TABLE IF NOT EXISTS vanished(id integer primary key); DELETE FROM vanished;");
+
+	insert = stmt_get(ix->index_db, "insert into vanished(id) values (?)");
+	if (insert == NULL) goto index_delete_vanished_failure;
+
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, ix->known);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct known_file *known = value;
+		if (known->seen) continue;
+
+		bool under_root = false;
+		for (int i = 0; (i < rootcount) && !under_root; ++i) {
+			under_root = uri_under(key, rooturis[i]);
+		}
+		if (!under_root) continue;
+
+		bool unread = false;
+		for (guint i = 0; (i < ix->failed->len) && !unread; ++i) {
+			unread = uri_under(key, g_ptr_array_index(ix->failed, i));
+		}
+		if (unread) continue;
+
+		if (sqlite3_reset(insert) != SQLITE_OK) goto index_delete_vanished_failure;
+		if (sqlite3_bind_int64(insert, 1, known->id) != SQLITE_OK) goto index_delete_vanished_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto index_delete_vanished_failure;
+		if (ix->changes != NULL) index_changes_add(ix->changes, known->id, INDEX_REMOVED);
+		++deleted;
+	}
+
+	sqlite3_reset(insert);
+
+	index_exec(ix->index_db, "DELETE FROM tunes WHERE id IN (SELECT id FROM vanished); DELETE FROM vanished; COMMIT;");
+
+	for (int i = 0; i < rootcount; ++i) {
+		g_free(rooturis[i]);
+	}
+	free(rooturis);
+
+	return deleted;
+
+index_delete_vanished_failure:
+
+	fprintf(stderr, "Sqlite3 error deleting vanished files: %s\n", sqlite3_errmsg(ix->index_db));
+	exit(EXIT_FAILURE);
+}
+
+// Remembers dir as one of the library's roots so that --update can rescan it later
+static void index_save_root(sqlite3 *index_db, const char *dir) {
+	sqlite3_stmt *save = NULL;
+
+	save = stmt_get(index_db, "insert into config(key, value) select 'root', ?1 where not exists (select 1 from config where key = 'root' and value = ?1)");
+	if (save == NULL) goto index_save_root_failure;
+	if (sqlite3_bind_text(save, 1, dir, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_save_root_failure;
+	if (sqlite3_step(save) != SQLITE_DONE) goto index_save_root_failure;
+
+	sqlite3_reset(save);
+	return;
+
+index_save_root_failure:
+
+	fprintf(stderr, "Sqlite3 error saving library root: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+static int index_load_roots(sqlite3 *index_db, char ***dirs) {
+	sqlite3_stmt *select = NULL;
+	int n = 0, size = 8;
+
+	*dirs = malloc(sizeof(char *) * size);
+	oomp(*dirs);
+
+	select = stmt_get(index_db, "select value from config where key = 'root'");
+	if (select == NULL) goto index_load_roots_failure;
+
+	while (sqlite3_step(select) == SQLITE_ROW) {
+		if (n >= size) {
+			size *= 2;
+			*dirs = realloc(*dirs, sizeof(char *) * size);
+			oomp(*dirs);
+		}
+		(*dirs)[n] = strdup((const char *)sqlite3_column_text(select, 0));
+		oomp((*dirs)[n]);
+		++n;
+	}
+
+	sqlite3_reset(select);
+	return n;
+
+index_load_roots_failure:
+
+	fprintf(stderr, "Sqlite3 error loading library roots: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+// Makes dir absolute (file uris need absolute paths) and strips trailing slashes
+static char *index_root_path(const char *dir) {
+	char *r;
+
+	if (dir[0] == '/') {
+		r = strdup(dir);
+	} else {
+		char *cwd = getcwd(NULL, 0);
+		oomp(cwd);
+		asprintf(&r, "%s/%s", cwd, dir);
+		free(cwd);
+	}
+	oomp(r);
+
+	for (int n = strlen(r); (n > 1) && (r[n-1] == '/'); --n) {
+		r[n-1] = '\0';
+	}
+
+	return r;
+}
+
+static void indexer_prepare(sqlite3 *index_db, sqlite3_stmt **stmt, const char *sql, const char *name) {
+	*stmt = stmt_get(index_db, sql);
+	if (*stmt == NULL) {
+		fprintf(stderr, "Sqlite3 error preparing %s statement: %s\n", name, sqlite3_errmsg(index_db));
 		exit(EXIT_FAILURE);
 	}
-	
-	insert_statements ins = { insert, rinsert, check };
-	
+}
+
+// Prepares the statements and starts the worker and writer threads. If
+// lookup_each is set the files already in the index are looked up one by one
+// instead of being loaded in advance.
+static void indexer_start(struct indexer *ix, sqlite3 *index_db, int nworkers, bool update, bool lookup_each, struct index_changes *changes) {
+	ix->index_db = index_db;
+	indexer_prepare(index_db, &ix->s.insert, "insert or replace into tunes(id, album, artist, album_artist, comment, composer, copyright, date, disc, encoder, genre, performer, publisher, title, track, filename, mtime, size, inode, track_no, disc_no, sort_artist, sort_album, track_key) values (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13, ?14, ?15, ?16, ?17, ?18, ?19, cast(?15 as integer), cast(?9 as integer), lower(?3), lower(?2), track_key(?16));", "insert");
+	ix->lookup = NULL;
+	if (lookup_each) {
+		indexer_prepare(index_db, &ix->lookup, "select id, mtime, size, inode from tunes where filename = ?", "lookup");
+	}
+
+	ix->nworkers = nworkers;
+	ix->update = update;
+	ix->known = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, free);
+	ix->changes = changes;
+	ix->indexed = 0;
+	ix->unchanged = 0;
+	ix->walked = 0;
+	ix->failed = g_ptr_array_new_with_free_func(g_free);
+	job_queue_init(&ix->paths, INDEX_QUEUE_LENGTH);
+	job_queue_init(&ix->jobs, INDEX_QUEUE_LENGTH);
+
+	if (!lookup_each) {
+		index_load_known(ix);
+	}
+
+	ix->writer = g_thread_new("index-writer", index_writer, ix);
+	ix->workers = malloc(sizeof(GThread *) * nworkers);
+	oomp(ix->workers);
+	for (int i = 0; i < nworkers; ++i) {
+		ix->workers[i] = g_thread_new("index-worker", index_worker, ix);
+	}
+}
+
+// Queues path, a file or a directory, returns false if it doesn't exist
+static bool indexer_add(struct indexer *ix, char *path) {
+	struct stat s;
+
+	if (stat(path, &s) < 0) {
+		return false;
+	}
+
+	if (S_ISDIR(s.st_mode)) {
+		index_directory(ix, path);
+	} else {
+		index_enqueue(ix, path, &s);
+	}
+
+	return true;
+}
+
+// Waits for all queued files to be written
+static void indexer_finish(struct indexer *ix) {
+	for (int i = 0; i < ix->nworkers; ++i) {
+		job_queue_push(&ix->paths, &end_of_jobs);
+	}
+
+	for (int i = 0; i < ix->nworkers; ++i) {
+		g_thread_join(ix->workers[i]);
+	}
+	g_thread_join(ix->writer);
+}
+
+static void indexer_free(struct indexer *ix) {
+	job_queue_free(&ix->paths);
+	job_queue_free(&ix->jobs);
+	g_hash_table_destroy(ix->known);
+	g_ptr_array_free(ix->failed, TRUE);
+	free(ix->workers);
+
+	// the statements belong to the registry, they are kept for the next run
+	sqlite3_reset(ix->s.insert);
+	if (ix->lookup != NULL) sqlite3_reset(ix->lookup);
+}
+
+// Deletes the rows of path or, if it was a directory, of every file that was in it
+static void index_delete_path(struct indexer *ix, const char *path) {
+	sqlite3_stmt *select = NULL;
+	char *fileuri = index_uri(path);
+	char *first, *last;
+
+	// uris under the directory sort between "<uri>/" and "<uri>0"
+	asprintf(&first, "%s/", fileuri);
+	oomp(first);
+	asprintf(&last, "%s0", fileuri);
+	oomp(last);
+
+	select = stmt_get(ix->index_db, "select id from tunes where filename = ?1 or (filename >= ?2 and filename < ?3)");
+	if (select == NULL) goto index_delete_path_failure;
+	if (sqlite3_bind_text(select, 1, fileuri, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_delete_path_failure;
+	if (sqlite3_bind_text(select, 2, first, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_delete_path_failure;
+	if (sqlite3_bind_text(select, 3, last, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto index_delete_path_failure;
+
+	index_exec(ix->index_db, "BEGIN; CREATE TEMP TABLE IF NOT EXISTS vanished(id integer primary key); DELETE FROM vanished;");
+
+	sqlite3_stmt *insert = stmt_get(ix->index_db, "insert into vanished(id) values (?)");
+	if (insert == NULL) goto index_delete_path_failure;
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		int64_t id = sqlite3_column_int64(select, 0);
+		if (sqlite3_reset(insert) != SQLITE_OK) goto index_delete_path_failure;
+		if (sqlite3_bind_int64(insert, 1, id) != SQLITE_OK) goto index_delete_path_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto index_delete_path_failure;
+		index_changes_add(ix->changes, id, INDEX_REMOVED);
+	}
+	if (r != SQLITE_DONE) goto index_delete_path_failure;
+
+	sqlite3_reset(insert);
+	sqlite3_reset(select);
+
+	index_exec(ix->index_db, "DELETE FROM tunes WHERE id IN (SELECT id FROM vanished); DELETE FROM vanished; COMMIT;");
+
+	free(first);
+	free(last);
+	g_free(fileuri);
+
+	return;
+
+index_delete_path_failure:
+
+	fprintf(stderr, "Sqlite3 error deleting %s: %s\n", path, sqlite3_errmsg(ix->index_db));
+	exit(EXIT_FAILURE);
+}
+
+int index_update_paths(sqlite3 *index_db, char *paths[], int n, struct index_changes *changes) {
+	struct indexer ix;
+
+	bool *missing = calloc(n, sizeof(bool));
+	oomp(missing);
+
+	indexer_start(&ix, index_db, 1, true, true, changes);
+
+	for (int i = 0; i < n; ++i) {
+		struct stat st;
+		if (stat(paths[i], &st) < 0) {
+			missing[i] = true;
+		} else if (S_ISDIR(st.st_mode)) {
+			index_directory(&ix, paths[i]);
+		} else if (should_autoindex_file(paths[i])) {
+			index_enqueue(&ix, paths[i], &st);
+		}
+	}
+
+	indexer_finish(&ix);
+
+	// the writer's transaction is closed now
+	for (int i = 0; i < n; ++i) {
+		if (missing[i]) {
+			index_delete_path(&ix, paths[i]);
+		}
+	}
+
+	indexer_free(&ix);
+	free(missing);
+
+	if (changes->n > 0) index_refresh_fuzzy(index_db);
+
+	return changes->n;
+}
+
+int index_rescan(sqlite3 *index_db, char *roots[], int n, struct index_changes *changes) {
+	struct indexer ix;
+
+	char **walked = malloc(sizeof(char *) * (n+1));
+	oomp(walked);
+	int walkedcount = 0;
+
+	// every file is looked at, the ones known are loaded at once
+	indexer_start(&ix, index_db, 1, true, false, changes);
+
+	for (int i = 0; i < n; ++i) {
+		struct stat st;
+		// as with index --update, a missing or empty root is left alone
+		if ((stat(roots[i], &st) < 0) || !S_ISDIR(st.st_mode)) continue;
+
+		int before = ix.walked;
+		index_directory(&ix, roots[i]);
+		if (ix.walked > before) walked[walkedcount++] = roots[i];
+	}
+
+	indexer_finish(&ix);
+	index_delete_vanished(&ix, walked, walkedcount);
+
+	indexer_free(&ix);
+	free(walked);
+
+	if (changes->n > 0) index_refresh_fuzzy(index_db);
+
+	return changes->n;
+}
+
+int index_roots(sqlite3 *index_db, char ***dirs) {
+	return index_load_roots(index_db, dirs);
+}
+
+void index_command(char *args[], int argcount) {
+	int nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	bool update = false;
+	char **dirs = malloc(sizeof(char *) * (argcount+1));
+	oomp(dirs);
+	int dircount = 0;
+
+	for (int i = 0; i < argcount; ++i) {
+		if (strcmp(args[i], "-j") == 0) {
+			if (++i >= argcount) {
+				fprintf(stderr, "Option -j requires an argument\n");
+				exit(EXIT_FAILURE);
+			}
+			nworkers = atoi(args[i]);
+		} else if (strstart(args[i], "-j")) {
+			nworkers = atoi(args[i]+2);
+		} else if (strcmp(args[i], "--update") == 0) {
+			update = true;
+		} else {
+			dirs[dircount++] = index_root_path(args[i]);
+		}
+	}
+
+	if (nworkers < 1) nworkers = 1;
+
+	sqlite3 *index_db = open_or_create_index_db();
+
+	if (dircount == 0) {
+		free(dirs);
+		dircount = index_load_roots(index_db, &dirs);
+		if (dircount == 0) {
+			fprintf(stderr, "Nothing to index, specify some directories\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	av_register_all();
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct indexer ix;
+	indexer_start(&ix, index_db, nworkers, update, false, NULL);
+
+	// the directories whose songs the update can remove: a root that isn't
+	// there or is empty is more likely a drive that isn't mounted than a
+	// library that was deleted
+	char **walked = malloc(sizeof(char *) * (dircount+1));
+	oomp(walked);
+	int walkedcount = 0;
+
 	for (int i = 0; i < dircount; ++i) {
 		struct stat s;
+		if (stat(dirs[i], &s) < 0) {
+			if (!update) {
+				perror("Can not stat file");
+				exit(EXIT_FAILURE);
+			}
+			fprintf(stderr, "Skipping %s: %s\n", dirs[i], strerror(errno));
+			continue;
+		}
 
 		printf("Indexing %s\n", dirs[i]);
+		int before = ix.walked;
+		indexer_add(&ix, dirs[i]);
 
-		if (stat(dirs[i], &s) < 0) {
-			perror("Can not stat file");
-			exit(EXIT_FAILURE);
+		if (!S_ISDIR(s.st_mode)) continue;
+		if (update && (ix.walked == before)) {
+			fprintf(stderr, "Found no files in %s, the songs of the library in it are kept\n", dirs[i]);
+			continue;
 		}
+		walked[walkedcount++] = dirs[i];
+	}
 
-		if (S_ISDIR(s.st_mode)) {
-			index_directory(index_db, ins, dirs[i]);
-		} else {
-			index_file(index_db, ins, dirs[i]);
+	indexer_finish(&ix);
+
+	int deleted = 0;
+	if (update) {
+		deleted = index_delete_vanished(&ix, walked, walkedcount);
+	}
+	free(walked);
+
+	for (int i = 0; i < dircount; ++i) {
+		struct stat s;
+		if ((stat(dirs[i], &s) == 0) && S_ISDIR(s.st_mode)) {
+			index_save_root(index_db, dirs[i]);
 		}
 	}
 
-	sqlite3_finalize(insert);
-	sqlite3_finalize(rinsert);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("Indexed %d files in %.1fs (%.1f files/s, %d workers), %d unchanged, %d removed\n", ix.indexed, elapsed, (elapsed > 0) ? ix.indexed / elapsed : 0.0, nworkers, ix.unchanged, deleted);
+
+	// merges the segments of fidx the run left behind into one, the watcher
+	// relies on fts5's own incremental merges
+	if (ix.indexed + deleted > 0) {
+		index_exec(index_db, "INSERT INTO fidx(fidx) VALUES ('optimize');");
+		index_refresh_fuzzy(index_db);
+	}
+
+	indexer_free(&ix);
+	for (int i = 0; i < dircount; ++i) {
+		free(dirs[i]);
+	}
+	free(dirs);
 
-	sqlite3_close(index_db);
+	close_db(index_db);
 }
@@ -1,6 +1,32 @@
 #ifndef __INDEX__
 #define __INDEX__
 
-void index_command(char *dirs[], int dircount);
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+enum index_change_kind {
+	INDEX_ADDED,
+	INDEX_UPDATED,
+	INDEX_REMOVED,
+};
+
+struct index_change {
+	int64_t id;
+	enum index_change_kind kind;
+};
+
+struct index_changes {
+	struct index_change *v;
+	int n, size;
+};
+
+void index_command(char *args[], int argcount);
+int index_update_paths(sqlite3 *index_db, char *paths[], int n, struct index_changes *changes);
+// Indexes the roots again like index --update does, the songs whose file is
+// gone from them included
+int index_rescan(sqlite3 *index_db, char *roots[], int n, struct index_changes *changes);
+void index_changes_free(struct index_changes *changes);
+int index_roots(sqlite3 *index_db, char ***dirs);
 
 #endif
\ No newline at end of file
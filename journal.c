@@ -0,0 +1,276 @@
+#include "journal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glib.h>
+
+#include "util.h"
+
+#define JOURNAL_MAGIC "mjrnl01"
+// the file grows by this many records at a time
+#define JOURNAL_GROW 32768
+
+// 32 bytes, a record never straddles two pages. Record 0 holds the magic.
+struct journal_record {
+	int64_t op, a, b;
+	uint64_t check;
+};
+
+struct journal_swap;
+
+struct journal {
+	char *path;
+	int fd;
+	struct journal_record *map;
+	int64_t size; // records the file holds, including the magic
+	int64_t n; // index of the next record
+	struct journal_swap *swap; // the compaction being synced, if any
+};
+
+// A compaction whose file isn't on disk under the journal's path yet. The
+// records appended meanwhile go to the old journal too: a crash leaves either
+// file complete under the path.
+struct journal_swap {
+	struct journal *old;
+	char *tmp_path;
+	char *path;
+	int fd;
+	GThread *thread;
+	gint done; // 1 once the new file is in place, -1 if it couldn't be
+	int error;
+};
+
+// FNV-1a of the record and its index: zeroed space, a record written only in
+// part or one left over from a larger file all fail it
+static uint64_t record_check(const struct journal_record *r, int64_t idx) {
+	int64_t words[4] = { r->op, r->a, r->b, idx };
+	const unsigned char *p = (const unsigned char *)words;
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < sizeof(words); ++i) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static bool journal_map(struct journal *j, int64_t size) {
+	if (ftruncate(j->fd, size * sizeof(struct journal_record)) < 0) return false;
+	void *map = mmap(NULL, size * sizeof(struct journal_record), PROT_READ | PROT_WRITE, MAP_SHARED, j->fd, 0);
+	if (map == MAP_FAILED) return false;
+	j->map = map;
+	j->size = size;
+	return true;
+}
+
+// Starts an empty journal in j->fd
+static bool journal_init(struct journal *j) {
+	if (ftruncate(j->fd, 0) < 0) return false;
+	if (!journal_map(j, JOURNAL_GROW)) return false;
+	memcpy(j->map, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	j->n = 1;
+	return true;
+}
+
+struct journal *journal_open(const char *path, void (*replay)(void *data, int64_t op, int64_t a, int64_t b), void *data) {
+	struct journal *j = calloc(1, sizeof(struct journal));
+	oomp(j);
+	j->path = strdup(path);
+	oomp(j->path);
+
+	j->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (j->fd < 0) goto journal_open_failure;
+
+	struct stat st;
+	if (fstat(j->fd, &st) < 0) goto journal_open_failure;
+
+	int64_t size = st.st_size / sizeof(struct journal_record);
+	if ((size < 1) || (st.st_size % sizeof(struct journal_record) != 0)) {
+		if (!journal_init(j)) goto journal_open_failure;
+		return j;
+	}
+
+	if (!journal_map(j, size)) goto journal_open_failure;
+
+	if (memcmp(j->map, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+		fprintf(stderr, "%s is not a journal, starting a new one\n", path);
+		munmap(j->map, j->size * sizeof(struct journal_record));
+		if (!journal_init(j)) goto journal_open_failure;
+		return j;
+	}
+
+	for (j->n = 1; j->n < j->size; ++j->n) {
+		struct journal_record *r = j->map + j->n;
+		if (r->check != record_check(r, j->n)) break;
+		replay(data, r->op, r->a, r->b);
+	}
+
+	return j;
+
+journal_open_failure:
+
+	fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+	if (j->fd >= 0) close(j->fd);
+	free(j->path);
+	free(j);
+	return NULL;
+}
+
+static void journal_put(struct journal *j, int64_t op, int64_t a, int64_t b) {
+	if (j->map == NULL) return;
+
+	if (j->n >= j->size) {
+		int64_t size = j->size + JOURNAL_GROW;
+		void *map = MAP_FAILED;
+		if (ftruncate(j->fd, size * sizeof(struct journal_record)) == 0) {
+			map = mremap(j->map, j->size * sizeof(struct journal_record), size * sizeof(struct journal_record), MREMAP_MAYMOVE);
+		}
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Could not grow %s, stopped saving to it: %s\n", j->path, strerror(errno));
+			munmap(j->map, j->size * sizeof(struct journal_record));
+			j->map = NULL;
+			return;
+		}
+		j->map = map;
+		j->size = size;
+	}
+
+	struct journal_record *r = j->map + j->n;
+	r->op = op;
+	r->a = a;
+	r->b = b;
+	r->check = record_check(r, j->n);
+	++j->n;
+}
+
+// Ends the compaction once the thread is done with it, waiting for it if wait
+// is set: the old journal is dropped or, if the new one couldn't be put in
+// place, taken back
+static void journal_swapped(struct journal *j, bool wait) {
+	struct journal_swap *swap = j->swap;
+	if (swap == NULL) return;
+	if (!wait && (g_atomic_int_get(&swap->done) == 0)) return;
+
+	g_thread_join(swap->thread);
+	struct journal *old = swap->old;
+
+	if (swap->done < 0) {
+		fprintf(stderr, "Could not compact %s: %s\n", j->path, strerror(swap->error));
+		if (j->map != NULL) munmap(j->map, j->size * sizeof(struct journal_record));
+		close(j->fd);
+		unlink(swap->tmp_path);
+		j->fd = old->fd;
+		j->map = old->map;
+		j->size = old->size;
+		j->n = old->n;
+	} else {
+		if (old->map != NULL) munmap(old->map, old->size * sizeof(struct journal_record));
+		close(old->fd);
+	}
+
+	free(old);
+	free(swap->tmp_path);
+	free(swap);
+	j->swap = NULL;
+}
+
+void journal_append(struct journal *j, int64_t op, int64_t a, int64_t b) {
+	journal_put(j, op, a, b);
+	if (j->swap != NULL) {
+		journal_put(j->swap->old, op, a, b);
+		journal_swapped(j, false);
+	}
+}
+
+int64_t journal_records(struct journal *j) {
+	return j->n - 1;
+}
+
+// Puts the new file of a compaction on disk and in place of the old one, in
+// its own thread: the syncs take tens of milliseconds
+static gpointer journal_sync(gpointer data) {
+	struct journal_swap *swap = data;
+
+	bool ok = (fdatasync(swap->fd) == 0) && (rename(swap->tmp_path, swap->path) == 0);
+	if (ok) {
+		// make the rename itself durable
+		char *dir = strdup(swap->path);
+		oomp(dir);
+		char *slash = strrchr(dir, '/');
+		if (slash != NULL) {
+			*slash = '\0';
+			int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			if (dir_fd >= 0) {
+				fsync(dir_fd);
+				close(dir_fd);
+			}
+		}
+		free(dir);
+	} else {
+		swap->error = errno;
+	}
+
+	g_atomic_int_set(&swap->done, ok ? 1 : -1);
+	return NULL;
+}
+
+void journal_compact(struct journal *j, void (*snapshot)(void *data, struct journal *j), void *data) {
+	// the previous one is still being synced, the next call will do
+	journal_swapped(j, false);
+	if (j->swap != NULL) return;
+
+	char *tmp_path;
+	asprintf(&tmp_path, "%s.new", j->path);
+	oomp(tmp_path);
+
+	struct journal *old = malloc(sizeof(struct journal));
+	oomp(old);
+	*old = *j;
+
+	j->map = NULL;
+	j->fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (j->fd < 0) goto journal_compact_failure;
+	if (!journal_init(j)) goto journal_compact_failure;
+
+	snapshot(data, j);
+	if (j->map == NULL) goto journal_compact_failure;
+
+	struct journal_swap *swap = calloc(1, sizeof(struct journal_swap));
+	oomp(swap);
+	swap->old = old;
+	swap->tmp_path = tmp_path;
+	swap->path = j->path;
+	swap->fd = j->fd;
+	j->swap = swap;
+	swap->thread = g_thread_new("journal-sync", journal_sync, swap);
+	return;
+
+journal_compact_failure:
+
+	// the old journal is still complete, keep appending to it
+	fprintf(stderr, "Could not compact %s: %s\n", j->path, strerror(errno));
+	if (j->fd >= 0) {
+		if (j->map != NULL) munmap(j->map, j->size * sizeof(struct journal_record));
+		close(j->fd);
+		unlink(tmp_path);
+	}
+	*j = *old;
+	free(old);
+	free(tmp_path);
+}
+
+void journal_close(struct journal *j) {
+	if (j == NULL) return;
+	journal_swapped(j, true);
+	if (j->map != NULL) munmap(j->map, j->size * sizeof(struct journal_record));
+	close(j->fd);
+	free(j->path);
+	free(j);
+}
@@ -0,0 +1,26 @@
+#ifndef __JOURNAL__
+#define __JOURNAL__
+
+#include <stdint.h>
+
+// Append-only log of fixed size records in a memory mapped file. Appending a
+// record is a store into the mapping, the kernel writes it back: records
+// survive the process crashing and a checksum drops the ones torn by a
+// system crash, replay stops at the first one that doesn't match.
+
+struct journal;
+
+// Opens the journal at path, creating it if it doesn't exist, and calls replay
+// with each record in it. Returns NULL if the file can not be opened.
+struct journal *journal_open(const char *path, void (*replay)(void *data, int64_t op, int64_t a, int64_t b), void *data);
+void journal_append(struct journal *j, int64_t op, int64_t a, int64_t b);
+// Number of records in the journal
+int64_t journal_records(struct journal *j);
+// Replaces the records of the journal with the ones snapshot appends. A
+// thread swaps the file atomically once they are on disk, the records
+// appended until then go to both files. Does nothing while the previous
+// compaction is still being synced.
+void journal_compact(struct journal *j, void (*snapshot)(void *data, struct journal *j), void *data);
+void journal_close(struct journal *j);
+
+#endif
@@ -2,6 +2,8 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <time.h>
+#include <limits.h>
 
 #include <gst/gst.h>
 #include <sqlite3.h>
@@ -10,13 +12,24 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <termios.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 
 #include "util.h"
 #include "index.h"
 #include "queue.h"
 #include "conn.h"
 #include "stats.h"
+#include "watch.h"
+#include "shuffle.h"
+#include "stmt.h"
+#include "prefix.h"
+#include "fuzzy.h"
+#include "now.h"
+#include "events.h"
 
 #ifdef USE_LIBNOTIFY
 #include <libnotify/notify.h>
@@ -38,13 +51,33 @@ NotifyNotification *notification;
 
 #define MINSTREL_PIC "/dev/shm/minstrel-pic.png"
 
-void do_notify(sqlite3_stmt *tune_select) {
+// MINSTREL_PREPARES set in the environment reports the statements prepared
+// by each command, after the first time they run it should be none
+static bool count_prepares = false;
+
+// MINSTREL_GAPS set in the environment reports how each tune led to the next:
+// the silence between the end of a tune and the next playing when it had to
+// be started anew, how early its uri reached playbin when it followed gapless
+static bool report_gaps = false;
+
+// The uri of the tune after the current one, kept up to date on the main loop
+// as the tune and the queue change, for about_to_finish to hand to playbin
+// from its streaming thread: the next tune follows without a gap, the tune
+// that ends doesn't post EOS. gapless_queued is the id whose uri was handed,
+// until its STREAM_START.
+static GMutex gapless_mutex;
+static char *gapless_uri = NULL;
+static int64_t gapless_id = 0;
+static int64_t gapless_queued = 0;
+static gint64 gapless_queued_at = 0;
+// when the last tune ended with EOS, for report_gaps
+static gint64 eos_at = 0;
+
+void do_notify(const struct tune *t) {
 #ifdef USE_LIBNOTIFY
-	go_to_tune(player_index_db, tune_select, queue_currently_playing()->id);
-	
 	const char *picok = NULL;
 	
-	const char *uri = (const char *)sqlite3_column_text(tune_select, 14);
+	const char *uri = t->filename;
 	const char *filename = g_filename_from_uri(uri, NULL, NULL);
 	
 	if (filename != NULL) {
@@ -91,9 +124,9 @@ void do_notify(sqlite3_stmt *tune_select) {
 	}
 
 	char *text = NULL;
-	asprintf(&text, "from %s by %s", sqlite3_column_text(tune_select, 0), sqlite3_column_text(tune_select, 1));
+	asprintf(&text, "from %s by %s", t->album, t->artist);
 	oomp(text);
-	notify_notification_update(notification, (const char *)sqlite3_column_text(tune_select, 12), text, picok);
+	notify_notification_update(notification, t->title, text, picok);
 	GError *error = NULL;
 	if (!notify_notification_show(notification, &error)) {
 		fprintf(stderr, "Error displaying notification: %s\n", error->message);
@@ -104,49 +137,101 @@ void do_notify(sqlite3_stmt *tune_select) {
 #endif
 }
 
-static int prepare_tune_select(sqlite3_stmt **tune_select) {
-	return sqlite3_prepare_v2(player_index_db, "select trim(album), trim(artist), trim(album_artist), trim(comment), trim(composer), trim(copyright), trim(date), trim(disc), trim(encoder), trim(genre), trim(performer), trim(publisher), trim(title), trim(track), filename from tunes where id = ?", -1, tune_select, NULL);
+static const char *state_name(GstState state) {
+	return (state == GST_STATE_PLAYING) ? "playing" : (state == GST_STATE_PAUSED) ? "paused" : "stopped";
 }
 
-bool tunes_play(struct item *item) {
-	sqlite3_stmt *get_filename = NULL;
-	const unsigned char *filename = NULL;
+static void track_event(GString *events) {
+	int64_t id = queue_currently_playing();
+	const struct tune *t = (id != 0) ? cache_get(id) : NULL;
+	if (t == NULL) return;
 
+	g_string_append_printf(events, "track\t%" PRId64 "\t%" PRId64, queue_currently_playing_pos(), t->id);
+	events_field(events, t->title);
+	events_field(events, t->artist);
+	events_field(events, t->album);
+	g_string_append_c(events, '\n');
+}
 
-	if (sqlite3_prepare_v2(player_index_db,"select filename from tunes where id = ?", -1, &get_filename, NULL) != SQLITE_OK) goto tunes_play_sqlite3_failure;
+// Resolves the tune after the current one for about_to_finish, with the queue
+// as it is now
+static void gapless_prepare(void) {
+	int64_t id = queue_peek_next(player_index_db);
+	const struct tune *t = (id != 0) ? cache_get(id) : NULL;
+
+	g_mutex_lock(&gapless_mutex);
+	g_free(gapless_uri);
+	gapless_uri = (t != NULL) ? g_strdup(t->filename) : NULL;
+	gapless_id = (t != NULL) ? id : 0;
+	g_mutex_unlock(&gapless_mutex);
+}
 
-	if (sqlite3_bind_int64(get_filename, 1, item->id) != SQLITE_OK) goto tunes_play_sqlite3_failure;
+// Forgets the uri handed to playbin, after a state change that dropped it
+static void gapless_cancel(void) {
+	g_mutex_lock(&gapless_mutex);
+	gapless_queued = 0;
+	g_mutex_unlock(&gapless_mutex);
+}
 
-	if (sqlite3_step(get_filename) != SQLITE_ROW) {
-		sqlite3_finalize(get_filename);
-		return false;
+// Called by playbin from a streaming thread once it has read all of the
+// current tune, the uri set here plays right after it
+static void about_to_finish(GstElement *element, gpointer data) {
+	g_mutex_lock(&gapless_mutex);
+	if (gapless_uri != NULL) {
+		g_object_set(G_OBJECT(element), "uri", gapless_uri, NULL);
+		gapless_queued = gapless_id;
+		gapless_queued_at = g_get_monotonic_time();
 	}
+	g_mutex_unlock(&gapless_mutex);
+}
 
-	filename = sqlite3_column_text(get_filename, 0);
+// What changes once t is the tune playing
+static void tune_started(const struct tune *t) {
+	now_set_tune(t->id, queue_currently_playing_pos(), t->title, t->artist, t->album, t->track);
+	now_set_state(NOW_PLAYING, 0, -1);
 
-	gst_element_set_state(play, GST_STATE_READY);
+	if (events_subscribed()) {
+		GString *event = g_string_new(NULL);
+		track_event(event);
+		events_emit(event->str);
+		g_string_free(event, TRUE);
+	}
 
-	g_object_set(G_OBJECT(play), "uri", filename, NULL);
-	gst_element_set_state(play, GST_STATE_PLAYING);
+	display_queue();
 
-	sqlite3_finalize(get_filename);
+	do_notify(t);
 
-	sqlite3_stmt *tune_select;
-	if (prepare_tune_select(&tune_select) != SQLITE_OK) goto tunes_play_sqlite3_failure;
+	gapless_prepare();
+}
 
-	display_queue(player_index_db, tune_select);
+bool tunes_play(int64_t id) {
+	// one query for this tune and the ones displayed around it
+	queue_load_window();
 
-	do_notify(tune_select);
+	const struct tune *t = cache_get(id);
+	if (t == NULL) return false;
 
-	sqlite3_finalize(tune_select);
+	gst_element_set_state(play, GST_STATE_READY);
+	gapless_cancel();
 
+	g_object_set(G_OBJECT(play), "uri", t->filename, NULL);
+	gst_element_set_state(play, GST_STATE_PLAYING);
+
+	tune_started(t);
 	return true;
+}
 
-tunes_play_sqlite3_failure:
 
-	fprintf(stderr, "Sqlite3 error starting to play %" PRId64 " [%s]: %s\n", item->id, filename, sqlite3_errmsg(player_index_db));
-	if (get_filename != NULL) sqlite3_finalize(get_filename);
-	exit(EXIT_FAILURE);
+// Publishes state, with the position and duration of the current tune, in
+// the now playing page
+static void publish_state(GstState state) {
+	gint64 pos, len;
+	int64_t pos_ms = -1, len_ms = -1;
+	if ((state == GST_STATE_PLAYING) || (state == GST_STATE_PAUSED)) {
+		if (gst_element_query_position(play, GST_FORMAT_TIME, &pos)) pos_ms = pos / 1000000;
+		if (gst_element_query_duration(play, GST_FORMAT_TIME, &len)) len_ms = len / 1000000;
+	}
+	now_set_state((state == GST_STATE_PLAYING) ? NOW_PLAYING : (state == GST_STATE_PAUSED) ? NOW_PAUSED : NOW_STOPPED, pos_ms, len_ms);
 }
 
 static void play_pause_action(void) {
@@ -155,8 +240,10 @@ static void play_pause_action(void) {
 
 	if (state == GST_STATE_PLAYING) {
 		gst_element_set_state(play, GST_STATE_PAUSED);
+		publish_state(GST_STATE_PAUSED);
 	} else if (state == GST_STATE_PAUSED) {
 		gst_element_set_state(play, GST_STATE_PLAYING);
+		publish_state(GST_STATE_PLAYING);
 	} else {
 		tunes_play(queue_currently_playing());
 	}
@@ -165,6 +252,9 @@ static void play_pause_action(void) {
 
 static void stop_action(void) {
 	gst_element_set_state(play, GST_STATE_NULL);
+	gapless_cancel();
+	eos_at = 0;
+	publish_state(GST_STATE_NULL);
 	printf("\n");
 }
 
@@ -176,6 +266,19 @@ static void next_action(void) {
 	}
 }
 
+// next requested by the user, a tune left while playing counts as skipped
+static void skip_action(void) {
+	GstState state, pending;
+	gst_element_get_state(play, &state, &pending, GST_SECOND);
+
+	if (state == GST_STATE_PLAYING) {
+		increment_skipped(queue_currently_playing());
+		shuffle_rating_changed(player_index_db, queue_currently_playing());
+	}
+
+	next_action();
+}
+
 static void prev_action(void) {
 	bool rewind = false;
 	GstState state, pending;
@@ -203,6 +306,87 @@ static void rewind_action(void) {
 	tunes_play(queue_currently_playing());
 }
 
+// STREAM_START, a tune started playing. If it is the one about_to_finish
+// handed to playbin the one before played to the end and the queue moves on
+// to it.
+static void stream_started(void) {
+	g_mutex_lock(&gapless_mutex);
+	int64_t id = gapless_queued;
+	gint64 queued_at = gapless_queued_at;
+	gapless_queued = 0;
+	g_mutex_unlock(&gapless_mutex);
+
+	if (id == 0) return;
+
+	if (report_gaps) {
+		fprintf(stderr, "\ngapless: the next tune reached playbin %.1f ms before it started\n", (g_get_monotonic_time() - queued_at) / 1e3);
+	}
+
+	printf("\n");
+	increment_listened(queue_currently_playing());
+	shuffle_rating_changed(player_index_db, queue_currently_playing());
+	advance_queue(player_index_db);
+
+	queue_load_window();
+	const struct tune *t = cache_get(queue_currently_playing());
+	if ((t == NULL) || (t->id != id)) {
+		// the queue changed after the uri was handed, play what it says
+		if (!tunes_play(queue_currently_playing())) next_action();
+		return;
+	}
+	tune_started(t);
+}
+
+// the state of the last state event
+static const char *state_sent = NULL;
+
+// Sends a state event once the player settles in a state other than the last
+// one sent: the pass through READY between two tunes isn't one
+static void state_changed(void) {
+	GstState state, pending;
+	gst_element_get_state(play, &state, &pending, 0);
+	if (pending != GST_STATE_VOID_PENDING) return;
+
+	if ((state == GST_STATE_PLAYING) && (eos_at != 0)) {
+		if (report_gaps) fprintf(stderr, "\ngap: %.1f ms from the end of the tune to the next playing\n", (g_get_monotonic_time() - eos_at) / 1e3);
+		eos_at = 0;
+	}
+
+	const char *name = state_name(state);
+	if ((state_sent != NULL) && (strcmp(name, state_sent) == 0)) return;
+	state_sent = name;
+
+	if (events_subscribed()) {
+		GString *event = g_string_new(NULL);
+		g_string_printf(event, "state\t%s\n", name);
+		events_emit(event->str);
+		g_string_free(event, TRUE);
+	}
+}
+
+// The events a new subscriber, or one that lost some, starts from
+static void player_snapshot(GString *events) {
+	GstState state, pending;
+	gst_element_get_state(play, &state, &pending, 0);
+
+	track_event(events);
+	g_string_append_printf(events, "state\t%s\n", state_name(state));
+	queue_event(events);
+}
+
+static bool position_event(GString *event) {
+	GstState state, pending;
+	gst_element_get_state(play, &state, &pending, 0);
+	if (state != GST_STATE_PLAYING) return false;
+
+	gint64 pos, len;
+	if (!gst_element_query_position(play, GST_FORMAT_TIME, &pos)) return false;
+	g_string_append_printf(event, "position\t%.1f", pos / 1e9);
+	if (gst_element_query_duration(play, GST_FORMAT_TIME, &len)) g_string_append_printf(event, "\t%.1f", len / 1e9);
+	g_string_append_c(event, '\n');
+	return true;
+}
+
 static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer data) {
 	switch(GST_MESSAGE_TYPE(message)) {
 		case GST_MESSAGE_ERROR: {
@@ -220,15 +404,23 @@ static gboolean bus_callback(GstBus *bus, GstMessage *message, gpointer data) {
 
 		case GST_MESSAGE_EOS:
 		{
-			sqlite3_stmt *tune_select;
-			if (prepare_tune_select(&tune_select) == SQLITE_OK) {
-				increment_listened(player_index_db, tune_select, queue_currently_playing()->id);
-				sqlite3_finalize(tune_select);
-			}
+			// the tune after it couldn't be resolved in time, it starts anew
+			eos_at = g_get_monotonic_time();
+			increment_listened(queue_currently_playing());
+			shuffle_rating_changed(player_index_db, queue_currently_playing());
 			next_action();
 			break;
 		}
 
+		case GST_MESSAGE_STREAM_START:
+			stream_started();
+			break;
+
+		case GST_MESSAGE_STATE_CHANGED:
+			// the elements inside playbin post theirs too
+			if (GST_MESSAGE_SRC(message) == GST_OBJECT(play)) state_changed();
+			break;
+
 		default:
 			// unhandled message
 			break;
@@ -242,6 +434,8 @@ static gboolean cb_print_position(void *none) {
 
 	GstState state, pending;
 	gst_element_get_state(play, &state, &pending, GST_SECOND);
+	// every second, the position readers of the page extrapolate stays close
+	publish_state(state);
 	if (state != GST_STATE_PLAYING) return TRUE;
 
 	GstFormat fmt = GST_FORMAT_TIME;
@@ -266,15 +460,29 @@ static gboolean cb_print_position(void *none) {
 static void usage(void) {
 	fprintf(stderr, "minstrel [command] [arguments]\n");
 	fprintf(stderr, "commands:\n");
-	fprintf(stderr, "  start\t\tStart server instance\n");
+	fprintf(stderr, "  index [-j N] [--update] <dirs...>\tAdds music files to the library, probing tags with N threads\n");
+	fprintf(stderr, "\t\twith --update re-reads changed files and removes deleted ones, without dirs rescans the library\n");
+	fprintf(stderr, "  start [--watch]\tStart server instance, with --watch changes to the library directories are indexed as they happen\n");
 	fprintf(stderr, "  play\t\tRequests server to toggle between play and pause\n");
 	fprintf(stderr, "  next\t\tRequests server next track\n");
 	fprintf(stderr, "  prev\t\tRequests server previous track\n");
 	fprintf(stderr, "  rewind\t\tRestart current song\n");
 	fprintf(stderr, "  add <id1...>\tAdds songs to queue -- list song IDs on command line or on standard input (one per line)\n");
-	fprintf(stderr, "  search <query> Search for songs by full text matching of a query, output can be piped into add\n");
+	fprintf(stderr, "  insert <id1...>\tLike add, but the songs play right after the current one\n");
+	fprintf(stderr, "  remove <pos1...>\tRemoves the songs at the given queue positions\n");
+	fprintf(stderr, "  move <from> <to>\tMoves the song at queue position from to position to\n");
+	fprintf(stderr, "  status\tShows the state of the player, its current song and the position in it\n");
+	fprintf(stderr, "  now\t\tLike status, read from the page of shared memory the player keeps up to date\n");
+	fprintf(stderr, "  watch [--ticks <ms>]\tPrints the changes of song, state and queue as they happen, and the position every ms while playing\n");
+	fprintf(stderr, "  queue [<first>[-<last>]]\tShows the songs of the queue at these positions, 20 from the current one by default\n");
+	fprintf(stderr, "  search [--rank] [--fuzzy] <query> Search for songs by full text matching of a query, output can be piped into add\n");
+	fprintf(stderr, "\t\tartist:word matches a single tag, word* the start of words, --rank sorts by relevance,\n\t\t--fuzzy also matches words a typo or two away\n");
+	fprintf(stderr, "  find\t\tSearch as you type by words of the artist, album and title, enter adds the highlighted song, tab inserts it\n");
 	fprintf(stderr, "  where <expr>\tSearch for songs with a boolean query\n");
 	fprintf(stderr, "  addlast\tAdds results of last search to queue\n");
+	fprintf(stderr, "  most-listened [--since <N>d|<N>w] [--by artist|album] [page]\tSongs played the most, 20 per page\n");
+	fprintf(stderr, "  most-added [--since <N>d|<N>w] [--by artist|album] [page]\tSongs added to the queue the most\n");
+	fprintf(stderr, "  config [<key> [<value>|--reset]]\tShows or changes settings, without arguments lists them all\n");
 	fprintf(stderr, "  help\t\tThis message\n");
 }
 
@@ -303,12 +511,19 @@ static void g_streamer_begin(void) {
 	gst_bus_add_watch(bus, bus_callback, loop);
 	gst_object_unref(bus);
 
+	g_signal_connect(play, "about-to-finish", G_CALLBACK(about_to_finish), NULL);
+
 	g_timeout_add(1000, (GSourceFunc)cb_print_position, NULL);
 }
 
 static void g_streamer_end() {
 	gst_element_set_state(play, GST_STATE_NULL);
 	gst_object_unref(GST_OBJECT(play));
+
+	g_mutex_lock(&gapless_mutex);
+	g_free(gapless_uri);
+	gapless_uri = NULL;
+	g_mutex_unlock(&gapless_mutex);
 }
 
 static void dbus_signal_callback(GDBusProxy *proxy, gchar *sender_name, gchar *signal_name, GVariant *parameters, gpointer user_data) {
@@ -334,7 +549,7 @@ static void dbus_signal_callback(GDBusProxy *proxy, gchar *sender_name, gchar *s
 	} else if (strcmp(key, "Stop") == 0) {
 		stop_action();
 	} else if (strcmp(key, "Next") == 0) {
-		next_action();
+		skip_action();
 	} else if (strcmp(key, "Previous") == 0) {
 		prev_action();
 	}
@@ -369,17 +584,61 @@ static void dbus_register(void) {
 	g_signal_connect(proxy, "g-signal", G_CALLBACK(dbus_signal_callback), NULL);
 }
 
+// a tune added to the queue by the user
+static void queue_added(int64_t id) {
+	increment_added(id);
+	display_queue();
+	shuffle_rating_changed(player_index_db, id);
+}
+
+// Queues the ids of a batch as one change, with one redraw, and answers the
+// client with the number of ids queued
+static void queue_batch(int fd, struct sockaddr_un *client, socklen_t addrlen, const int64_t *command, ssize_t len) {
+	int64_t n = command[2];
+	const int64_t *ids = command + COMMAND_WORDS;
+	int64_t ack = -1;
+
+	if ((command[1] == BATCH_VERSION) && (n >= 0) && (n <= BATCH_MAX) && (len == (COMMAND_WORDS + n) * (ssize_t)sizeof(int64_t))) {
+		for (int64_t i = 0; i < n; ++i) {
+			if (command[0] == CMD_ADD_BATCH) {
+				queue_append(ids[i]);
+			} else {
+				// each goes right after the current tune, from the last
+				queue_insert_next(ids[n - 1 - i]);
+			}
+		}
+
+		// the tunes counted are loaded a cache full at a time
+		for (int64_t i = 0; i < n; ++i) {
+			if (i % CACHE_SIZE == 0) cache_load(ids + i, (n - i < CACHE_SIZE) ? n - i : CACHE_SIZE);
+			increment_added(ids[i]);
+			shuffle_rating_changed(player_index_db, ids[i]);
+		}
+
+		display_queue();
+		ack = n;
+	}
+
+	// a client that went away is not waited for
+	sendto(fd, &ack, sizeof(ack), MSG_DONTWAIT, (struct sockaddr *)client, addrlen);
+}
+
 static gboolean server_watch(GIOChannel *source, GIOCondition condition, void *ignored) {
-	int64_t command[2] = { 0, 0 };
+	// large enough for a batch
+	static int64_t command[COMMAND_WORDS + BATCH_MAX];
 	struct sockaddr_un src_addr;
 	socklen_t addrlen = sizeof(src_addr);
 
-	size_t bytes_read = recvfrom(g_io_channel_unix_get_fd(source), (void *)command, sizeof(command), 0, &src_addr, &addrlen);
+	memset(command, 0, COMMAND_WORDS * sizeof(int64_t));
+	ssize_t bytes_read = recvfrom(g_io_channel_unix_get_fd(source), (void *)command, sizeof(command), 0, &src_addr, &addrlen);
 
-	if (bytes_read != sizeof(command)) return TRUE;
+	// clients from before the move command send two words
+	if (bytes_read < (ssize_t)(sizeof(int64_t) * 2)) return TRUE;
 
 	//printf("\nControl interface: %zd [ %" PRId64 " %" PRId64 " ]\n", bytes_read, command[0], command[1]);
 
+	int prepares = stmt_prepares();
+
 	switch (command[0]) {
 	case CMD_HANDSHAKE: {
 		// Nothing to do with this
@@ -392,7 +651,7 @@ static gboolean server_watch(GIOChannel *source, GIOCondition condition, void *i
 		stop_action();
 		break;
 	case CMD_NEXT:
-		next_action();
+		skip_action();
 		break;
 	case CMD_REWIND:
 		rewind_action();
@@ -400,29 +659,80 @@ static gboolean server_watch(GIOChannel *source, GIOCondition condition, void *i
 	case CMD_PREV:
 		prev_action();
 		break;
-	case CMD_ADD: {
+	case CMD_ADD:
 		queue_append(command[1]);
-
-		sqlite3_stmt *tune_select;
-		if (prepare_tune_select(&tune_select) != SQLITE_OK) {
-			fprintf(stderr, "Sqlite3 error adding to queue: %s\n", sqlite3_errmsg(player_index_db));
-		} else {
-			increment_added(player_index_db, tune_select, command[1]);
-			display_queue(player_index_db, tune_select);
-			sqlite3_finalize(tune_select);
+		queue_added(command[1]);
+		break;
+	case CMD_INSERT:
+		queue_insert_next(command[1]);
+		queue_added(command[1]);
+		break;
+	case CMD_ADD_BATCH:
+	case CMD_INSERT_BATCH:
+		queue_batch(g_io_channel_unix_get_fd(source), &src_addr, addrlen, command, bytes_read);
+		break;
+	case CMD_REMOVE:
+		if (!queue_remove(command[1])) {
+			printf("\nCan not remove %" PRId64 " from the queue\n", command[1]);
+			break;
 		}
-
+		display_queue();
+		break;
+	case CMD_MOVE:
+		if (!queue_move(command[1], command[2])) {
+			printf("\nCan not move %" PRId64 " to %" PRId64 " in the queue\n", command[1], command[2]);
+			break;
+		}
+		display_queue();
 		break;
-	}
 
 	default:
 		printf("Received unknown command: %" PRId64 "\n", command[0]);
 	}
 
+	// the tune after the current one may not be the same anymore
+	gapless_prepare();
+
+	if (count_prepares) {
+		fprintf(stderr, "command %" PRId64 ": %d statements prepared\n", command[0], stmt_prepares() - prepares);
+	}
+
 	return TRUE;
 }
 
-static void start_player(void) {
+// called on the main loop with the changes the library watcher indexed
+static void library_changed(struct index_changes *changes) {
+	for (int i = 0; i < changes->n; ++i) {
+		cache_forget(changes->v[i].id);
+	}
+	// the tune drawn for the end of the queue could be one that went away,
+	// the new ones get their chance too, unless playbin already has it
+	g_mutex_lock(&gapless_mutex);
+	bool handed = (gapless_queued != 0);
+	g_mutex_unlock(&gapless_mutex);
+	if (!handed) queue_return_drawn();
+
+	shuffle_changes(player_index_db, changes);
+	prefix_changes(player_index_db, changes);
+	if (!handed) gapless_prepare();
+}
+
+// the player answers queries on the rpc socket, see query_command
+static void rpc_start(void);
+static void rpc_stop(void);
+
+static void start_player(int argc, char *argv[]) {
+	bool watch = false;
+
+	for (int i = 0; i < argc; ++i) {
+		if (strcmp(argv[i], "--watch") == 0) {
+			watch = true;
+		} else {
+			fprintf(stderr, "Unknown option to start: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	{
 		int fd = conn();
 		if (fd >= 0) {
@@ -433,9 +743,13 @@ static void start_player(void) {
 	}
 
 	term_init();
-	queue_init();
 	rating_init();
 	player_index_db = open_or_create_index_db();
+	stats_start(player_index_db);
+	cache_init(player_index_db);
+	bool restored = queue_init(player_index_db);
+	shuffle_init(player_index_db);
+	prefix_start();
 
 #ifdef USE_LIBNOTIFY
 	if (!notify_init(APPNAME)) {
@@ -449,26 +763,48 @@ static void start_player(void) {
 	g_streamer_init();
 	g_streamer_begin();
 	dbus_register();
+	now_open();
 
-	advance_queue(player_index_db);
-	tunes_play(queue_currently_playing());
+	// a restored queue resumes from the tune that was playing
+	if (!restored || !tunes_play(queue_currently_playing())) {
+		advance_queue(player_index_db);
+		tunes_play(queue_currently_playing());
+	}
 
 	int fd = serve();
 	serve_channel = g_io_channel_unix_new(fd);
 	serve_channel_source_id = g_io_add_watch(serve_channel, G_IO_IN|G_IO_ERR|G_IO_PRI|G_IO_HUP|G_IO_NVAL, (GIOFunc)server_watch, NULL);
+	events_start(player_snapshot, position_event);
+	rpc_start();
+
+	if (watch) {
+		watch_start(library_changed);
+	}
 
 	g_main_loop_run(loop);
+	rpc_stop();
+	events_stop();
+	watch_stop();
+	now_close();
 	g_streamer_end();
+	prefix_close();
+	shuffle_close();
+	queue_close();
+	stats_stop();
+	cache_close();
 
 	close(fd);
-	sqlite3_close(player_index_db);
+	close_db(player_index_db);
 }
 
-static void show_search_results(sqlite3_stmt *search_select) {
+// Prints the rows of search_select to out and, if save isn't NULL, runs it with the
+// id of each, returns false on sqlite errors
+static bool show_search_results(FILE *out, sqlite3_stmt *search_select, sqlite3_stmt *save) {
 	int64_t cs = 0;
 	char null_str[] = "(null)";
+	int r;
 
-	while (sqlite3_step(search_select) == SQLITE_ROW) {
+	while ((r = sqlite3_step(search_select)) == SQLITE_ROW) {
 		const char *cur_album = (const char *)sqlite3_column_text(search_select, 0);
 		const char *cur_artist = (const char *)sqlite3_column_text(search_select, 1);
 
@@ -478,231 +814,1289 @@ static void show_search_results(sqlite3_stmt *search_select) {
 		int64_t cur_cs = checksum(cur_album) + checksum(cur_artist);
 
 		if (cur_cs != cs) {
-			fputs("\nFrom ", stdout);
-			putctlcod("md", stdout);
-			fputs(cur_album, stdout);
-			putctlcod("me", stdout);
-			fputs(" by ", stdout);
-			putctlcod("md", stdout);
-			fputs(cur_artist, stdout);
-			putctlcod("me", stdout);
-			fputs("\n", stdout);
+			fputs("\nFrom ", out);
+			putctlcod("md", out);
+			fputs(cur_album, out);
+			putctlcod("me", out);
+			fputs(" by ", out);
+			putctlcod("md", out);
+			fputs(cur_artist, out);
+			putctlcod("me", out);
+			fputs("\n", out);
 
 			cs = cur_cs;
 		}
 
-		printf("%" PRId64 "\t%2d. ", (int64_t)sqlite3_column_int64(search_select, 15), sqlite3_column_int(search_select, 13));
-		putctlcod("md", stdout);
-		fputs((const char *)sqlite3_column_text(search_select, 12), stdout);
-		putctlcod("me", stdout);
-		fputs("\n", stdout);
+		int64_t id = sqlite3_column_int64(search_select, 15);
+
+		fprintf(out, "%" PRId64 "\t%2d. ", id, sqlite3_column_int(search_select, 13));
+		putctlcod("md", out);
+		fputs((const char *)sqlite3_column_text(search_select, 12), out);
+		putctlcod("me", out);
+		fputs("\n", out);
+
+		if (save != NULL) {
+			sqlite3_reset(save);
+			if (sqlite3_bind_int64(save, 1, id) != SQLITE_OK) return false;
+			if (sqlite3_step(save) != SQLITE_DONE) return false;
+		}
 	}
+
+	return r == SQLITE_DONE;
 }
 
-static void search_command(char *terms[], int n) {
-	int size = 1;
+// operators and phrases are passed to fts5 as they are
+static bool search_operator(const char *term) {
+	return (strcmp(term, "AND") == 0) || (strcmp(term, "OR") == 0) || (strcmp(term, "NOT") == 0) || (strpbrk(term, "\"()") != NULL);
+}
 
-	for (int i = 0; i < n; ++i) {
-		size += 1 + strlen(terms[i]);
+// the length of the column filter term starts with, colon included
+static size_t search_column(const char *term) {
+	static const char *columns[] = { "album", "artist", "album_artist", "comment", "composer", "copyright", "date", "disc", "encoder", "genre", "performer", "publisher", "title", "track" };
+
+	const char *colon = strchr(term, ':');
+	if (colon == NULL) return 0;
+
+	for (int i = 0; i < sizeof(columns)/sizeof(const char *); ++i) {
+		if ((strlen(columns[i]) == colon - term) && strstart(term, columns[i])) return colon - term + 1;
 	}
+	return 0;
+}
 
-	char *query = malloc(sizeof(char) * size);
-	oomp(query);
-	query[0] = '\0';
+// fts5 takes words of letters, digits and _ as they are: other terms are
+// quoted, keeping a column filter (title:) and a trailing * for prefixes
+static void search_term(GString *query, const char *term) {
+	if (search_operator(term)) {
+		g_string_append_printf(query, "%s ", term);
+		return;
+	}
 
-	for (int i = 0; i < n; ++i) {
-		strcat(query, terms[i]);
-		strcat(query, " ");
+	size_t column = search_column(term);
+	g_string_append_len(query, term, column);
+	term += column;
+
+	size_t len = strlen(term);
+	bool prefix = (len > 0) && (term[len-1] == '*');
+	if (prefix) --len;
+	if (len == 0) {
+		g_string_append(query, "\"\" ");
+		return;
 	}
 
-	term_init();
-	player_index_db = open_or_create_index_db();
+	bool bare = true;
+	for (size_t i = 0; i < len; ++i) {
+		unsigned char c = term[i];
+		if (!isalnum(c) && (c != '_') && (c < 0x80)) bare = false;
+	}
 
-	sqlite3_stmt *search_select;
-	if (sqlite3_prepare_v2(player_index_db, "select trim(album), trim(artist), trim(album_artist), trim(comment), trim(composer), trim(copyright), trim(date), trim(disc), trim(encoder), trim(genre), trim(performer), trim(publisher), trim(title), trim(track), filename, tunes.id from tunes, ridx where tunes.id = ridx.id and any match ? order by artist, album, cast(track as integer) asc", -1, &search_select, NULL) != SQLITE_OK) goto search_sqlite3_failure;
+	if (bare) {
+		g_string_append_len(query, term, len);
+	} else {
+		g_string_append_c(query, '"');
+		for (size_t i = 0; i < len; ++i) {
+			g_string_append_c(query, term[i]);
+		}
+		g_string_append_c(query, '"');
+	}
+	g_string_append(query, prefix ? "* " : " ");
+}
 
-	if (sqlite3_bind_text(search_select, 1, query, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto search_sqlite3_failure;
+// Each word of term, split like fidx splits tags, matches the terms close to
+// it; the ones it stands for are written to err when they are not just the
+// word. Operators, phrases and prefixes are left as they are. Returns false
+// on sqlite errors.
+static bool search_fuzzy_term(sqlite3 *db, GString *query, FILE *err, const char *term) {
+	size_t len = strlen(term);
+	if (search_operator(term) || ((len > 0) && (term[len-1] == '*'))) {
+		search_term(query, term);
+		return true;
+	}
 
-	show_search_results(search_select);
+	size_t column = search_column(term);
+	char *words = strdup(term + column);
+	oomp(words);
+	GString *group = g_string_new(NULL), *terms = g_string_new(NULL);
+	bool ok = true;
+
+	char *word = words;
+	while (ok && (*word != '\0')) {
+		char *end = word;
+		while ((*end != '\0') && (isalnum((unsigned char)*end) || ((unsigned char)*end >= 0x80))) ++end;
+		bool last = (*end == '\0');
+		*end = '\0';
+
+		if (*word != '\0') {
+			if (group->len > 0) g_string_append(group, " AND ");
+			g_string_truncate(terms, 0);
+			int n = fuzzy_match(db, word, group, terms);
+			if (n < 0) {
+				ok = false;
+			} else if (n == 0) {
+				// nothing is close, the word is looked up as it is and matches nothing
+				g_string_append_printf(group, "\"%s\"", word);
+				fprintf(err, "%s: no close term\n", word);
+			} else if (g_ascii_strcasecmp(terms->str, word) != 0) {
+				fprintf(err, "%s: %s\n", word, terms->str);
+			}
+		}
 
-	sqlite3_finalize(search_select);
+		word = last ? end : end + 1;
+	}
+
+	if (group->len == 0) {
+		search_term(query, term);
+	} else {
+		g_string_append_len(query, term, column);
+		g_string_append_printf(query, "(%s) ", group->str);
+	}
+
+	g_string_free(group, TRUE);
+	g_string_free(terms, TRUE);
+	free(words);
+	return ok;
+}
 
+// fts5 only ANDs phrases implicitly, the groups of fuzzy terms are joined
+// explicitly unless an operator or a bracket is in between
+static bool search_fuzzy_and(const char *previous, const char *term) {
+	size_t len = strlen(previous);
+	if ((strcmp(previous, "AND") == 0) || (strcmp(previous, "OR") == 0) || (strcmp(previous, "NOT") == 0) || ((len > 0) && (previous[len-1] == '('))) return false;
+	return (strcmp(term, "AND") != 0) && (strcmp(term, "OR") != 0) && (strcmp(term, "NOT") != 0) && (term[0] != ')');
+}
+
+// The commands answering a query run in the player when it is running, with
+// its connections to the index, or else in the client. They write to out
+// and err and return the exit status.
+
+static int search_query(sqlite3 *db, FILE *out, FILE *err, char *terms[], int n) {
+	bool rank = false, fuzzy = false;
+	GString *query = g_string_new(NULL);
+	char *select_query = NULL;
+	sqlite3_stmt *search_select = NULL, *search_save = NULL;
 	char *errmsg = NULL;
-	sqlite3_exec(player_index_db, "DELETE FROM search_save;", NULL, NULL, &errmsg);
+
+	for (int i = 0; i < n; ++i) {
+		if (strcmp(terms[i], "--rank") == 0) {
+			rank = true;
+		} else if (strcmp(terms[i], "--fuzzy") == 0) {
+			fuzzy = true;
+		}
+	}
+
+	const char *previous = NULL;
+	for (int i = 0; i < n; ++i) {
+		if ((strcmp(terms[i], "--rank") == 0) || (strcmp(terms[i], "--fuzzy") == 0)) continue;
+		if (!fuzzy) {
+			search_term(query, terms[i]);
+			continue;
+		}
+
+		if ((previous != NULL) && search_fuzzy_and(previous, terms[i])) g_string_append(query, "AND ");
+		if (!search_fuzzy_term(db, query, err, terms[i])) goto search_sqlite3_failure;
+		previous = terms[i];
+	}
+
+	// bm25 with the title weighing the most, then the artist and the album
+	const char *order = rank ? "bm25(fidx, 2, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 4, 1)" : "sort_artist, sort_album, disc_no, track_no";
+	asprintf(&select_query, "select tunes.album, tunes.artist, tunes.album_artist, tunes.comment, tunes.composer, tunes.copyright, tunes.date, tunes.disc, tunes.encoder, tunes.genre, tunes.performer, tunes.publisher, tunes.title, tunes.track, tunes.filename, tunes.id "
+		"from fidx join tunes on tunes.id = fidx.rowid where fidx match ? order by %s", order);
+	oomp(select_query);
+
+	// the query runs once, each row is printed and saved for addlast as it
+	// comes, the saved results are replaced in one transaction that takes the
+	// write lock first: two searches at once wait for each other
+	sqlite3_exec(db, "BEGIN IMMEDIATE; DELETE FROM search_save;", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto search_sqlite3_failure;
 
-	sqlite3_stmt *search_save;
-	if (sqlite3_prepare_v2(player_index_db, "INSERT INTO search_save(id) SELECT tunes.id FROM tunes, ridx WHERE tunes.id = ridx.id AND any MATCH ? ORDER BY artist, album, cast(track as integer) ASC;", -1, &search_save, NULL) != SQLITE_OK) goto search_sqlite3_failure;
+	search_select = stmt_get(db, select_query);
+	if (search_select == NULL) goto search_sqlite3_failure;
+	search_save = stmt_get(db, "INSERT INTO search_save(id) VALUES (?);");
+	if (search_save == NULL) goto search_sqlite3_failure;
 
-	if (sqlite3_bind_text(search_save, 1, query, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto search_sqlite3_failure;
+	if (sqlite3_bind_text(search_select, 1, query->str, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto search_sqlite3_failure;
 
-	if (sqlite3_step(search_save) != SQLITE_DONE) goto search_sqlite3_failure;
+	if (!show_search_results(out, search_select, search_save)) goto search_sqlite3_failure;
 
-	sqlite3_finalize(search_save);
+	sqlite3_reset(search_select);
+	sqlite3_reset(search_save);
 
-	sqlite3_close(player_index_db);
-	free(query);
+	sqlite3_exec(db, "COMMIT;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto search_sqlite3_failure;
 
-	return;
+	g_string_free(query, TRUE);
+	free(select_query);
+
+	return EXIT_SUCCESS;
 
 search_sqlite3_failure:
 
-	fprintf(stderr, "Sqlite3 error while searching: %s\n", sqlite3_errmsg(player_index_db));
-	sqlite3_close(player_index_db);
-	exit(EXIT_FAILURE);
+	fprintf(err, "Sqlite3 error while searching: %s\n", sqlite3_errmsg(db));
+	sqlite3_free(errmsg);
+	// the player keeps using the connection
+	if (search_select != NULL) sqlite3_reset(search_select);
+	if (search_save != NULL) sqlite3_reset(search_save);
+	if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+	g_string_free(query, TRUE);
+	free(select_query);
+	return EXIT_FAILURE;
 }
 
-static void where_command(const char *clause) {
-	term_init();
-	player_index_db = open_or_create_index_db();
+// any, the full text index, is fidx under another name: MATCH on it goes to
+// fidx. The join costs a scan of fidx, it is only made for clauses that can
+// use it.
+#define WHERE_ANY_JOIN ", (select rowid as any_rowid, fidx as \"any\" from fidx) where any_rowid = tunes.id and"
 
+static int where_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
 	char *query;
 
-	if (clause != NULL) {
-		asprintf(&query, "select trim(album), trim(artist), trim(album_artist), trim(comment), trim(composer), trim(copyright), trim(date), trim(disc), trim(encoder), trim(genre), trim(performer), trim(publisher), trim(title), trim(track), filename, tunes.id from tunes, ridx where tunes.id = ridx.id and (%s) order by artist, album, cast(track as integer) asc", clause);
+	if (n > 0) {
+		asprintf(&query, "select album, artist, album_artist, comment, composer, copyright, date, disc, encoder, genre, performer, publisher, title, track, filename, tunes.id from tunes%s (%s) order by sort_artist, sort_album, disc_no, track_no", (strcasestr(args[0], "any") != NULL) ? WHERE_ANY_JOIN : " where", args[0]);
 	} else {
-		asprintf(&query, "select trim(album), trim(artist), trim(album_artist), trim(comment), trim(composer), trim(copyright), trim(date), trim(disc), trim(encoder), trim(genre), trim(performer), trim(publisher), trim(title), trim(track), filename, tunes.id from tunes, ridx where tunes.id = ridx.id order by artist, album, cast(track as integer) asc");
+		asprintf(&query, "select album, artist, album_artist, comment, composer, copyright, date, disc, encoder, genre, performer, publisher, title, track, filename, tunes.id from tunes order by sort_artist, sort_album, disc_no, track_no");
 	}
 	oomp(query);
 
-	sqlite3_stmt *search_select;
-	if (sqlite3_prepare_v2(player_index_db, query, -1, &search_select, NULL) != SQLITE_OK) goto where_sqlite3_failure;
+	// every clause is new SQL, kept among the shared statements of a
+	// connection that lives as long as the player they would pile up
+	sqlite3_stmt *search_select = NULL;
+	if (sqlite3_prepare_v2(db, query, -1, &search_select, NULL) != SQLITE_OK) goto where_sqlite3_failure;
 
-	show_search_results(search_select);
+	if (!show_search_results(out, search_select, NULL)) goto where_sqlite3_failure;
 
 	sqlite3_finalize(search_select);
 	free(query);
-	sqlite3_close(player_index_db);
 
-	return;
+	return EXIT_SUCCESS;
 
 where_sqlite3_failure:
 
-	fprintf(stderr, "Sqlite3 error: %s\n", sqlite3_errmsg(player_index_db));
-	sqlite3_close(player_index_db);
+	fprintf(err, "Sqlite3 error: %s\n", sqlite3_errmsg(db));
+	sqlite3_finalize(search_select);
 	free(query);
-	return;
+	return EXIT_FAILURE;
 }
 
-static void add_command(int argc, char *argv[]) {
-	int fd = conn();
-	if (fd == -1) {
-		fprintf(stderr, "Couldn't connect to server\n");
-		exit(EXIT_FAILURE);
-	}
-
+// Calls f with each song ID listed on the command line or, if there are none,
+// at the start of the lines of standard input that have a tab after it (the
+// output of search). Standard input is read a buffer at a time, a line can
+// span two of them.
+static void each_id(int argc, char *argv[], void (*f)(int64_t id, void *data), void *data) {
 	if (argc > 0) {
 		for (int i = 0; i < argc; ++i) {
-			send_add(fd, (int64_t)atoll(argv[i]));
+			f((int64_t)atoll(argv[i]), data);
 		}
-	} else {
-#define LINEBUF 40
-		char buf[LINEBUF];
-		int i = 0;
-		int r;
-
-		while ((r = getchar()) != EOF) {
-			if (i < LINEBUF-1)
-				buf[i++] = r;
-			if (r == '\n') {
-				buf[i] = '\0';
-				if (isdigit(buf[0])) {
-					char *tab = strchr(buf, '\t');
-					if (tab != NULL) {
-						*tab = '\0';
-						send_add(fd, (int64_t)atoll(buf));
-					}
-				}
-				i = 0;
+		return;
+	}
+
+	static char buf[65536];
+	enum { LINE_START, LINE_ID, LINE_REST } state = LINE_START;
+	int64_t id = 0;
+	size_t r;
+
+	while ((r = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+		size_t i = 0;
+		while (i < r) {
+			if (state == LINE_REST) {
+				char *newline = memchr(buf + i, '\n', r - i);
+				if (newline == NULL) break;
+				i = newline - buf + 1;
+				state = LINE_START;
+				continue;
+			}
+
+			unsigned char c = buf[i++];
+			if (isdigit(c)) {
+				id = ((state == LINE_START) ? 0 : id * 10) + (c - '0');
+				state = LINE_ID;
+			} else if (c == '\n') {
+				state = LINE_START;
+			} else {
+				if ((state == LINE_ID) && (c == '\t')) f(id, data);
+				state = LINE_REST;
 			}
 		}
 	}
-	close(fd);
 }
 
-static void addlast_command(void) {
+static int conn_or_exit(void) {
 	int fd = conn();
 	if (fd == -1) {
 		fprintf(stderr, "Couldn't connect to server\n");
 		exit(EXIT_FAILURE);
 	}
+	return fd;
+}
+
+// ids sent BATCH_MAX at a time, each batch waiting for the player
+struct id_batch {
+	int fd;
+	int64_t code;
+	int n;
+	int64_t ids[BATCH_MAX];
+};
+
+static void batch_flush(struct id_batch *b) {
+	if (b->n == 0) return;
+	if (!send_batch(b->fd, b->code, b->ids, b->n)) exit(EXIT_FAILURE);
+	b->n = 0;
+}
+
+static void batch_one(int64_t id, void *data) {
+	struct id_batch *b = data;
+	b->ids[b->n++] = id;
+	if (b->n == BATCH_MAX) batch_flush(b);
+}
+
+static void add_command(int argc, char *argv[]) {
+	struct id_batch *b = malloc(sizeof(struct id_batch));
+	oomp(b);
+	b->fd = conn_or_exit();
+	b->code = CMD_ADD_BATCH;
+	b->n = 0;
+
+	each_id(argc, argv, batch_one, b);
+	batch_flush(b);
+
+	close(b->fd);
+	free(b);
+}
+
+static void insert_one(int64_t id, void *data) {
+	g_array_append_val((GArray *)data, id);
+}
+
+static void insert_command(int argc, char *argv[]) {
+	GArray *ids = g_array_new(FALSE, FALSE, sizeof(int64_t));
+	each_id(argc, argv, insert_one, ids);
+
+	// each batch goes right after the current tune, sending them from the
+	// last leaves them in the order they were listed
+	int fd = conn_or_exit();
+	for (int end = ids->len; end > 0; end -= BATCH_MAX) {
+		int start = (end > BATCH_MAX) ? end - BATCH_MAX : 0;
+		if (!send_batch(fd, CMD_INSERT_BATCH, &g_array_index(ids, int64_t, start), end - start)) exit(EXIT_FAILURE);
+	}
+	close(fd);
+
+	g_array_free(ids, TRUE);
+}
+
+static int position_compare_desc(const void *a, const void *b) {
+	int64_t pa = *(const int64_t *)a, pb = *(const int64_t *)b;
+	return (pa < pb) - (pa > pb);
+}
+
+static bool parse_position(const char *arg, int64_t *pos) {
+	char *end;
+	*pos = strtoll(arg, &end, 10);
+	if ((end == arg) || (*end != '\0') || (*pos < 0)) {
+		fprintf(stderr, "Not a queue position: %s\n", arg);
+		return false;
+	}
+	return true;
+}
+
+static void remove_command(int argc, char *argv[]) {
+	if (argc < 1) {
+		fprintf(stderr, "Wrong number of arguments to 'remove'\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t *positions = malloc(sizeof(int64_t) * argc);
+	oomp(positions);
+	for (int i = 0; i < argc; ++i) {
+		if (!parse_position(argv[i], positions + i)) exit(EXIT_FAILURE);
+	}
+
+	// removing a tune shifts the ones after it, go from the last
+	qsort(positions, argc, sizeof(int64_t), position_compare_desc);
+
+	int fd = conn_or_exit();
+	for (int i = 0; i < argc; ++i) {
+		if ((i > 0) && (positions[i] == positions[i-1])) continue;
+		send_command(fd, CMD_REMOVE, positions[i], 0);
+	}
+	close(fd);
+
+	free(positions);
+}
+
+static void move_command(int argc, char *argv[]) {
+	if (argc != 2) {
+		fprintf(stderr, "Wrong number of arguments to 'move'\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t from, to;
+	if (!parse_position(argv[0], &from) || !parse_position(argv[1], &to)) exit(EXIT_FAILURE);
+
+	int fd = conn_or_exit();
+	send_command(fd, CMD_MOVE, from, to);
+	close(fd);
+}
+
+static void addlast_command(void) {
+	struct id_batch *b = malloc(sizeof(struct id_batch));
+	oomp(b);
+	b->fd = conn_or_exit();
+	b->code = CMD_ADD_BATCH;
+	b->n = 0;
 
 	player_index_db = open_or_create_index_db();
 
-	sqlite3_stmt *select;
-	if (sqlite3_prepare_v2(player_index_db, "SELECT id FROM search_save ORDER BY counter;", -1, &select, NULL) != SQLITE_OK) goto addlast_command_sqlite3_failure;
+	sqlite3_stmt *select = stmt_get(player_index_db, "SELECT id FROM search_save ORDER BY counter;");
+	if (select == NULL) goto addlast_command_sqlite3_failure;
 
 	while (sqlite3_step(select) == SQLITE_ROW) {
-		send_add(fd, (int64_t)sqlite3_column_int64(select, 0));
+		batch_one((int64_t)sqlite3_column_int64(select, 0), b);
 	}
+	batch_flush(b);
 
-	sqlite3_finalize(select);
-	sqlite3_close(player_index_db);
-	close(fd);
+	sqlite3_reset(select);
+	close_db(player_index_db);
+	close(b->fd);
+	free(b);
 
 	return;
 
 addlast_command_sqlite3_failure:
 
 	fprintf(stderr, "Sqlite error: %s\n", sqlite3_errmsg(player_index_db));
-	sqlite3_close(player_index_db);
-	close(fd);
+	close_db(player_index_db);
+	close(b->fd);
+	free(b);
 }
 
 #define PAGESZ 20
 
-static void most_command(const char *kind, char *args[], int n) {
+// Lifetime counts come from the rating table, with --since or --by they are
+// added up from the daily and weekly totals of the history
+static int most_query(const char *kind, sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
 	char *sort_query = NULL;
 	int page = 0;
+	int64_t since = 0; // days
+	const char *by = NULL;
 
-	player_index_db = open_or_create_index_db();
-	rating_init();
-
-	if (n > 0) {
-		page = atoi(args[0]);
-		if (page < 0) {
-			page = 0;
+	for (int i = 0; i < n; ++i) {
+		if ((strcmp(args[i], "--since") == 0) && (i + 1 < n)) {
+			char *end;
+			since = strtoll(args[++i], &end, 10);
+			if (*end == 'w') {
+				since *= 7;
+				++end;
+			} else if (*end == 'd') {
+				++end;
+			}
+			if ((since <= 0) || (*end != '\0')) {
+				fprintf(err, "--since takes a number of days (30d) or weeks (4w)\n");
+				return EXIT_FAILURE;
+			}
+		} else if ((strcmp(args[i], "--by") == 0) && (i + 1 < n)) {
+			by = args[++i];
+			if ((strcmp(by, "artist") != 0) && (strcmp(by, "album") != 0)) {
+				fprintf(err, "--by takes artist or album\n");
+				return EXIT_FAILURE;
+			}
+		} else {
+			page = atoi(args[i]);
+			if (page < 0) {
+				page = 0;
+			}
 		}
 	}
 
-	sqlite3_stmt *sort_stmt, *tune_select, *find_id_stmt;
-
-	asprintf(&sort_query, "SELECT filename, %s FROM rating ORDER BY %s DESC LIMIT %d OFFSET %d;", kind, kind, PAGESZ, page*PAGESZ);
+	sqlite3_stmt *sort_stmt = NULL;
+	bool history = (since > 0) || (by != NULL);
+	// whole weeks are counted from the weekly totals, the days before the
+	// first one from the daily totals, a week starts on day 7 * week - 3
+	int64_t first_day = 0, first_week = 0;
+
+	// one query per kind, the page is bound, rows are name, count and the
+	// tune's columns, NULL for a file no longer in the index or with --by
+	if (!history) {
+		asprintf(&sort_query, "SELECT r.filename, r.%s, t.id, t.album, t.artist, t.title, t.track FROM rating.rating r LEFT JOIN tunes t ON t.track_key = r.track_key "
+			"ORDER BY r.%s DESC LIMIT ?5 OFFSET ?6;", kind, kind);
+	} else {
+		asprintf(&sort_query, "SELECT r.name, r.n, t.id, t.album, t.artist, t.title, t.track FROM "
+			"(SELECT name, sum(n) n FROM (SELECT name, %s n FROM rating.rollup_daily WHERE what = ?1 AND day >= ?2 AND day < ?3 "
+			"UNION ALL SELECT name, %s FROM rating.rollup_weekly WHERE what = ?1 AND week >= ?4) GROUP BY 1 ORDER BY 2 DESC LIMIT ?5 OFFSET ?6) r "
+			"LEFT JOIN tunes t ON ?1 = %d AND t.filename = r.name ORDER BY r.n DESC;", kind, kind, ROLLUP_TUNE);
+
+		if (since > 0) {
+			int64_t keep_daily = setting_get_double(db, "history.daily");
+			first_day = stats_day(time(NULL)) - since + 1;
+			first_week = stats_week(first_day * 86400);
+			if ((keep_daily > 0) && (since > keep_daily)) {
+				// the daily totals are gone, count the whole first week
+				first_day = 7 * first_week - 3;
+			} else if (7 * first_week - 3 < first_day) {
+				++first_week;
+			}
+		}
+	}
 	oomp(sort_query);
 
-	if (prepare_tune_select(&tune_select) != SQLITE_OK) goto most_command_failed;
-	if (sqlite3_prepare_v2(rating_db, sort_query, -1, &sort_stmt, NULL) != SQLITE_OK) goto most_command_failed;
-	if (sqlite3_prepare_v2(player_index_db, "SELECT id FROM tunes WHERE filename = ?;", -1, &find_id_stmt, NULL) != SQLITE_OK) goto most_command_failed;
+	sort_stmt = stmt_get(db, sort_query);
+	if (sort_stmt == NULL) goto most_command_failed;
+	if (history) {
+		enum stats_rollup what = (by == NULL) ? ROLLUP_TUNE : (strcmp(by, "artist") == 0) ? ROLLUP_ARTIST : ROLLUP_ALBUM;
+		if (sqlite3_bind_int(sort_stmt, 1, what) != SQLITE_OK) goto most_command_failed;
+		if (sqlite3_bind_int64(sort_stmt, 2, first_day) != SQLITE_OK) goto most_command_failed;
+		if (sqlite3_bind_int64(sort_stmt, 3, 7 * first_week - 3) != SQLITE_OK) goto most_command_failed;
+		if (sqlite3_bind_int64(sort_stmt, 4, first_week) != SQLITE_OK) goto most_command_failed;
+	}
+	if (sqlite3_bind_int(sort_stmt, 5, PAGESZ) != SQLITE_OK) goto most_command_failed;
+	if (sqlite3_bind_int(sort_stmt, 6, page*PAGESZ) != SQLITE_OK) goto most_command_failed;
 
 	while (sqlite3_step(sort_stmt) == SQLITE_ROW) {
-		int64_t id;
-		const char *filename = (const char *)sqlite3_column_text(sort_stmt, 0);
+		const char *name = (const char *)sqlite3_column_text(sort_stmt, 0);
 		int64_t count = sqlite3_column_int64(sort_stmt, 1);
 
-		sqlite3_reset(find_id_stmt);
-		if (sqlite3_bind_text(find_id_stmt, 1, filename, -1, SQLITE_TRANSIENT) != SQLITE_OK) {
-			printf("%ld. UNKNOWN FILE %s\n", count, filename);
-			continue;
-		}
-		if (sqlite3_step(find_id_stmt) != SQLITE_ROW) {
-			printf("%ld. UNKNOWN FILE %s\n", count, filename);
-			continue;
+		if (by != NULL) {
+			fprintf(out, "%" PRId64 ". %s\n", count, name);
+		} else if (sqlite3_column_type(sort_stmt, 2) != SQLITE_NULL) {
+			struct tune t = {
+				sqlite3_column_int64(sort_stmt, 2),
+				(const char *)sqlite3_column_text(sort_stmt, 3),
+				(const char *)sqlite3_column_text(sort_stmt, 4),
+				(const char *)sqlite3_column_text(sort_stmt, 5),
+				(const char *)sqlite3_column_text(sort_stmt, 6),
+				name,
+				0,
+			};
+			print_tune(out, &t, false, count);
+		} else {
+			fprintf(out, "%" PRId64 ". UNKNOWN FILE %s\n", count, name);
 		}
-		id = sqlite3_column_int64(find_id_stmt, 0);
-
-		print_tune(player_index_db, tune_select, id, false, count);
 	}
 
-	sqlite3_finalize(tune_select);
-	sqlite3_finalize(sort_stmt);
-	sqlite3_finalize(find_id_stmt);
+	sqlite3_reset(sort_stmt);
 	free(sort_query);
 
-	return;
+	return EXIT_SUCCESS;
 
 most_command_failed:
-	fprintf(stderr, "most failed\n");
-	return;
+	fprintf(err, "most failed: %s\n", sqlite3_errmsg(db));
+	if (sort_stmt != NULL) sqlite3_reset(sort_stmt);
+	free(sort_query);
+	return EXIT_FAILURE;
+}
+
+#define FIND_MAX 200
+
+// Writes a tag on a line of find_query's answer
+static void find_field(FILE *out, const char *tag) {
+	if (tag == NULL) return;
+	for (const char *c = tag; *c != '\0'; ++c) {
+		fputc(((*c == '\t') || (*c == '\n')) ? ' ' : *c, out);
+	}
+}
+
+// The tunes from the prefix index for the query in args[0]: their number and
+// then up to args[1] lines of id, title, artist and album separated by tabs
+static int find_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
+	int max = (n > 1) ? atoi(args[1]) : FIND_MAX;
+	if ((max <= 0) || (max > FIND_MAX)) max = FIND_MAX;
+
+	int64_t ids[FIND_MAX];
+	int found = prefix_find((n > 0) ? args[0] : "", ids, max);
+	fprintf(out, "%d\n", found);
+
+	sqlite3_stmt *select = stmt_get(db, "SELECT title, artist, album FROM tunes WHERE id = ?;");
+	if (select == NULL) goto find_query_failure;
+
+	for (int i = 0; (i < found) && (i < max); ++i) {
+		if (sqlite3_bind_int64(select, 1, ids[i]) != SQLITE_OK) goto find_query_failure;
+		if (sqlite3_step(select) == SQLITE_ROW) {
+			fprintf(out, "%" PRId64, ids[i]);
+			for (int col = 0; col < 3; ++col) {
+				fputc('\t', out);
+				find_field(out, (const char *)sqlite3_column_text(select, col));
+			}
+			fputc('\n', out);
+		}
+		sqlite3_reset(select);
+	}
+
+	return EXIT_SUCCESS;
+
+find_query_failure:
+
+	fprintf(err, "Sqlite3 error: %s\n", sqlite3_errmsg(db));
+	if (select != NULL) sqlite3_reset(select);
+	return EXIT_FAILURE;
+}
+
+// The state of the player and its current tune, one "Key: value" per line
+// with the keys /tmp/minstrel.currently has. Position and Duration are in
+// seconds.
+static int status_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
+	GstState state, pending;
+	// the state as it is, without waiting for a change in progress
+	gst_element_get_state(play, &state, &pending, 0);
+	fprintf(out, "State: %s\n", state_name(state));
+
+	int64_t id = queue_currently_playing();
+	const struct tune *t = (id != 0) ? cache_get(id) : NULL;
+	if (t != NULL) {
+		fprintf(out, "Index: %" PRId64 "\n", queue_currently_playing_pos());
+		fprintf(out, "Id: %" PRId64 "\n", t->id);
+		fprintf(out, "Title: %s\n", t->title);
+		fprintf(out, "Author: %s\n", t->artist);
+		fprintf(out, "Album: %s\n", t->album);
+		fprintf(out, "Track: %s\n", t->track);
+	}
+
+	gint64 pos, len;
+	if ((state == GST_STATE_PLAYING) || (state == GST_STATE_PAUSED)) {
+		if (gst_element_query_position(play, GST_FORMAT_TIME, &pos)) fprintf(out, "Position: %.1f\n", pos / 1e9);
+		if (gst_element_query_duration(play, GST_FORMAT_TIME, &len)) fprintf(out, "Duration: %.1f\n", len / 1e9);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+// lines of the queue shown without a range, and at most
+#define QUEUE_PAGE 20
+#define QUEUE_RANGE_MAX 1000
+
+// The tunes of the queue at the positions of args[0], first-last or first,
+// from the current one if there is none
+static int queue_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
+	int64_t first = queue_currently_playing_pos(), last;
+	if (first < 0) first = 0;
+	last = first + QUEUE_PAGE - 1;
+
+	if (n > 0) {
+		char *end;
+		first = strtoll(args[0], &end, 10);
+		if ((end != args[0]) && (*end == '-')) {
+			char *to = end + 1;
+			last = strtoll(to, &end, 10);
+			if (end == to) end = to - 1;
+		} else {
+			last = first + QUEUE_PAGE - 1;
+		}
+		if ((end == args[0]) || (*end != '\0') || (first < 0) || (last < first)) {
+			fprintf(err, "Not a range of queue positions: %s\n", args[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (last - first >= QUEUE_RANGE_MAX) last = first + QUEUE_RANGE_MAX - 1;
+	queue_print(out, first, last + 1);
+	return EXIT_SUCCESS;
+}
+
+static int most_added_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
+	return most_query("added", db, out, err, args, n);
+}
+
+static int most_listened_query(sqlite3 *db, FILE *out, FILE *err, char *args[], int n) {
+	return most_query("listened", db, out, err, args, n);
+}
+
+static const struct query_command {
+	int64_t code;
+	bool rating; // attaches the rating db
+	bool player; // about the player's state, only it can answer
+	int (*run)(sqlite3 *db, FILE *out, FILE *err, char *args[], int n);
+} QUERY_COMMANDS[] = {
+	{ CMD_SEARCH, false, false, search_query },
+	{ CMD_WHERE, false, false, where_query },
+	{ CMD_MOST_ADDED, true, false, most_added_query },
+	{ CMD_MOST_LISTENED, true, false, most_listened_query },
+	{ CMD_FIND, false, false, find_query },
+	{ CMD_STATUS, false, true, status_query },
+	{ CMD_QUEUE, false, true, queue_query },
+	{ 0, false, false, NULL },
+};
+
+static const struct query_command *query_command_find(int64_t code) {
+	for (const struct query_command *c = QUERY_COMMANDS; c->run != NULL; ++c) {
+		if (c->code == code) return c;
+	}
+	return NULL;
+}
+
+// Threads answering the queries sent to the player, each takes a connection
+// to the index from rpc_dbs and gives it back when done: they stay open, with
+// their statements prepared and their page caches warm
+#define RPC_THREADS 4
+// a client not taking its answer for this long is dropped
+#define RPC_TIMEOUT 10
+
+static int rpc_fd = -1;
+static guint rpc_source_id;
+static GThreadPool *rpc_pool = NULL;
+static GAsyncQueue *rpc_dbs = NULL;
+// requests accepted and not answered yet
+static gint rpc_pending = 0;
+
+// The queries about the player run on the main loop, that owns its state,
+// with the player's connection to the index. The thread answering the
+// request waits for the output, collected in memory so that a slow client
+// never holds up the main loop.
+struct player_query {
+	const struct query_command *c;
+	char **args;
+	int n;
+	char *out, *err;
+	size_t out_len, err_len;
+	int status;
+	bool done;
+	GMutex mutex;
+	GCond cond;
+};
+
+static gboolean player_query_run(gpointer data) {
+	struct player_query *q = data;
+
+	FILE *out = open_memstream(&q->out, &q->out_len);
+	FILE *err = open_memstream(&q->err, &q->err_len);
+	oomp(out);
+	oomp(err);
+	q->status = q->c->run(player_index_db, out, err, q->args, q->n);
+	fclose(out);
+	fclose(err);
+
+	g_mutex_lock(&q->mutex);
+	q->done = true;
+	g_cond_signal(&q->cond);
+	g_mutex_unlock(&q->mutex);
+
+	return G_SOURCE_REMOVE;
+}
+
+static int player_query(const struct query_command *c, FILE *out, FILE *err, char *args[], int n) {
+	struct player_query q = { c, args, n, NULL, NULL, 0, 0, EXIT_FAILURE, false };
+	g_mutex_init(&q.mutex);
+	g_cond_init(&q.cond);
+
+	g_main_context_invoke(NULL, player_query_run, &q);
+
+	g_mutex_lock(&q.mutex);
+	while (!q.done) g_cond_wait(&q.cond, &q.mutex);
+	g_mutex_unlock(&q.mutex);
+
+	fwrite(q.out, 1, q.out_len, out);
+	fwrite(q.err, 1, q.err_len, err);
+	free(q.out);
+	free(q.err);
+	g_mutex_clear(&q.mutex);
+	g_cond_clear(&q.cond);
+
+	return q.status;
+}
+
+static sqlite3 *rpc_db_open(void) {
+	sqlite3 *db = open_or_create_index_db();
+	rating_attach(db);
+	return db;
+}
+
+// A watch request has the interval of the position ticks in milliseconds, if
+// the client wants them
+static void rpc_subscribe(int fd, char *args[], int n) {
+	long tick_ms = 0;
+	if (n > 0) {
+		char *end;
+		tick_ms = strtol(args[0], &end, 10);
+		if ((n > 1) || (end == args[0]) || (*end != '\0') || (tick_ms < EVENTS_TICK_MIN) || (tick_ms > INT_MAX)) {
+			FILE *err = rpc_stream(fd, RPC_ERR);
+			oomp(err);
+			fprintf(err, "Ticks are a number of milliseconds, at least %d\n", EVENTS_TICK_MIN);
+			fclose(err);
+			rpc_exit(fd, EXIT_FAILURE);
+			close(fd);
+			return;
+		}
+	}
+
+	events_subscribe(fd, tick_ms);
+}
+
+static void rpc_answer(gpointer data, gpointer ignored) {
+	// see rpc_watch
+	int fd = GPOINTER_TO_INT(data) - 1;
+	int64_t code;
+	int n;
+
+	char **args = rpc_recv_request(fd, &code, &n);
+	if (args == NULL) {
+		close(fd);
+		g_atomic_int_add(&rpc_pending, -1);
+		return;
+	}
+
+	if (code == CMD_WATCH) {
+		// the connection stays open, the main loop sends the events
+		rpc_subscribe(fd, args, n);
+		free(args);
+		g_atomic_int_add(&rpc_pending, -1);
+		return;
+	}
+
+	int prepares = stmt_prepares();
+
+	FILE *out = rpc_stream(fd, RPC_OUT);
+	FILE *err = rpc_stream(fd, RPC_ERR);
+	oomp(out);
+	oomp(err);
+
+	int status = EXIT_FAILURE;
+	const struct query_command *c = query_command_find(code);
+	if (c == NULL) {
+		fprintf(err, "The player doesn't know command %" PRId64 "\n", code);
+	} else if (c->player) {
+		status = player_query(c, out, err, args, n);
+	} else {
+		sqlite3 *db = g_async_queue_try_pop(rpc_dbs);
+		if (db == NULL) db = rpc_db_open();
+		status = c->run(db, out, err, args, n);
+		g_async_queue_push(rpc_dbs, db);
+	}
+
+	fclose(out);
+	fclose(err);
+	rpc_exit(fd, status);
+
+	close(fd);
+	free(args);
+
+	if (count_prepares) {
+		fprintf(stderr, "command %" PRId64 ": %d statements prepared\n", code, stmt_prepares() - prepares);
+	}
+
+	g_atomic_int_add(&rpc_pending, -1);
+}
+
+static gboolean rpc_watch(GIOChannel *source, GIOCondition condition, void *ignored) {
+	int fd = accept4(g_io_channel_unix_get_fd(source), NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) return TRUE;
+
+	struct timeval timeout = { RPC_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	// the pool doesn't take NULL, fd 0 included
+	g_atomic_int_inc(&rpc_pending);
+	g_thread_pool_push(rpc_pool, GINT_TO_POINTER(fd + 1), NULL);
+	return TRUE;
+}
+
+static void rpc_start(void) {
+	rpc_dbs = g_async_queue_new();
+	// the first query doesn't wait for a connection
+	g_async_queue_push(rpc_dbs, rpc_db_open());
+
+	rpc_pool = g_thread_pool_new(rpc_answer, NULL, RPC_THREADS, FALSE, NULL);
+
+	rpc_fd = rpc_serve();
+	GIOChannel *channel = g_io_channel_unix_new(rpc_fd);
+	rpc_source_id = g_io_add_watch(channel, G_IO_IN, (GIOFunc)rpc_watch, NULL);
+	g_io_channel_unref(channel);
+}
+
+static void rpc_stop(void) {
+	g_source_remove(rpc_source_id);
+	close(rpc_fd);
+
+	// the main loop has stopped, the queries about the player still being
+	// answered need it to run
+	while (g_atomic_int_get(&rpc_pending) > 0) {
+		if (!g_main_context_iteration(NULL, FALSE)) g_usleep(1000);
+	}
+	g_thread_pool_free(rpc_pool, FALSE, TRUE);
+
+	sqlite3 *db;
+	while ((db = g_async_queue_try_pop(rpc_dbs)) != NULL) {
+		close_db(db);
+	}
+	g_async_queue_unref(rpc_dbs);
+}
+
+// Sends the command to the player, without it runs it here, exits on failure
+static void query_command(int64_t code, char *args[], int n) {
+	const struct query_command *c = query_command_find(code);
+	int status;
+
+	int fd = rpc_conn();
+	if (fd >= 0) {
+		if (!rpc_send_request(fd, code, args, n)) {
+			fprintf(stderr, "Couldn't send the command to the player\n");
+			exit(EXIT_FAILURE);
+		}
+		status = rpc_relay(fd, stdout, stderr);
+		close(fd);
+	} else if (c->player) {
+		fprintf(stderr, "The player isn't running\n");
+		exit(EXIT_FAILURE);
+	} else {
+		term_init();
+		if (c->rating) rating_init();
+		sqlite3 *db = open_or_create_index_db();
+		if (c->rating) rating_attach(db);
+		status = c->run(db, stdout, stderr, args, n);
+		close_db(db);
+	}
+
+	if (status != EXIT_SUCCESS) exit(status);
+}
+
+
+
+// minstrel find: the results of the query are fetched again at every key
+// typed, from the player or, if it isn't running, from a prefix index built
+// here once
+#define FIND_QUERY_MAX 256
+// the lines under the results: their number and the query
+#define FIND_FOOTER 2
+
+struct find_state {
+	char query[FIND_QUERY_MAX];
+	size_t query_n;
+	char *answer; // find_query's, split in place
+	char *lines[FIND_MAX][4]; // id, title, artist and album
+	int lines_n, count, selected;
+	char status[128];
+	sqlite3 *local_db;
+	struct termios saved;
+};
+
+static void find_fetch(struct find_state *s, int rows) {
+	free(s->answer);
+	s->answer = NULL;
+	size_t len;
+	FILE *out = open_memstream(&s->answer, &len);
+	oomp(out);
+
+	char max[16];
+	snprintf(max, sizeof(max), "%d", rows);
+	char *args[] = { s->query, max };
+
+	int fd = (s->local_db == NULL) ? rpc_conn() : -1;
+	if ((fd >= 0) && rpc_send_request(fd, CMD_FIND, args, 2)) {
+		rpc_relay(fd, out, out);
+	} else {
+		if (s->local_db == NULL) {
+			s->local_db = open_or_create_index_db();
+			prefix_init(s->local_db);
+		}
+		find_query(s->local_db, out, out, args, 2);
+	}
+	if (fd >= 0) close(fd);
+	fclose(out);
+
+	s->count = atoi(s->answer);
+	s->lines_n = 0;
+	s->selected = 0;
+
+	// after the line with the count
+	char *line = strchr(s->answer, '\n');
+	while ((line != NULL) && (*++line != '\0') && (s->lines_n < FIND_MAX)) {
+		char *end = strchr(line, '\n');
+		if (end != NULL) *end = '\0';
+
+		char **fields = s->lines[s->lines_n];
+		int f = 0;
+		for (char *field = line; (field != NULL) && (f < 4); ++f) {
+			fields[f] = field;
+			field = strchr(field, '\t');
+			if (field != NULL) *field++ = '\0';
+		}
+		if (f == 4) ++s->lines_n;
+
+		line = end;
+	}
+}
+
+// Writes s on at most cols columns, counting a column for each UTF-8
+// character
+static void find_put(const char *s, int *cols) {
+	for (; (*s != '\0') && (*cols > 0); ++s) {
+		if ((*s & 0xc0) != 0x80) {
+			if (--*cols == 0) break;
+		}
+		putchar(*s);
+	}
+	// the rest of a character cut at the edge
+	while ((*s & 0xc0) == 0x80) putchar(*s++);
+}
+
+static void find_draw(struct find_state *s, int rows, int cols) {
+	putctlcod("cl", stdout);
+
+	for (int i = 0; i < rows - FIND_FOOTER; ++i) {
+		if (i < s->lines_n) {
+			char **fields = s->lines[i];
+			int left = cols;
+			if (i == s->selected) putctlcod("md", stdout);
+			find_put((i == s->selected) ? "> " : "  ", &left);
+			find_put(fields[1], &left);
+			find_put(" by ", &left);
+			find_put(fields[2], &left);
+			find_put(" from ", &left);
+			find_put(fields[3], &left);
+			if (i == s->selected) putctlcod("me", stdout);
+		}
+		fputs("\n", stdout);
+	}
+
+	printf("%d found  %s\n", s->count, s->status);
+	printf("find: %s", s->query);
+	fflush(stdout);
+}
+
+static void find_send(struct find_state *s, int64_t code) {
+	if (s->lines_n == 0) return;
+
+	int fd = conn();
+	if (fd < 0) {
+		snprintf(s->status, sizeof(s->status), "the player isn't running");
+		return;
+	}
+	send_command(fd, code, atoll(s->lines[s->selected][0]), 0);
+	close(fd);
+
+	snprintf(s->status, sizeof(s->status), "%s %s", (code == CMD_ADD) ? "added" : "inserted", s->lines[s->selected][1]);
+}
+
+// Reads the rest of an escape sequence, returns the key or 0 for escape
+// itself
+static int find_escape(void) {
+	struct pollfd p = { STDIN_FILENO, POLLIN, 0 };
+	unsigned char seq[2];
+
+	if (poll(&p, 1, 30) <= 0) return 0;
+	if (read(STDIN_FILENO, seq, 1) != 1) return 0;
+	if ((seq[0] != '[') && (seq[0] != 'O')) return 0;
+	if (read(STDIN_FILENO, seq + 1, 1) != 1) return 0;
+	return seq[1];
+}
+
+static void find_command(void) {
+	if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+		fprintf(stderr, "find needs a terminal\n");
+		exit(EXIT_FAILURE);
+	}
+
+	term_init();
+
+	struct find_state *s = calloc(1, sizeof(struct find_state));
+	oomp(s);
+
+	tcgetattr(STDIN_FILENO, &s->saved);
+	struct termios raw = s->saved;
+	raw.c_iflag &= ~(ICRNL | IXON);
+	raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+	bool changed = true, done = false;
+
+	while (!done) {
+		struct winsize ws;
+		int rows = 24, cols = 80;
+		if ((ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0) && (ws.ws_row > FIND_FOOTER)) {
+			rows = ws.ws_row;
+			cols = ws.ws_col;
+		}
+
+		if (changed) {
+			int want = rows - FIND_FOOTER;
+			find_fetch(s, (want < FIND_MAX) ? want : FIND_MAX);
+			changed = false;
+		}
+		find_draw(s, rows, cols);
+
+		unsigned char c;
+		if (read(STDIN_FILENO, &c, 1) != 1) break;
+
+		switch (c) {
+		case 3: // ^C
+		case 4: // ^D
+			done = true;
+			break;
+		case 27:
+			switch (find_escape()) {
+			case 0:
+				done = true;
+				break;
+			case 'A':
+				if (s->selected > 0) --s->selected;
+				break;
+			case 'B':
+				if (s->selected < s->lines_n - 1) ++s->selected;
+				break;
+			}
+			break;
+		case 16: // ^P
+			if (s->selected > 0) --s->selected;
+			break;
+		case 14: // ^N
+			if (s->selected < s->lines_n - 1) ++s->selected;
+			break;
+		case '\r':
+		case '\n':
+			find_send(s, CMD_ADD);
+			break;
+		case '\t':
+			find_send(s, CMD_INSERT);
+			break;
+		case 127:
+		case 8:
+			// a whole UTF-8 character
+			while ((s->query_n > 0) && ((s->query[--s->query_n] & 0xc0) == 0x80));
+			s->query[s->query_n] = '\0';
+			changed = true;
+			break;
+		case 21: // ^U
+			s->query_n = 0;
+			s->query[0] = '\0';
+			changed = true;
+			break;
+		default:
+			if ((c >= ' ') && (s->query_n < FIND_QUERY_MAX - 1)) {
+				s->query[s->query_n++] = c;
+				s->query[s->query_n] = '\0';
+				changed = true;
+			}
+		}
+	}
+
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &s->saved);
+	fputs("\n", stdout);
+
+	if (s->local_db != NULL) {
+		prefix_close();
+		close_db(s->local_db);
+	}
+	free(s->answer);
+	free(s);
+}
+
+static void config_command(char *args[], int n) {
+	if (n > 2) {
+		fprintf(stderr, "Wrong number of arguments to 'config'\n");
+		exit(EXIT_FAILURE);
+	}
+
+	player_index_db = open_or_create_index_db();
+
+	if (n == 0) {
+		for (const struct setting *s = SETTINGS; s->key != NULL; ++s) {
+			char *value = setting_get(player_index_db, s->key);
+			printf("%s = %s\n\t%s\n", s->key, value, s->description);
+			free(value);
+		}
+		close_db(player_index_db);
+		return;
+	}
+
+	if (setting_find(args[0]) == NULL) {
+		fprintf(stderr, "Unknown setting %s\n", args[0]);
+		close_db(player_index_db);
+		exit(EXIT_FAILURE);
+	}
+
+	if (n == 1) {
+		char *value = setting_get(player_index_db, args[0]);
+		printf("%s\n", value);
+		free(value);
+	} else if (strcmp(args[1], "--reset") == 0) {
+		setting_set(player_index_db, args[0], NULL);
+	} else {
+		char *end;
+		if (strstart(args[0], "weight.") && ((strtod(args[1], &end), *end != '\0') || (end == args[1]))) {
+			fprintf(stderr, "Value of %s must be a number\n", args[0]);
+			close_db(player_index_db);
+			exit(EXIT_FAILURE);
+		}
+		if (((strcmp(args[0], "queue.history") == 0) || strstart(args[0], "history.")) && ((strtoll(args[1], &end, 10) < 0) || (*end != '\0') || (end == args[1]))) {
+			fprintf(stderr, "Value of %s must be a non negative integer\n", args[0]);
+			close_db(player_index_db);
+			exit(EXIT_FAILURE);
+		}
+		if ((strcmp(args[0], "shuffle") == 0) && (strcmp(args[1], "bag") != 0) && (strcmp(args[1], "weighted") != 0)) {
+			fprintf(stderr, "Value of shuffle must be bag or weighted\n");
+			close_db(player_index_db);
+			exit(EXIT_FAILURE);
+		}
+		setting_set(player_index_db, args[0], args[1]);
+	}
+
+	close_db(player_index_db);
+}
+
+// Prints the events of the player as they happen, until it stops
+static void watch_command(int argc, char *argv[]) {
+	char *args[1];
+	int n = 0;
+
+	for (int i = 0; i < argc; ++i) {
+		if ((strcmp(argv[i], "--ticks") == 0) && (i + 1 < argc) && (n == 0)) {
+			args[n++] = argv[++i];
+		} else {
+			fprintf(stderr, "Unknown option to watch: %s\n", argv[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	int fd = rpc_conn();
+	if (fd < 0) {
+		fprintf(stderr, "The player isn't running\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!rpc_send_request(fd, CMD_WATCH, args, n)) {
+		fprintf(stderr, "Couldn't send the command to the player\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// each event as it comes, also into a pipe
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	int status = rpc_relay(fd, stdout, stderr);
+	close(fd);
+	exit(status);
+}
+
+// a playing page not refreshed for this long was left by a player that died
+#define NOW_STALE_MS 5000
+
+// Prints what status prints from the now playing page, without a word to the
+// player, extrapolating the position of a tune that is playing
+static void now_command(void) {
+	const struct now_page *page = now_map();
+	struct now_page now;
+	if ((page == NULL) || !now_read(page, &now)) {
+		fprintf(stderr, "The player isn't running\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t elapsed = now_monotonic_ms() - now.updated_ms;
+	if ((now.state == NOW_PLAYING) && (elapsed > NOW_STALE_MS)) {
+		fprintf(stderr, "The player isn't running\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("State: %s\n", (now.state == NOW_PLAYING) ? "playing" : (now.state == NOW_PAUSED) ? "paused" : "stopped");
+	if (now.id != 0) {
+		printf("Index: %" PRId64 "\n", now.index);
+		printf("Id: %" PRId64 "\n", now.id);
+		printf("Title: %s\n", now.title);
+		printf("Author: %s\n", now.artist);
+		printf("Album: %s\n", now.album);
+		printf("Track: %s\n", now.track);
+	}
+
+	if (now.position_ms >= 0) {
+		int64_t pos = now.position_ms;
+		if (now.state == NOW_PLAYING) pos += elapsed;
+		if ((now.duration_ms >= 0) && (pos > now.duration_ms)) pos = now.duration_ms;
+		printf("Position: %.1f\n", pos / 1e3);
+	}
+	if (now.duration_ms >= 0) printf("Duration: %.1f\n", now.duration_ms / 1e3);
 }
 
 int main(int argc, char *argv[]) {
@@ -711,44 +2105,68 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
+	count_prepares = (getenv("MINSTREL_PREPARES") != NULL);
+	report_gaps = (getenv("MINSTREL_GAPS") != NULL);
+
 	if (strcmp(argv[1], "index") == 0) {
 		index_command(argv+2, argc-2);
 	} else if (strcmp(argv[1], "start") == 0) {
-		start_player();
+		start_player(argc-2, argv+2);
 	} else if (strcmp(argv[1], "play") == 0) {
-		int64_t cmd[] = { CMD_PLAY_PAUSE, 0 };
+		int64_t cmd[] = { CMD_PLAY_PAUSE, 0, 0 };
 		conn_and_send(cmd);
 	} else if (strcmp(argv[1], "stop") == 0) {
-		int64_t cmd[] = { CMD_STOP, 0 };
+		int64_t cmd[] = { CMD_STOP, 0, 0 };
 		conn_and_send(cmd);
 	} else if (strcmp(argv[1], "next") == 0) {
-		int64_t cmd[] = { CMD_NEXT, 0 };
+		int64_t cmd[] = { CMD_NEXT, 0, 0 };
 		conn_and_send(cmd);
 	} else if (strcmp(argv[1], "rewind") == 0) {
-		int64_t cmd[] = { CMD_REWIND, 0 };
+		int64_t cmd[] = { CMD_REWIND, 0, 0 };
 		conn_and_send(cmd);
 	} else if (strcmp(argv[1], "prev") == 0) {
-		int64_t cmd[] = { CMD_PREV, 0 };
+		int64_t cmd[] = { CMD_PREV, 0, 0 };
 		conn_and_send(cmd);
 	} else if (strcmp(argv[1], "add") == 0) {
 		add_command(argc-2, argv+2);
+	} else if (strcmp(argv[1], "insert") == 0) {
+		insert_command(argc-2, argv+2);
+	} else if (strcmp(argv[1], "remove") == 0) {
+		remove_command(argc-2, argv+2);
+	} else if (strcmp(argv[1], "move") == 0) {
+		move_command(argc-2, argv+2);
 	} else if (strcmp(argv[1], "search") == 0) {
-		search_command(argv+2, argc-2);
+		query_command(CMD_SEARCH, argv+2, argc-2);
+	} else if (strcmp(argv[1], "find") == 0) {
+		find_command();
 	} else if (strcmp(argv[1], "where") == 0) {
-		if (argc == 2) {
-			where_command(NULL);
-		} else if (argc == 3) {
-			where_command(argv[2]);
+		if (argc <= 3) {
+			query_command(CMD_WHERE, argv+2, argc-2);
 		} else {
 			fprintf(stderr, "Wrong number of arguments to 'where'\n");
 			exit(EXIT_FAILURE);
 		}
+	} else if (strcmp(argv[1], "status") == 0) {
+		query_command(CMD_STATUS, argv+2, argc-2);
+	} else if (strcmp(argv[1], "now") == 0) {
+		now_command();
+	} else if (strcmp(argv[1], "watch") == 0) {
+		watch_command(argc-2, argv+2);
+	} else if (strcmp(argv[1], "queue") == 0) {
+		if (argc <= 3) {
+			query_command(CMD_QUEUE, argv+2, argc-2);
+		} else {
+			fprintf(stderr, "Wrong number of arguments to 'queue'\n");
+			exit(EXIT_FAILURE);
+		}
 	} else if (strcmp(argv[1], "addlast") == 0) {
 		addlast_command();
 	} else if (strcmp(argv[1],  "most-added") == 0) {
-		most_command("added", argv+2, argc-2);
+		query_command(CMD_MOST_ADDED, argv+2, argc-2);
 	} else if (strcmp(argv[1], "most-listened") == 0) {
-		most_command("listened", argv+2, argc-2);
+		query_command(CMD_MOST_LISTENED, argv+2, argc-2);
+	} else if (strcmp(argv[1], "config") == 0) {
+		config_command(argv+2, argc-2);
 	} else if (strcmp(argv[1], "help") == 0) {
 		usage();
 	} else {
@@ -757,5 +2175,9 @@ int main(int argc, char *argv[]) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (count_prepares) {
+		fprintf(stderr, "%s: %d statements prepared\n", argv[1], stmt_prepares());
+	}
+
 	return 0;
 }
@@ -0,0 +1,170 @@
+#include "now.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "util.h"
+
+// a reader finding seq odd this many times gives up, the writer died in the
+// middle of an update
+#define NOW_READ_TRIES 100000
+
+static struct now_page *page = NULL;
+
+char *now_path(void) {
+	char *path = NULL;
+	asprintf(&path, "/dev/shm/minstrel-now.%d", (int)getuid());
+	oomp(path);
+	return path;
+}
+
+int64_t now_monotonic_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// seq odd, the stores that follow can't be seen before it
+static void now_begin(void) {
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// seq even, after the stores that came before
+static void now_end(void) {
+	__atomic_store_n(&page->seq, page->seq + 1, __ATOMIC_RELEASE);
+}
+
+// copies src truncated to size bytes, without splitting an utf-8 character
+static void now_copy(char *dst, const char *src, size_t size) {
+	size_t n = (src != NULL) ? strlen(src) : 0;
+	if (n >= size) {
+		n = size - 1;
+		while ((n > 0) && (((unsigned char)src[n] & 0xc0) == 0x80)) --n;
+	}
+	if (n > 0) memcpy(dst, src, n);
+	memset(dst + n, 0, size - n);
+}
+
+void now_open(void) {
+	char *path = now_path();
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Couldn't create the now playing page %s: %s\n", path, strerror(errno));
+		goto now_open_failure;
+	}
+
+	if (ftruncate(fd, sizeof(struct now_page)) < 0) {
+		fprintf(stderr, "Couldn't size the now playing page %s: %s\n", path, strerror(errno));
+		goto now_open_failure;
+	}
+
+	void *map = mmap(NULL, sizeof(struct now_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Couldn't map the now playing page %s: %s\n", path, strerror(errno));
+		goto now_open_failure;
+	}
+	page = map;
+	close(fd);
+	free(path);
+
+	// a player that died while writing left seq odd
+	if (page->seq & 1) ++page->seq;
+
+	now_begin();
+	page->magic = NOW_MAGIC;
+	page->version = NOW_VERSION;
+	page->state = NOW_STOPPED;
+	page->id = 0;
+	page->index = -1;
+	page->position_ms = page->duration_ms = -1;
+	page->updated_ms = now_monotonic_ms();
+	now_copy(page->title, NULL, NOW_TEXT);
+	now_copy(page->artist, NULL, NOW_TEXT);
+	now_copy(page->album, NULL, NOW_TEXT);
+	now_copy(page->track, NULL, NOW_TRACK);
+	now_end();
+	return;
+
+now_open_failure:
+
+	if (fd >= 0) close(fd);
+	free(path);
+}
+
+void now_set_tune(int64_t id, int64_t index, const char *title, const char *artist, const char *album, const char *track) {
+	if (page == NULL) return;
+
+	now_begin();
+	page->id = id;
+	page->index = index;
+	now_copy(page->title, title, NOW_TEXT);
+	now_copy(page->artist, artist, NOW_TEXT);
+	now_copy(page->album, album, NOW_TEXT);
+	now_copy(page->track, track, NOW_TRACK);
+	now_end();
+}
+
+void now_set_state(enum now_state state, int64_t position_ms, int64_t duration_ms) {
+	if (page == NULL) return;
+
+	now_begin();
+	page->state = state;
+	page->position_ms = position_ms;
+	page->duration_ms = duration_ms;
+	page->updated_ms = now_monotonic_ms();
+	now_end();
+}
+
+void now_close(void) {
+	if (page == NULL) return;
+
+	now_set_state(NOW_STOPPED, -1, -1);
+	munmap(page, sizeof(struct now_page));
+	page = NULL;
+}
+
+const struct now_page *now_map(void) {
+	char *path = now_path();
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd < 0) return NULL;
+
+	struct stat st;
+	void *map = MAP_FAILED;
+	if ((fstat(fd, &st) == 0) && (st.st_size >= sizeof(struct now_page))) {
+		map = mmap(NULL, sizeof(struct now_page), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	return (map != MAP_FAILED) ? map : NULL;
+}
+
+bool now_read(const struct now_page *page, struct now_page *snapshot) {
+	for (int tries = 0; tries < NOW_READ_TRIES; ++tries) {
+		uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			// the player is in the middle of an update, it takes a few stores
+			if (tries > 100) sched_yield();
+			continue;
+		}
+
+		memcpy(snapshot, (const void *)page, sizeof(struct now_page));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) != seq) continue;
+
+		snapshot->title[NOW_TEXT-1] = snapshot->artist[NOW_TEXT-1] = snapshot->album[NOW_TEXT-1] = snapshot->track[NOW_TRACK-1] = '\0';
+		return (snapshot->magic == NOW_MAGIC) && (snapshot->version == NOW_VERSION);
+	}
+
+	return false;
+}
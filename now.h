@@ -0,0 +1,56 @@
+#ifndef __NOW__
+#define __NOW__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// What the player is playing, published in a page of shared memory that any
+// number of processes can map and read without a system call or a word to
+// the player. The page is a seqlock: the player makes seq odd, changes the
+// fields and makes it even again, a reader keeps its copy of the page only if
+// seq was the same even number before and after taking it.
+
+#define NOW_MAGIC 0x776f6e6d
+#define NOW_VERSION 1
+#define NOW_TEXT 256
+#define NOW_TRACK 32
+
+enum now_state {
+	NOW_STOPPED = 0,
+	NOW_PAUSED = 1,
+	NOW_PLAYING = 2,
+};
+
+struct now_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t state;
+	int64_t id; // 0 without a current tune
+	int64_t index; // position of the tune in the queue
+	int64_t position_ms, duration_ms; // -1 when not known
+	// CLOCK_MONOTONIC time of position_ms: while playing readers add the time
+	// since, the player refreshes it every second
+	int64_t updated_ms;
+	char title[NOW_TEXT], artist[NOW_TEXT], album[NOW_TEXT], track[NOW_TRACK];
+};
+
+// Path of the page, /dev/shm/minstrel-now.<uid>, to free
+char *now_path(void);
+
+// Used by the player: creates the page, empty and stopped, or takes over the
+// one a previous player left
+void now_open(void);
+void now_set_tune(int64_t id, int64_t index, const char *title, const char *artist, const char *album, const char *track);
+void now_set_state(enum now_state state, int64_t position_ms, int64_t duration_ms);
+// Marks the page stopped, readers keep their mapping
+void now_close(void);
+
+// Maps the page read only, NULL if no player published one
+const struct now_page *now_map(void);
+// Copies a consistent snapshot of page, false if it is from another version
+// or a player died while writing it
+bool now_read(const struct now_page *page, struct now_page *snapshot);
+int64_t now_monotonic_ms(void);
+
+#endif
@@ -0,0 +1,552 @@
+#include "prefix.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <glib.h>
+
+#include "util.h"
+#include "stmt.h"
+
+#define ID_KEY(id) ((gpointer)(intptr_t)(id))
+// a query has at most this many words, the others are ignored
+#define QUERY_WORDS 16
+
+struct prefix_tune {
+	int64_t id; // 0 once removed
+	uint32_t words; // offset in text of its words, an empty one ends them
+	// offset in text of its sort_artist then sort_album, each \1 and the
+	// text or, for NULL, empty: they compare like sqlite does
+	uint32_t key;
+	int64_t disc, track; // INT64_MIN for NULL
+};
+
+// a word of a tune, sorted by the word and then by tune
+struct prefix_word {
+	uint32_t word; // offset in text
+	uint32_t tune;
+};
+
+static GRWLock lock;
+// set once the words are loaded, by prefix_init or the thread prefix_start
+// runs
+static bool ready = false;
+static GMutex ready_mutex;
+static GCond ready_cond;
+static GThread *builder = NULL;
+// the changes prefix_changes got before the words were loaded, as struct
+// index_change, the builder applies them before it is ready
+static GArray *early = NULL;
+
+// tunes sorted by tune_compare, then the ones added since the last merge
+static struct prefix_tune *tunes = NULL;
+static uint32_t tunes_n = 0, tunes_size = 0;
+// the tunes from sorted_tunes on have their words pending
+static uint32_t sorted_tunes = 0;
+// the words of the tunes, each NUL terminated
+static char *text = NULL;
+static size_t text_n = 0, text_size = 0;
+static struct prefix_word *words = NULL;
+static size_t words_n = 0;
+// id -> index in tunes + 1
+static GHashTable *by_id = NULL;
+
+static void text_grow(size_t len) {
+	if (text_n + len <= text_size) return;
+	while (text_n + len > text_size) text_size = (text_size == 0) ? 1 << 20 : text_size * 2;
+	text = realloc(text, text_size);
+	oomp(text);
+}
+
+static bool word_char(unsigned char c) {
+	return ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) || ((c >= '0') && (c <= '9')) || (c == '_') || (c >= 0x80);
+}
+
+// Appends the lowered words of s to text
+static void text_add_words(const char *s) {
+	if (s == NULL) return;
+
+	text_grow(strlen(s) + 1);
+
+	bool in_word = false;
+	for (const unsigned char *c = (const unsigned char *)s; *c != '\0'; ++c) {
+		if (word_char(*c)) {
+			text[text_n++] = ((*c >= 'A') && (*c <= 'Z')) ? *c - 'A' + 'a' : *c;
+			in_word = true;
+		} else if (in_word) {
+			text[text_n++] = '\0';
+			in_word = false;
+		}
+	}
+	if (in_word) text[text_n++] = '\0';
+}
+
+// Appends s to text as the key of a tune
+static void text_add_key(const char *s) {
+	size_t len = (s != NULL) ? strlen(s) + 1 : 0;
+	text_grow(len + 1);
+	if (s != NULL) {
+		text[text_n++] = '\1';
+		memcpy(text + text_n, s, len - 1);
+		text_n += len - 1;
+	}
+	text[text_n++] = '\0';
+}
+
+static int64_t column_number(sqlite3_stmt *select, int col) {
+	return (sqlite3_column_type(select, col) == SQLITE_NULL) ? INT64_MIN : sqlite3_column_int64(select, col);
+}
+
+#define TUNE_COLUMNS "id, artist, album, title, sort_artist, sort_album, disc_no, track_no"
+
+// select returns TUNE_COLUMNS
+static void tune_add(sqlite3_stmt *select) {
+	if (tunes_n == tunes_size) {
+		tunes_size = (tunes_size == 0) ? 1024 : tunes_size * 2;
+		tunes = realloc(tunes, sizeof(struct prefix_tune) * tunes_size);
+		oomp(tunes);
+	}
+
+	struct prefix_tune *t = tunes + tunes_n;
+	t->id = sqlite3_column_int64(select, 0);
+	t->words = text_n;
+
+	for (int col = 1; col <= 3; ++col) {
+		text_add_words((const char *)sqlite3_column_text(select, col));
+	}
+	text_grow(1);
+	text[text_n++] = '\0';
+
+	t->key = text_n;
+	text_add_key((const char *)sqlite3_column_text(select, 4));
+	text_add_key((const char *)sqlite3_column_text(select, 5));
+	t->disc = column_number(select, 6);
+	t->track = column_number(select, 7);
+
+	g_hash_table_insert(by_id, ID_KEY(t->id), GUINT_TO_POINTER(tunes_n + 1));
+	++tunes_n;
+}
+
+// The order of the index: by sort_artist, sort_album, disc_no, track_no and
+// id, like build selects them
+static int tune_compare(const struct prefix_tune *a, const struct prefix_tune *b) {
+	const char *ka = text + a->key, *kb = text + b->key;
+	int r = strcmp(ka, kb);
+	if (r != 0) return r;
+	r = strcmp(ka + strlen(ka) + 1, kb + strlen(kb) + 1);
+	if (r != 0) return r;
+	if (a->disc != b->disc) return (a->disc < b->disc) ? -1 : 1;
+	if (a->track != b->track) return (a->track < b->track) ? -1 : 1;
+	return (a->id > b->id) - (a->id < b->id);
+}
+
+// compares tunes, given as indices in tunes
+static int index_compare(const void *a, const void *b, void *ignored) {
+	return tune_compare(tunes + *(const uint32_t *)a, tunes + *(const uint32_t *)b);
+}
+
+// compares distinct words, given as indices in offsets
+static int distinct_compare(const void *a, const void *b, void *offsets) {
+	const uint32_t *o = offsets;
+	return strcmp(text + o[*(const uint32_t *)a], text + o[*(const uint32_t *)b]);
+}
+
+// The words of the live tunes from first on, sorted, *n tells how many.
+// Only the distinct words are sorted, each word of a tune is then put in
+// place by the rank of its word: going through the tunes in order keeps the
+// tunes of a word in order.
+static struct prefix_word *tune_words(uint32_t first, size_t *n) {
+	size_t size = 0;
+	for (uint32_t i = first; i < tunes_n; ++i) {
+		if (tunes[i].id == 0) continue;
+		for (const char *w = text + tunes[i].words; *w != '\0'; w += strlen(w) + 1) ++size;
+	}
+
+	// the distinct word of each word of a tune, an index in offsets
+	uint32_t *word_of = malloc(sizeof(uint32_t) * (size + 1));
+	oomp(word_of);
+	GArray *offsets = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+	GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+
+	size_t k = 0;
+	for (uint32_t i = first; i < tunes_n; ++i) {
+		if (tunes[i].id == 0) continue;
+		for (const char *w = text + tunes[i].words; *w != '\0'; w += strlen(w) + 1) {
+			guint d = GPOINTER_TO_UINT(g_hash_table_lookup(seen, w));
+			if (d == 0) {
+				uint32_t offset = w - text;
+				g_array_append_val(offsets, offset);
+				d = offsets->len;
+				g_hash_table_insert(seen, (gpointer)w, GUINT_TO_POINTER(d));
+			}
+			word_of[k++] = d - 1;
+		}
+	}
+	g_hash_table_destroy(seen);
+
+	guint distinct = offsets->len;
+	uint32_t *order = malloc(sizeof(uint32_t) * (distinct + 1));
+	uint32_t *rank = malloc(sizeof(uint32_t) * (distinct + 1));
+	size_t *start = calloc(distinct + 1, sizeof(size_t));
+	oomp(order);
+	oomp(rank);
+	oomp(start);
+
+	for (guint d = 0; d < distinct; ++d) order[d] = d;
+	qsort_r(order, distinct, sizeof(uint32_t), distinct_compare, offsets->data);
+	for (guint r = 0; r < distinct; ++r) rank[order[r]] = r;
+
+	// where the words of each rank start
+	for (k = 0; k < size; ++k) ++start[rank[word_of[k]] + 1];
+	for (guint r = 1; r <= distinct; ++r) start[r] += start[r-1];
+
+	struct prefix_word *words_sorted = malloc(sizeof(struct prefix_word) * (size + 1));
+	oomp(words_sorted);
+
+	k = 0;
+	for (uint32_t i = first; i < tunes_n; ++i) {
+		if (tunes[i].id == 0) continue;
+		for (const char *w = text + tunes[i].words; *w != '\0'; w += strlen(w) + 1) {
+			struct prefix_word *e = words_sorted + start[rank[word_of[k++]]]++;
+			e->word = w - text;
+			e->tune = i;
+		}
+	}
+
+	free(start);
+	free(rank);
+	free(order);
+	free(word_of);
+	g_array_free(offsets, TRUE);
+
+	*n = size;
+	return words_sorted;
+}
+
+// Merges the pending tunes in their place among the sorted ones and their
+// words into words, dropping the removed tunes and their words
+static void merge_pending(void) {
+	size_t pending_n;
+	struct prefix_word *pending = tune_words(sorted_tunes, &pending_n);
+
+	uint32_t added = tunes_n - sorted_tunes;
+	uint32_t *order = malloc(sizeof(uint32_t) * (added + 1));
+	oomp(order);
+	for (uint32_t i = 0; i < added; ++i) order[i] = sorted_tunes + i;
+	qsort_r(order, added, sizeof(uint32_t), index_compare, NULL);
+
+	// old index in tunes -> new one
+	uint32_t *moved = malloc(sizeof(uint32_t) * (tunes_n + 1));
+	struct prefix_tune *merged_tunes = malloc(sizeof(struct prefix_tune) * tunes_size);
+	oomp(moved);
+	oomp(merged_tunes);
+
+	uint32_t i = 0, j = 0, n = 0;
+	while ((i < sorted_tunes) || (j < added)) {
+		uint32_t from;
+		if ((i < sorted_tunes) && (tunes[i].id == 0)) {
+			++i;
+			continue;
+		} else if ((j < added) && (tunes[order[j]].id == 0)) {
+			++j;
+			continue;
+		} else if ((j == added) || ((i < sorted_tunes) && (tune_compare(tunes + i, tunes + order[j]) < 0))) {
+			from = i++;
+		} else {
+			from = order[j++];
+		}
+		moved[from] = n;
+		merged_tunes[n] = tunes[from];
+		g_hash_table_insert(by_id, ID_KEY(tunes[from].id), GUINT_TO_POINTER(n + 1));
+		++n;
+	}
+
+	// the words stay sorted by word, the tunes of a word needn't be
+	struct prefix_word *merged = malloc(sizeof(struct prefix_word) * (words_n + pending_n + 1));
+	oomp(merged);
+
+	size_t wi = 0, wj = 0, wn = 0;
+	while ((wi < words_n) || (wj < pending_n)) {
+		struct prefix_word *w;
+		if ((wi < words_n) && (tunes[words[wi].tune].id == 0)) {
+			++wi;
+			continue;
+		} else if ((wj == pending_n) || ((wi < words_n) && (strcmp(text + words[wi].word, text + pending[wj].word) < 0))) {
+			w = words + wi++;
+		} else {
+			w = pending + wj++;
+		}
+		merged[wn].word = w->word;
+		merged[wn].tune = moved[w->tune];
+		++wn;
+	}
+
+	free(words);
+	free(pending);
+	free(tunes);
+	free(moved);
+	free(order);
+	words = merged;
+	words_n = wn;
+	tunes = merged_tunes;
+	tunes_n = sorted_tunes = n;
+}
+
+static void tune_remove(int64_t id) {
+	guint idx = GPOINTER_TO_UINT(g_hash_table_lookup(by_id, ID_KEY(id)));
+	if (idx == 0) return;
+	tunes[idx - 1].id = 0;
+	g_hash_table_remove(by_id, ID_KEY(id));
+}
+
+static void apply_changes(sqlite3 *index_db, const struct index_change *v, int n) {
+	g_rw_lock_writer_lock(&lock);
+
+	for (int i = 0; i < n; ++i) {
+		tune_remove(v[i].id);
+		if (v[i].kind == INDEX_REMOVED) continue;
+
+		sqlite3_stmt *select = stmt_get(index_db, "SELECT " TUNE_COLUMNS " FROM tunes WHERE id = ?;");
+		if (select == NULL) goto apply_changes_failure;
+		if (sqlite3_bind_int64(select, 1, v[i].id) != SQLITE_OK) goto apply_changes_failure;
+		if (sqlite3_step(select) == SQLITE_ROW) tune_add(select);
+		sqlite3_reset(select);
+	}
+
+	if (tunes_n - sorted_tunes > PREFIX_PENDING_MAX) merge_pending();
+
+	g_rw_lock_writer_unlock(&lock);
+	return;
+
+apply_changes_failure:
+
+	fprintf(stderr, "Sqlite error loading the words of a tune: %s\n", sqlite3_errmsg(index_db));
+	g_rw_lock_writer_unlock(&lock);
+}
+
+static void build(sqlite3 *index_db) {
+	sqlite3_stmt *select = stmt_get(index_db, "SELECT " TUNE_COLUMNS " FROM tunes ORDER BY sort_artist, sort_album, disc_no, track_no, id;");
+	if (select == NULL) goto build_failure;
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		tune_add(select);
+	}
+	if (r != SQLITE_DONE) goto build_failure;
+	sqlite3_reset(select);
+
+	words = tune_words(0, &words_n);
+	sorted_tunes = tunes_n;
+
+	// the changes made while loading, the select may have seen some of them
+	g_mutex_lock(&ready_mutex);
+	while (early->len > 0) {
+		GArray *batch = early;
+		early = g_array_new(FALSE, FALSE, sizeof(struct index_change));
+		g_mutex_unlock(&ready_mutex);
+		apply_changes(index_db, (struct index_change *)batch->data, batch->len);
+		g_array_free(batch, TRUE);
+		g_mutex_lock(&ready_mutex);
+	}
+	ready = true;
+	g_cond_broadcast(&ready_cond);
+	g_mutex_unlock(&ready_mutex);
+	return;
+
+build_failure:
+
+	fprintf(stderr, "Sqlite error loading the words of tunes: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+static void wait_ready(void) {
+	g_mutex_lock(&ready_mutex);
+	while (!ready) g_cond_wait(&ready_cond, &ready_mutex);
+	g_mutex_unlock(&ready_mutex);
+}
+
+void prefix_init(sqlite3 *index_db) {
+	by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+	early = g_array_new(FALSE, FALSE, sizeof(struct index_change));
+	build(index_db);
+}
+
+static gpointer builder_run(gpointer ignored) {
+	sqlite3 *index_db = open_or_create_index_db();
+	build(index_db);
+	close_db(index_db);
+	return NULL;
+}
+
+void prefix_start(void) {
+	by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+	early = g_array_new(FALSE, FALSE, sizeof(struct index_change));
+	builder = g_thread_new("prefix", builder_run, NULL);
+}
+
+void prefix_changes(sqlite3 *index_db, struct index_changes *changes) {
+	if (by_id == NULL) return;
+
+	// while the builder loads, the caller doesn't wait for it
+	g_mutex_lock(&ready_mutex);
+	if (!ready) {
+		g_array_append_vals(early, changes->v, changes->n);
+		g_mutex_unlock(&ready_mutex);
+		return;
+	}
+	g_mutex_unlock(&ready_mutex);
+
+	apply_changes(index_db, changes->v, changes->n);
+}
+
+// The range of words starting with prefix, those sort together
+static void prefix_range(const char *prefix, size_t *lo, size_t *hi) {
+	size_t len = strlen(prefix);
+	size_t a = 0, b = words_n;
+
+	while (a < b) {
+		size_t m = a + (b - a) / 2;
+		if (strncmp(text + words[m].word, prefix, len) < 0) a = m + 1; else b = m;
+	}
+	*lo = a;
+
+	b = words_n;
+	while (a < b) {
+		size_t m = a + (b - a) / 2;
+		if (strncmp(text + words[m].word, prefix, len) <= 0) a = m + 1; else b = m;
+	}
+	*hi = a;
+}
+
+// The first word of t starting with prefix, NULL if none does
+static const char *tune_word(const struct prefix_tune *t, const char *prefix, size_t len) {
+	for (const char *w = text + t->words; *w != '\0'; w += strlen(w) + 1) {
+		if (strncmp(w, prefix, len) == 0) return w;
+	}
+	return NULL;
+}
+
+static bool tune_matches(const struct prefix_tune *t, char *query[], size_t len[], int n) {
+	for (int i = 0; i < n; ++i) {
+		if (tune_word(t, query[i], len[i]) == NULL) return false;
+	}
+	return true;
+}
+
+int prefix_find(const char *query, int64_t *ids, int max) {
+	// the query is split and lowered like the tags
+	char *folded = malloc(strlen(query) + 1);
+	oomp(folded);
+	char *q[QUERY_WORDS];
+	size_t len[QUERY_WORDS];
+	int n = 0;
+
+	char *dst = folded;
+	for (const unsigned char *c = (const unsigned char *)query; ; ++c) {
+		if ((*c != '\0') && word_char(*c)) {
+			if ((dst == folded) || (dst[-1] == '\0')) {
+				if (n == QUERY_WORDS) break;
+				q[n++] = dst;
+			}
+			*dst++ = ((*c >= 'A') && (*c <= 'Z')) ? *c - 'A' + 'a' : *c;
+		} else if ((dst > folded) && (dst[-1] != '\0')) {
+			len[n-1] = dst - q[n-1];
+			*dst++ = '\0';
+		}
+		if (*c == '\0') break;
+	}
+
+	if ((n == 0) || (by_id == NULL)) {
+		free(folded);
+		return 0;
+	}
+
+	wait_ready();
+	g_rw_lock_reader_lock(&lock);
+
+	// a bit per tune for the ones matching every word so far and one for
+	// those matching the current word, scanning the bits gives the tunes
+	// in order
+	size_t bitmap_n = (tunes_n + 63) / 64;
+	uint64_t *matching = malloc(sizeof(uint64_t) * (bitmap_n + 1));
+	uint64_t *word = calloc(bitmap_n + 1, sizeof(uint64_t));
+	oomp(matching);
+	oomp(word);
+
+	for (int i = 0; i < n; ++i) {
+		size_t lo, hi;
+		prefix_range(q[i], &lo, &hi);
+
+		uint64_t *bits = (i == 0) ? matching : word;
+		if (i == 0) memset(matching, 0, sizeof(uint64_t) * bitmap_n);
+		for (size_t j = lo; j < hi; ++j) {
+			bits[words[j].tune / 64] |= 1ULL << (words[j].tune % 64);
+		}
+
+		if (i > 0) {
+			for (size_t j = 0; j < bitmap_n; ++j) {
+				matching[j] &= word[j];
+				word[j] = 0;
+			}
+		}
+	}
+
+	// the tunes added since the last merge are checked one by one, then put
+	// in their place among the others
+	uint32_t *added = malloc(sizeof(uint32_t) * (tunes_n - sorted_tunes + 1));
+	oomp(added);
+	uint32_t added_n = 0;
+	for (uint32_t i = sorted_tunes; i < tunes_n; ++i) {
+		if ((tunes[i].id != 0) && tune_matches(tunes + i, q, len, n)) added[added_n++] = i;
+	}
+	qsort_r(added, added_n, sizeof(uint32_t), index_compare, NULL);
+
+	int found = 0;
+	uint32_t a = 0;
+	for (size_t j = 0; j < bitmap_n; ++j) {
+		for (uint64_t bits = matching[j]; bits != 0; bits &= bits - 1) {
+			const struct prefix_tune *t = tunes + j * 64 + __builtin_ctzll(bits);
+			if (t->id == 0) continue;
+			for (; (a < added_n) && (tune_compare(tunes + added[a], t) < 0); ++a) {
+				if (found < max) ids[found] = tunes[added[a]].id;
+				++found;
+			}
+			if (found < max) ids[found] = t->id;
+			++found;
+		}
+	}
+	for (; a < added_n; ++a) {
+		if (found < max) ids[found] = tunes[added[a]].id;
+		++found;
+	}
+
+	g_rw_lock_reader_unlock(&lock);
+
+	free(added);
+	free(matching);
+	free(word);
+	free(folded);
+	return found;
+}
+
+void prefix_close(void) {
+	if (by_id == NULL) return;
+	if (builder != NULL) {
+		g_thread_join(builder);
+		builder = NULL;
+	}
+	ready = false;
+	g_hash_table_destroy(by_id);
+	by_id = NULL;
+	g_array_free(early, TRUE);
+	early = NULL;
+	free(tunes);
+	free(text);
+	free(words);
+	tunes = NULL;
+	text = NULL;
+	words = NULL;
+	tunes_n = tunes_size = sorted_tunes = 0;
+	text_n = text_size = words_n = 0;
+}
@@ -0,0 +1,35 @@
+#ifndef __PREFIX__
+#define __PREFIX__
+
+#include <stdint.h>
+
+#include <sqlite3.h>
+
+#include "index.h"
+
+// In memory index of the words of the artist, album and title of every tune,
+// to find tunes as a query is typed. Words are split at ASCII spaces and
+// punctuation and lowered, like fidx does but keeping diacritics.
+//
+// All the words sorted in one array make the tunes having a word that starts
+// with a prefix a range found with two binary searches. Tunes added since the
+// array was built are checked one by one until there are PREFIX_PENDING_MAX
+// of them, then they and their words are merged in. prefix_find can be called
+// from any thread, prefix_changes from the one that called prefix_init or
+// prefix_start.
+
+#define PREFIX_PENDING_MAX 4096
+
+void prefix_init(sqlite3 *index_db);
+// Loads the words in a thread with its own connection to the index,
+// prefix_find waits for it, the changes given before it is done are applied
+// once it is
+void prefix_start(void);
+void prefix_changes(sqlite3 *index_db, struct index_changes *changes);
+// Fills ids with up to max tunes having, for every word of query, a word
+// starting with it, ordered by artist and album. Returns the number of
+// matches.
+int prefix_find(const char *query, int64_t *ids, int max);
+void prefix_close(void);
+
+#endif
@@ -1,155 +1,478 @@
 #include "queue.h"
 
 #include "util.h"
+#include "shuffle.h"
+#include "journal.h"
+#include "events.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
+#include <glib.h>
+
+// The queue is an unrolled list: an array of pointers to chunks of up to
+// QUEUE_CHUNK ids. Appending fills the last chunk, inserting or removing moves
+// at most a chunk worth of ids and a full chunk is split in half. Chunks are
+// found walking from the front, since history is trimmed to queue.history
+// tunes the current one is never more than a few chunks in.
+#define QUEUE_CHUNK 256
+
+struct queue_chunk {
+	int n;
+	int64_t ids[QUEUE_CHUNK];
+};
+
+static struct queue_chunk **chunks = NULL;
+static int chunks_n = 0, chunks_size = 0;
+static int64_t queue_n = 0; // tunes in the queue
+static int64_t queue_base = 0; // absolute position of the first tune kept
+static int64_t queue_current = -1; // absolute position of the current tune
+static int64_t queue_history = 0;
+
+static struct queue_chunk *chunk_new_at(int c) {
+	if (chunks_n >= chunks_size) {
+		chunks_size = (chunks_size == 0) ? 16 : chunks_size * 2;
+		chunks = realloc(chunks, sizeof(struct queue_chunk *) * chunks_size);
+		oomp(chunks);
+	}
+
+	struct queue_chunk *k = malloc(sizeof(struct queue_chunk));
+	oomp(k);
+	k->n = 0;
 
-struct item queue[QUEUE_LENGTH];
-int queue_position;
-int queue_currently_playing_idx;
+	memmove(chunks + c + 1, chunks + c, sizeof(struct queue_chunk *) * (chunks_n - c));
+	chunks[c] = k;
+	++chunks_n;
 
-void queue_init(void) {
-	bzero(queue, sizeof(queue));
-	queue_position = 0;
-	queue_currently_playing_idx = -1;
+	return k;
 }
 
-void queue_append(int64_t id) {
-	//printf("appending to %d\n", queue_position);
-	if (queue_position >= QUEUE_LENGTH) {
-		fprintf(stderr, "can not add anything anymore\n");
-		return;
+static void chunk_drop(int c) {
+	free(chunks[c]);
+	memmove(chunks + c, chunks + c + 1, sizeof(struct queue_chunk *) * (chunks_n - c - 1));
+	--chunks_n;
+}
+
+// Returns the chunk holding the i-th tune (relative to queue_base) and its
+// offset in the chunk, i == queue_n gives the end of the last chunk
+static int chunk_locate(int64_t i, int *off) {
+	int c = 0;
+	while ((c < chunks_n - 1) && (i >= chunks[c]->n)) {
+		i -= chunks[c]->n;
+		++c;
 	}
-	queue[queue_position].occupied = true;
-	queue[queue_position].played = false;
-	queue[queue_position].id = id;
-	++queue_position;
+	*off = i;
+	return c;
 }
 
-struct item *queue_currently_playing(void) {
-	return queue+queue_currently_playing_idx;
+static int64_t queue_get_at(int64_t i) {
+	int off;
+	int c = chunk_locate(i, &off);
+	return chunks[c]->ids[off];
 }
 
-static int64_t random_index_item(sqlite3 *player_index_db) {
-	sqlite3_stmt *random_id;
+static void queue_insert_at(int64_t i, int64_t id) {
+	int off;
+	int c = chunk_locate(i, &off);
+	struct queue_chunk *k = chunks[c];
+
+	if (k->n == QUEUE_CHUNK) {
+		if (off == QUEUE_CHUNK) {
+			// appending after a full chunk
+			k = chunk_new_at(c + 1);
+			off = 0;
+		} else {
+			struct queue_chunk *split = chunk_new_at(c + 1);
+			split->n = QUEUE_CHUNK - QUEUE_CHUNK/2;
+			memcpy(split->ids, k->ids + QUEUE_CHUNK/2, sizeof(int64_t) * split->n);
+			k->n = QUEUE_CHUNK/2;
+			if (off > k->n) {
+				off -= k->n;
+				k = split;
+			}
+		}
+	}
 
-	if (sqlite3_prepare_v2(player_index_db, "select id from tunes order by random() limit 1", -1, &random_id, NULL) != SQLITE_OK) goto random_index_item_sqlite3_failure;
+	memmove(k->ids + off + 1, k->ids + off, sizeof(int64_t) * (k->n - off));
+	k->ids[off] = id;
+	++k->n;
+	++queue_n;
+}
 
-	if (sqlite3_step(random_id) != SQLITE_ROW) goto random_index_item_sqlite3_failure;
-	int64_t id = sqlite3_column_int64(random_id, 0);
-	sqlite3_finalize(random_id);
+static int64_t queue_remove_at(int64_t i) {
+	int off;
+	int c = chunk_locate(i, &off);
+	struct queue_chunk *k = chunks[c];
+	int64_t id = k->ids[off];
+
+	memmove(k->ids + off, k->ids + off + 1, sizeof(int64_t) * (k->n - off - 1));
+	--k->n;
+	--queue_n;
+
+	if (k->n == 0) {
+		// the queue always keeps one chunk
+		if (chunks_n > 1) chunk_drop(c);
+	} else if ((c + 1 < chunks_n) && (k->n + chunks[c+1]->n <= QUEUE_CHUNK/2)) {
+		// merge half empty neighbours, or removals would leave many tiny chunks
+		memcpy(k->ids + k->n, chunks[c+1]->ids, sizeof(int64_t) * chunks[c+1]->n);
+		k->n += chunks[c+1]->n;
+		chunk_drop(c + 1);
+	}
 
 	return id;
+}
+
+// Forgets the tunes played more than queue.history tunes ago
+static void queue_trim(void) {
+	while (queue_current - queue_base > queue_history) {
+		queue_remove_at(0);
+		++queue_base;
+	}
+}
+
+static bool queue_do_insert(int64_t pos, int64_t id) {
+	if ((pos < queue_base) || (pos > queue_base + queue_n)) return false;
 
-random_index_item_sqlite3_failure:
+	queue_insert_at(pos - queue_base, id);
+	if (pos <= queue_current) ++queue_current;
 
-	fprintf(stderr, "Sqlite3 error during random_index_item selection: %s\n", sqlite3_errmsg(player_index_db));
-	exit(EXIT_FAILURE);
+	return true;
 }
 
-void advance_queue(sqlite3 *index_db) {
-	if (queue_currently_playing_idx >= 0) {
-		//printf("setting played to true for %d\n", queue_currently_playing_idx);
-		queue[queue_currently_playing_idx].played = true;
+static bool queue_do_remove(int64_t pos) {
+	if ((pos < queue_base) || (pos >= queue_base + queue_n)) return false;
+	if (pos == queue_current) return false;
+
+	queue_remove_at(pos - queue_base);
+	if (pos < queue_current) --queue_current;
+
+	return true;
+}
+
+static bool queue_do_move(int64_t from, int64_t to) {
+	if ((from < queue_base) || (from >= queue_base + queue_n)) return false;
+	if ((to < queue_base) || (to >= queue_base + queue_n)) return false;
+
+	queue_insert_at(to - queue_base, queue_remove_at(from - queue_base));
+
+	if (from == queue_current) {
+		queue_current = to;
+	} else {
+		if (from < queue_current) --queue_current;
+		if (to <= queue_current) ++queue_current;
 	}
 
-	queue_currently_playing_idx = (queue_currently_playing_idx + 1) % QUEUE_LENGTH;
+	return true;
+}
+
+static void queue_do_advance(void) {
+	++queue_current;
+	queue_trim();
+}
+
+static bool queue_do_prev(void) {
+	if (queue_current - 1 < queue_base) return false;
+	--queue_current;
+	return true;
+}
+
+// Every change to the queue is appended to the journal in the configuration
+// directory, start replays it. Once it holds many more records than the
+// queue has tunes it is rewritten as a snapshot, taken on the main loop after
+// the change that triggered it has been handled and synced by journal's
+// thread.
+enum queue_op {
+	QUEUE_OP_APPEND = 1, // a: id
+	QUEUE_OP_INSERT = 2, // a: position, b: id
+	QUEUE_OP_REMOVE = 3, // a: position
+	QUEUE_OP_MOVE = 4, // a: from, b: to
+	QUEUE_OP_ADVANCE = 5,
+	QUEUE_OP_PREV = 6,
+	QUEUE_OP_BASE = 7, // a: position of the first tune, only in snapshots
+	QUEUE_OP_CURRENT = 8, // a: position of the current tune, only in snapshots
+	QUEUE_OP_DRAWN = 9, // a: the id queue_peek_next drew, 0 once appended or returned
+};
+
+#define QUEUE_COMPACT_MIN 4096
+
+static struct journal *journal = NULL;
+static guint compact_source_id = 0;
+
+// the tune queue_peek_next drew from the shuffle bag, appended when the queue
+// moves past its end
+static int64_t queue_drawn = 0;
+
+static void queue_replay(void *data, int64_t op, int64_t a, int64_t b) {
+	switch (op) {
+	case QUEUE_OP_APPEND:
+		queue_insert_at(queue_n, a);
+		break;
+	case QUEUE_OP_INSERT:
+		queue_do_insert(a, b);
+		break;
+	case QUEUE_OP_REMOVE:
+		queue_do_remove(a);
+		break;
+	case QUEUE_OP_MOVE:
+		queue_do_move(a, b);
+		break;
+	case QUEUE_OP_ADVANCE:
+		if (queue_current + 1 < queue_base + queue_n) queue_do_advance();
+		break;
+	case QUEUE_OP_PREV:
+		queue_do_prev();
+		break;
+	case QUEUE_OP_BASE:
+		if (queue_n == 0) {
+			queue_base = a;
+			queue_current = a - 1;
+		}
+		break;
+	case QUEUE_OP_CURRENT:
+		if ((a >= queue_base) && (a < queue_base + queue_n)) queue_current = a;
+		break;
+	case QUEUE_OP_DRAWN:
+		queue_drawn = a;
+		break;
+	}
+}
 
-	if (queue[queue_currently_playing_idx].occupied) {
-		if (!queue[queue_currently_playing_idx].played) return;
+static void queue_snapshot(void *data, struct journal *j) {
+	journal_append(j, QUEUE_OP_BASE, queue_base, 0);
+	for (int c = 0; c < chunks_n; ++c) {
+		for (int i = 0; i < chunks[c]->n; ++i) {
+			journal_append(j, QUEUE_OP_APPEND, chunks[c]->ids[i], 0);
+		}
 	}
+	journal_append(j, QUEUE_OP_CURRENT, queue_current, 0);
+	if (queue_drawn != 0) journal_append(j, QUEUE_OP_DRAWN, queue_drawn, 0);
+}
+
+static gboolean queue_compact(gpointer data) {
+	journal_compact(journal, queue_snapshot, NULL);
+	compact_source_id = 0;
+	return FALSE;
+}
 
-	// either not occupied or already played (we looped back)
+// the changes made while handling a command, a batch included, are one
+// queue event
+static guint event_source_id = 0;
 
-	queue_append(random_index_item(index_db));
+void queue_event(GString *events) {
+	g_string_append_printf(events, "queue\t%" PRId64 "\t%" PRId64 "\t%" PRId64 "\n", queue_base, queue_current, queue_base + queue_n);
 }
 
-static void clear_screen(void) {
-	putctlcod("cl", stdout);
+static gboolean queue_changed(gpointer data) {
+	GString *event = g_string_new(NULL);
+	queue_event(event);
+	events_emit(event->str);
+	g_string_free(event, TRUE);
+	event_source_id = 0;
+	return FALSE;
+}
+
+static void queue_log(int64_t op, int64_t a, int64_t b) {
+	// the drawn tune isn't in the queue yet
+	if ((event_source_id == 0) && (op != QUEUE_OP_DRAWN) && events_subscribed()) {
+		event_source_id = g_idle_add(queue_changed, NULL);
+	}
+
+	if (journal == NULL) return;
+
+	journal_append(journal, op, a, b);
+
+	if ((compact_source_id == 0) && (journal_records(journal) > QUEUE_COMPACT_MIN + 2 * queue_n)) {
+		compact_source_id = g_idle_add(queue_compact, NULL);
+	}
 }
 
-void go_to_tune(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id) {
-	if (sqlite3_reset(tune_select) != SQLITE_OK) goto print_tune_sqlite_failure;
-	if (sqlite3_bind_int64(tune_select, 1, id) != SQLITE_OK) goto print_tune_sqlite_failure;
-	if (sqlite3_step(tune_select) != SQLITE_ROW) goto print_tune_sqlite_failure;
+bool queue_init(sqlite3 *index_db) {
+	while (chunks_n > 0) chunk_drop(chunks_n - 1);
+	chunk_new_at(0);
+	queue_n = 0;
+	queue_base = 0;
+	queue_current = -1;
+	queue_drawn = 0;
+
+	char *history = setting_get(index_db, "queue.history");
+	queue_history = atoll(history);
+	if (queue_history < 0) queue_history = 0;
+	free(history);
 
-	return;
+	char *path = config_path("queue");
+	journal = journal_open(path, queue_replay, NULL);
+	free(path);
 
-print_tune_sqlite_failure:
+	// also drops whatever a crash left after the last good record
+	if (journal != NULL) journal_compact(journal, queue_snapshot, NULL);
 
-	fprintf(stderr, "Sqlite error while displaying queue: %s\n", sqlite3_errmsg(index_db));
-	exit(EXIT_FAILURE);
+	return queue_currently_playing() != 0;
 }
 
-char *print_tune(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id, bool current, int idx) {
-	char *lyricist_link = NULL;
+void queue_close(void) {
+	if (compact_source_id != 0) {
+		g_source_remove(compact_source_id);
+		compact_source_id = 0;
+	}
+	if (event_source_id != 0) {
+		g_source_remove(event_source_id);
+		event_source_id = 0;
+	}
+	journal_close(journal);
+	journal = NULL;
+
+	while (chunks_n > 0) chunk_drop(chunks_n - 1);
+	free(chunks);
+	chunks = NULL;
+	chunks_size = 0;
+}
+
+void queue_append(int64_t id) {
+	queue_insert_at(queue_n, id);
+	queue_log(QUEUE_OP_APPEND, id, 0);
+}
+
+void queue_insert_next(int64_t id) {
+	int64_t pos = queue_current + 1;
+	queue_do_insert(pos, id);
+	queue_log(QUEUE_OP_INSERT, pos, id);
+}
+
+bool queue_remove(int64_t pos) {
+	if (!queue_do_remove(pos)) return false;
+	queue_log(QUEUE_OP_REMOVE, pos, 0);
+	return true;
+}
+
+bool queue_move(int64_t from, int64_t to) {
+	if (!queue_do_move(from, to)) return false;
+	queue_log(QUEUE_OP_MOVE, from, to);
+	return true;
+}
+
+int64_t queue_currently_playing(void) {
+	if ((queue_current < queue_base) || (queue_current >= queue_base + queue_n)) return 0;
+	return queue_get_at(queue_current - queue_base);
+}
+
+int64_t queue_currently_playing_pos(void) {
+	return queue_current;
+}
+
+int64_t queue_peek_next(sqlite3 *index_db) {
+	if (queue_current + 1 < queue_base + queue_n) return queue_get_at(queue_current + 1 - queue_base);
+	if (queue_drawn == 0) {
+		// the bag saved it as picked, the journal keeps it from being lost
+		queue_drawn = shuffle_next(index_db);
+		queue_log(QUEUE_OP_DRAWN, queue_drawn, 0);
+	}
+	return queue_drawn;
+}
+
+void queue_return_drawn(void) {
+	if (queue_drawn == 0) return;
+	shuffle_return(queue_drawn);
+	queue_drawn = 0;
+	queue_log(QUEUE_OP_DRAWN, 0, 0);
+}
+
+void advance_queue(sqlite3 *index_db) {
+	if (queue_current + 1 >= queue_base + queue_n) {
+		if (queue_drawn != 0) {
+			queue_append(queue_drawn);
+			queue_drawn = 0;
+			queue_log(QUEUE_OP_DRAWN, 0, 0);
+		} else {
+			queue_append(shuffle_next(index_db));
+		}
+	}
+
+	queue_do_advance();
+	queue_log(QUEUE_OP_ADVANCE, 0, 0);
+}
+
+static void clear_screen(void) {
+	putctlcod("cl", stdout);
+}
 
-	go_to_tune(index_db, tune_select, id);
+static void print_tune_lines(FILE *out, const struct tune *t, bool current, int64_t idx) {
+	if (idx >= 0) {
+		fprintf(out, " %c %" PRId64 ". %s\n", current ? '>' : ' ', idx, t->title);
+		fprintf(out, " %c\tby %s from %s [%s]\n", current ? '>' : ' ', t->artist, t->album, t->track);
+	} else {
+		fprintf(out, "%" PRId64 "   %s\n", t->id, t->title);
+		fprintf(out, "       by %s from %s [%s]\n", t->artist, t->album, t->track);
+	}
+}
+
+char *print_tune(FILE *out, const struct tune *t, bool current, int64_t idx) {
+	char *lyricist_link = NULL;
 
 	if (current) {
 		FILE *f = fopen("/tmp/minstrel.currently", "w");
 		if (f != NULL) {
-			fprintf(f, "Index: %d\n", idx);
-			fprintf(f, "Title: %s\n", sqlite3_column_text(tune_select, 12));
-			fprintf(f, "Author: %s\n", sqlite3_column_text(tune_select, 1));
-			fprintf(f, "Album: %s\n", sqlite3_column_text(tune_select, 0));
-			fprintf(f, "Track: %s\n", sqlite3_column_text(tune_select, 13));
+			fprintf(f, "Index: %" PRId64 "\n", idx);
+			fprintf(f, "Title: %s\n", t->title);
+			fprintf(f, "Author: %s\n", t->artist);
+			fprintf(f, "Album: %s\n", t->album);
+			fprintf(f, "Track: %s\n", t->track);
 			fclose(f);
 		}
 
-		asprintf(&lyricist_link, "Lyrics (maybe): http://lyrics.wikia.com/%s:%s", sqlite3_column_text(tune_select, 1), sqlite3_column_text(tune_select, 12));
+		asprintf(&lyricist_link, "Lyrics (maybe): http://lyrics.wikia.com/%s:%s", t->artist, t->title);
 
 		for (char *c = lyricist_link + strlen("Lyrics (maybe): "); *c != '\0'; ++c) {
 			if (*c == ' ') *c = '_';
 		}
 	}
 
-	if (idx >= 0) {
-		printf(" %c %d. %s\n", current ? '>' : ' ', idx, sqlite3_column_text(tune_select, 12));
-		printf(" %c\tby %s from %s [%s]\n", current ? '>' : ' ', sqlite3_column_text(tune_select, 1), sqlite3_column_text(tune_select, 0), sqlite3_column_text(tune_select, 13));
-	} else {
-		printf("%ld   %s\n", id, sqlite3_column_text(tune_select, 12));
-		printf("       by %s from %s [%s]\n", sqlite3_column_text(tune_select, 1), sqlite3_column_text(tune_select, 0), sqlite3_column_text(tune_select, 13));
-	}
+	print_tune_lines(out, t, current, idx);
 
 	return lyricist_link;
 }
 
-static bool queue_could_be_prev(int idx) {
-	if (!queue[idx].occupied) return false;
-	if (!queue[idx].played) return false;
-	return true;
-}
-
 #define DISPLAY_BEFORE_CURRENT 5
 #define DISPLAY_AFTER_CURRENT 5
 
-void display_queue(sqlite3 *index_db, sqlite3_stmt *tune_select) {
-	clear_screen();
+static int64_t display_first(void) {
+	int64_t first = queue_current - (DISPLAY_BEFORE_CURRENT - 1);
+	return (first < queue_base) ? queue_base : first;
+}
 
-	int start_off = 1;
+static int64_t display_end(void) {
+	int64_t end = queue_current + DISPLAY_AFTER_CURRENT;
+	return (end > queue_base + queue_n) ? queue_base + queue_n : end;
+}
 
-	while (queue_could_be_prev((queue_currently_playing_idx - start_off) % QUEUE_LENGTH)
-		&& (start_off < DISPLAY_BEFORE_CURRENT))
-		++start_off;
+void queue_load_window(void) {
+	int64_t ids[DISPLAY_BEFORE_CURRENT + DISPLAY_AFTER_CURRENT];
+	int n = 0;
 
-	for (int i = start_off-1; i > 0; --i) {
-		int idx = (queue_currently_playing_idx - i) % QUEUE_LENGTH;
-		print_tune(index_db, tune_select, queue[idx].id, false, idx);
+	for (int64_t pos = display_first(); pos < display_end(); ++pos) {
+		ids[n++] = queue_get_at(pos - queue_base);
 	}
 
-	char *lyricist_link = print_tune(index_db, tune_select, queue_currently_playing()->id, true, queue_currently_playing_idx);
+	cache_load(ids, n);
+}
+
+void display_queue(void) {
+	queue_load_window();
 
-	for (int i = 1; i < DISPLAY_AFTER_CURRENT; ++i) {
-		int idx = (queue_currently_playing_idx + i) % QUEUE_LENGTH;
-		if (!queue[idx].occupied) break;
-		if (queue[idx].played) break;
-		print_tune(index_db, tune_select, queue[idx].id, false, idx);
-	}
+	clear_screen();
+
+	char *lyricist_link = NULL;
 
-	sqlite3_reset(tune_select);
+	// tunes deleted from the library since they were queued are left out
+	for (int64_t pos = display_first(); pos < display_end(); ++pos) {
+		const struct tune *t = cache_get(queue_get_at(pos - queue_base));
+		if (t == NULL) continue;
+		if (pos == queue_current) {
+			lyricist_link = print_tune(stdout, t, true, pos);
+		} else {
+			print_tune(stdout, t, false, pos);
+		}
+	}
 
 	printf("\n");
 	if (lyricist_link != NULL) {
@@ -158,10 +481,28 @@ void display_queue(sqlite3 *index_db, sqlite3_stmt *tune_select) {
 	}
 }
 
+void queue_print(FILE *out, int64_t first, int64_t end) {
+	if (first < queue_base) first = queue_base;
+	if (end > queue_base + queue_n) end = queue_base + queue_n;
+
+	for (int64_t pos = first; pos < end; ++pos) {
+		// the tunes are loaded a cache full at a time
+		if ((pos - first) % CACHE_SIZE == 0) {
+			int64_t ids[CACHE_SIZE];
+			int n = 0;
+			for (int64_t p = pos; (p < end) && (n < CACHE_SIZE); ++p) {
+				ids[n++] = queue_get_at(p - queue_base);
+			}
+			cache_load(ids, n);
+		}
+
+		const struct tune *t = cache_get(queue_get_at(pos - queue_base));
+		if (t != NULL) print_tune_lines(out, t, pos == queue_current, pos);
+	}
+}
+
 bool queue_to_prev(void) {
-	int prev_idx = (queue_currently_playing_idx - 1) % QUEUE_LENGTH;
-	if (!queue_could_be_prev(prev_idx)) return false;
-	queue_currently_playing()->played = false;
-	queue_currently_playing_idx = prev_idx;
+	if (!queue_do_prev()) return false;
+	queue_log(QUEUE_OP_PREV, 0, 0);
 	return true;
 }
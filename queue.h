@@ -3,27 +3,49 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include <sqlite3.h>
+#include <glib.h>
 
-struct item {
-	bool occupied;
-	bool played;
-	int64_t id;
-};
+#include "cache.h"
 
-#define QUEUE_LENGTH 2048
-extern struct item queue[QUEUE_LENGTH];
-extern int queue_position;
-extern int queue_currently_playing_idx;
+// The queue is a list of tune ids, the tunes before the current one were
+// already played. Positions are absolute: they start at 0 with a new
+// queue and don't change when old history is dropped from the front, but
+// inserting, removing or moving a tune shifts the ones after it.
 
-void queue_init(void);
+// Restores the queue saved in the configuration directory, returns true if
+// it has a current tune
+bool queue_init(sqlite3 *index_db);
+void queue_close(void);
 void queue_append(int64_t id);
-struct item *queue_currently_playing(void);
+// Inserts id right after the current tune
+void queue_insert_next(int64_t id);
+// Returns false if pos isn't in the queue or is the current tune
+bool queue_remove(int64_t pos);
+// Moves the tune at from to position to, the current tune can be moved
+bool queue_move(int64_t from, int64_t to);
+// Returns the id of the current tune, 0 if the queue is empty
+int64_t queue_currently_playing(void);
+int64_t queue_currently_playing_pos(void);
+// Returns the id of the tune after the current one without moving to it, at
+// the end of the queue it is drawn from the shuffle bag and kept, in the
+// journal too, for advance_queue, tunes added in the meantime still come first
+int64_t queue_peek_next(sqlite3 *index_db);
+// Puts the tune queue_peek_next drew back in the shuffle bag, the next peek
+// draws again
+void queue_return_drawn(void);
 void advance_queue(sqlite3 *index_db);
-void display_queue(sqlite3 *index_db, sqlite3_stmt *tune_select);
+// Loads the tunes display_queue shows into the cache with one query
+void queue_load_window(void);
+void display_queue(void);
+// Prints the tunes at the positions from first to end, excluded, that are in
+// the queue, like display_queue does
+void queue_print(FILE *out, int64_t first, int64_t end);
 bool queue_to_prev(void);
-void go_to_tune(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id);
-char *print_tune(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id, bool current, int idx);
+// Appends the queue event of events.h: its first, current and end positions
+void queue_event(GString *events);
+char *print_tune(FILE *out, const struct tune *t, bool current, int64_t idx);
 
-#endif
\ No newline at end of file
+#endif
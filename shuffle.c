@@ -0,0 +1,594 @@
+#include "shuffle.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <glib.h>
+
+#include "util.h"
+#include "stats.h"
+#include "stmt.h"
+
+#define SHUFFLE_MAGIC "mshuf01"
+
+// The file is this header followed by n ids. ids[0..cursor) were picked
+// during the current round, ids[cursor..n) are left.
+struct shuffle_header {
+	char magic[8];
+	int64_t n;
+	int64_t cursor;
+};
+
+static int64_t *bag = NULL;
+static int64_t bag_n = 0, bag_size = 0, bag_cursor = 0;
+// id -> position in bag
+static GHashTable *bag_positions = NULL;
+static int bag_fd = -1;
+
+#define ID_KEY(id) ((gpointer)(intptr_t)(id))
+#define POSITION_VALUE(pos) ((gpointer)(intptr_t)(pos))
+
+static void bag_write(off_t off, const void *buf, size_t len) {
+	if (bag_fd < 0) return;
+	if (pwrite(bag_fd, buf, len, off) != (ssize_t)len) {
+		perror("Could not save shuffle state");
+		close(bag_fd);
+		bag_fd = -1;
+	}
+}
+
+static void bag_write_header(void) {
+	struct shuffle_header header;
+	memcpy(header.magic, SHUFFLE_MAGIC, sizeof(header.magic));
+	header.n = bag_n;
+	header.cursor = bag_cursor;
+	bag_write(0, &header, sizeof(header));
+}
+
+static void bag_write_slot(int64_t pos) {
+	bag_write(sizeof(struct shuffle_header) + pos * sizeof(int64_t), bag + pos, sizeof(int64_t));
+}
+
+static void bag_write_all(void) {
+	if (bag_fd < 0) return;
+	if (ftruncate(bag_fd, sizeof(struct shuffle_header) + bag_n * sizeof(int64_t)) < 0) {
+		perror("Could not save shuffle state");
+	}
+	bag_write(sizeof(struct shuffle_header), bag, bag_n * sizeof(int64_t));
+	bag_write_header();
+}
+
+static void bag_set(int64_t pos, int64_t id) {
+	bag[pos] = id;
+	g_hash_table_insert(bag_positions, ID_KEY(id), POSITION_VALUE(pos));
+}
+
+static void bag_append(int64_t id) {
+	if (bag_n >= bag_size) {
+		bag_size = (bag_size == 0) ? 1024 : bag_size * 2;
+		bag = realloc(bag, sizeof(int64_t) * bag_size);
+		oomp(bag);
+	}
+	bag_set(bag_n++, id);
+}
+
+static bool bag_lookup(int64_t id, int64_t *pos) {
+	gpointer value;
+	if (!g_hash_table_lookup_extended(bag_positions, ID_KEY(id), NULL, &value)) return false;
+	*pos = (intptr_t)value;
+	return true;
+}
+
+// Removes the id at pos keeping picked ids before the cursor
+static void bag_remove(int64_t pos) {
+	g_hash_table_remove(bag_positions, ID_KEY(bag[pos]));
+
+	if (pos < bag_cursor) {
+		// the last picked id takes its place, the last id takes the last picked's
+		--bag_cursor;
+		if (pos != bag_cursor) {
+			bag_set(pos, bag[bag_cursor]);
+			bag_write_slot(pos);
+		}
+		pos = bag_cursor;
+	}
+
+	--bag_n;
+	if (pos != bag_n) {
+		bag_set(pos, bag[bag_n]);
+		bag_write_slot(pos);
+	}
+
+	bag_write_header();
+}
+
+static void bag_load(void) {
+	char *path = config_path("shuffle");
+	bag_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (bag_fd < 0) {
+		fprintf(stderr, "Could not open %s, shuffle state will not be saved\n", path);
+	}
+	free(path);
+
+	if (bag_fd < 0) return;
+
+	struct shuffle_header header;
+	if (pread(bag_fd, &header, sizeof(header), 0) != sizeof(header)) return;
+	if (memcmp(header.magic, SHUFFLE_MAGIC, sizeof(header.magic)) != 0) return;
+	if ((header.n < 0) || (header.cursor < 0) || (header.cursor > header.n)) return;
+
+	int64_t *ids = malloc(sizeof(int64_t) * (header.n + 1));
+	oomp(ids);
+
+	ssize_t len = header.n * sizeof(int64_t);
+	if (pread(bag_fd, ids, len, sizeof(header)) == len) {
+		for (int64_t i = 0; i < header.n; ++i) {
+			if (g_hash_table_contains(bag_positions, ID_KEY(ids[i]))) continue;
+			if (i < header.cursor) ++bag_cursor;
+			bag_append(ids[i]);
+		}
+	}
+
+	free(ids);
+}
+
+// Makes the bag contain exactly the ids in tunes. Picked ids stay picked,
+// new ones are added to the ones left.
+static void bag_reconcile(sqlite3 *index_db) {
+	sqlite3_stmt *select = NULL;
+	bool *present = calloc(bag_n + 1, sizeof(bool));
+	oomp(present);
+	GArray *added = g_array_new(FALSE, FALSE, sizeof(int64_t));
+
+	select = stmt_get(index_db, "select id from tunes");
+	if (select == NULL) goto bag_reconcile_failure;
+
+	int r;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		int64_t id = sqlite3_column_int64(select, 0);
+		int64_t pos;
+		if (bag_lookup(id, &pos)) {
+			present[pos] = true;
+		} else {
+			g_array_append_val(added, id);
+		}
+	}
+	if (r != SQLITE_DONE) goto bag_reconcile_failure;
+
+	sqlite3_reset(select);
+
+	int64_t *old = bag;
+	int64_t old_n = bag_n, old_cursor = bag_cursor;
+
+	bag = NULL;
+	bag_n = bag_size = bag_cursor = 0;
+	g_hash_table_remove_all(bag_positions);
+
+	for (int64_t i = 0; i < old_n; ++i) {
+		if (!present[i]) continue;
+		if (i < old_cursor) ++bag_cursor;
+		bag_append(old[i]);
+	}
+	for (guint i = 0; i < added->len; ++i) {
+		bag_append(g_array_index(added, int64_t, i));
+	}
+
+	free(old);
+	free(present);
+	g_array_free(added, TRUE);
+
+	bag_write_all();
+
+	return;
+
+bag_reconcile_failure:
+
+	fprintf(stderr, "Sqlite3 error loading tunes to shuffle: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+/* Weighted mode */
+
+// Tunes are picked with probability proportional to their weight, sampled
+// with a Fenwick tree over the positions in bag. The bag file isn't used,
+// removed tunes leave a slot of weight 0 (and id 0) until the next start.
+
+#define REBUILD_EVERY 65536
+
+static bool weighted = false;
+static struct {
+	double base, listened, added, skipped, cooldown, cooldown_factor;
+} formula;
+
+// weights[pos] is the weight used for sampling, cooldown included
+static double *weights = NULL;
+// tree[i] is the sum of weights[i - (i & -i) .. i), tree[0] is unused
+static double *tree = NULL;
+// tunes picked or played recently have their weight reduced until cooled_until[pos]
+static int64_t *cooled_until = NULL;
+static int64_t weights_size = 0, weighted_live = 0, updates_since_rebuild = 0;
+
+// pending ends of cooldowns, by time
+struct cooling {
+	int64_t id;
+	int64_t until;
+};
+static GQueue *cooling = NULL;
+
+
+static double weight_raw(int64_t listened, int64_t added, int64_t skipped) {
+	double w = (formula.base + formula.listened * listened + formula.added * added) / (1 + formula.skipped * skipped);
+	return (w > 0) ? w : 0;
+}
+
+static void weights_grow(void) {
+	if (bag_n <= weights_size) return;
+	weights_size = bag_size;
+	weights = realloc(weights, sizeof(double) * weights_size);
+	oomp(weights);
+	tree = realloc(tree, sizeof(double) * (weights_size + 1));
+	oomp(tree);
+	cooled_until = realloc(cooled_until, sizeof(int64_t) * weights_size);
+	oomp(cooled_until);
+}
+
+static double tree_prefix(int64_t count) {
+	double sum = 0;
+	for (int64_t i = count; i > 0; i -= i & -i) {
+		sum += tree[i];
+	}
+	return sum;
+}
+
+static void tree_add(int64_t pos, double delta) {
+	for (int64_t i = pos + 1; i <= bag_n; i += i & -i) {
+		tree[i] += delta;
+	}
+}
+
+static void tree_rebuild(void) {
+	for (int64_t i = 1; i <= bag_n; ++i) {
+		tree[i] = weights[i-1];
+	}
+	for (int64_t i = 1; i <= bag_n; ++i) {
+		int64_t parent = i + (i & -i);
+		if (parent <= bag_n) tree[parent] += tree[i];
+	}
+	updates_since_rebuild = 0;
+}
+
+// Position of the tune where the running sum of weights goes past target
+static int64_t tree_find(double target) {
+	int64_t i = 0, step = 1;
+	while (step * 2 <= bag_n) step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if ((i + step <= bag_n) && (tree[i + step] <= target)) {
+			i += step;
+			target -= tree[i];
+		}
+	}
+
+	return i;
+}
+
+static void weight_set(int64_t pos, double w) {
+	tree_add(pos, w - weights[pos]);
+	weights[pos] = w;
+	// sums of doubles drift, start again from the weights once in a while
+	if (++updates_since_rebuild >= REBUILD_EVERY) {
+		tree_rebuild();
+	}
+}
+
+static void cooling_push(int64_t id, int64_t until) {
+	struct cooling *c = malloc(sizeof(struct cooling));
+	oomp(c);
+	c->id = id;
+	c->until = until;
+	g_queue_push_tail(cooling, c);
+}
+
+static gint cooling_compare(gconstpointer a, gconstpointer b, gpointer data) {
+	const struct cooling *ca = a, *cb = b;
+	return (ca->until > cb->until) - (ca->until < cb->until);
+}
+
+// Reads the rating of the tune at pos again and recomputes its weight
+static void weight_refresh(sqlite3 *index_db, int64_t pos, int64_t now) {
+	struct rating rating = { 0, 0, 0, 0 };
+	sqlite3_stmt *key_select = stmt_get(index_db, "select track_key from tunes where id = ?");
+
+	if (key_select == NULL) goto weight_refresh_failure;
+	if (sqlite3_bind_int64(key_select, 1, bag[pos]) != SQLITE_OK) goto weight_refresh_failure;
+
+	int r = sqlite3_step(key_select);
+	if (r == SQLITE_ROW) {
+		rating_get(sqlite3_column_int64(key_select, 0), &rating);
+	} else if (r != SQLITE_DONE) {
+		goto weight_refresh_failure;
+	}
+
+	// a finished statement doesn't keep the index's read transaction open
+	sqlite3_reset(key_select);
+
+	double w = weight_raw(rating.listened, rating.added, rating.skipped);
+
+	int64_t until = rating.last_played + (int64_t)formula.cooldown;
+	if (until < cooled_until[pos]) until = cooled_until[pos];
+
+	if (until > now) {
+		w *= formula.cooldown_factor;
+		if (until > cooled_until[pos]) cooling_push(bag[pos], until);
+		cooled_until[pos] = until;
+	} else {
+		cooled_until[pos] = 0;
+	}
+
+	weight_set(pos, w);
+	return;
+
+weight_refresh_failure:
+
+	fprintf(stderr, "Sqlite3 error reading tune for rating: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+// Ends the cooldowns that expired, tunes played again meanwhile stay cool
+static void cooling_expire(sqlite3 *index_db, int64_t now) {
+	while (!g_queue_is_empty(cooling)) {
+		struct cooling *c = g_queue_peek_head(cooling);
+		if (c->until > now) break;
+		g_queue_pop_head(cooling);
+
+		int64_t pos;
+		if (bag_lookup(c->id, &pos) && (cooled_until[pos] == c->until)) {
+			cooled_until[pos] = 0;
+			weight_refresh(index_db, pos, now);
+		}
+
+		free(c);
+	}
+}
+
+static void weighted_append(sqlite3 *index_db, int64_t id, int64_t now) {
+	bag_append(id);
+	weights_grow();
+
+	int64_t pos = bag_n - 1, i = bag_n;
+	weights[pos] = 0;
+	cooled_until[pos] = 0;
+	tree[i] = tree_prefix(i - 1) - tree_prefix(i - (i & -i));
+	++weighted_live;
+
+	weight_refresh(index_db, pos, now);
+}
+
+static void weighted_remove(int64_t pos) {
+	g_hash_table_remove(bag_positions, ID_KEY(bag[pos]));
+	bag[pos] = 0;
+	cooled_until[pos] = 0;
+	weight_set(pos, 0);
+	--weighted_live;
+}
+
+static void weighted_load(sqlite3 *index_db) {
+	sqlite3_stmt *select = NULL;
+	GArray *cooldowns = g_array_new(FALSE, FALSE, sizeof(struct cooling));
+	int64_t now = time(NULL);
+	int r;
+
+	formula.base = setting_get_double(index_db, "weight.base");
+	formula.listened = setting_get_double(index_db, "weight.listened");
+	formula.added = setting_get_double(index_db, "weight.added");
+	formula.skipped = setting_get_double(index_db, "weight.skipped");
+	formula.cooldown = setting_get_double(index_db, "weight.cooldown");
+	formula.cooldown_factor = setting_get_double(index_db, "weight.cooldown_factor");
+
+	select = stmt_get(index_db, "select id, track_key from tunes");
+	if (select == NULL) goto weighted_load_failure;
+
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		bag_append(sqlite3_column_int64(select, 0));
+		weights_grow();
+
+		int64_t pos = bag_n - 1;
+		struct rating rating;
+		rating_get(sqlite3_column_int64(select, 1), &rating);
+
+		weights[pos] = weight_raw(rating.listened, rating.added, rating.skipped);
+		cooled_until[pos] = 0;
+
+		struct cooling c = { bag[pos], rating.last_played + (int64_t)formula.cooldown };
+		if (c.until > now) {
+			weights[pos] *= formula.cooldown_factor;
+			cooled_until[pos] = c.until;
+			g_array_append_val(cooldowns, c);
+		}
+	}
+	if (r != SQLITE_DONE) goto weighted_load_failure;
+
+	sqlite3_reset(select);
+
+	weighted_live = bag_n;
+	tree_rebuild();
+
+	g_array_sort_with_data(cooldowns, cooling_compare, NULL);
+	for (guint i = 0; i < cooldowns->len; ++i) {
+		struct cooling *c = &g_array_index(cooldowns, struct cooling, i);
+		cooling_push(c->id, c->until);
+	}
+
+	g_array_free(cooldowns, TRUE);
+
+	return;
+
+weighted_load_failure:
+
+	fprintf(stderr, "Sqlite3 error loading tunes to shuffle: %s\n", sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+static int64_t weighted_next(sqlite3 *index_db) {
+	int64_t now = time(NULL);
+
+	cooling_expire(index_db, now);
+
+	if (weighted_live <= 0) {
+		fprintf(stderr, "Nothing to play, the index is empty\n");
+		exit(EXIT_FAILURE);
+	}
+
+	int64_t pos = -1;
+	double total = tree_prefix(bag_n);
+
+	if (total > 0) {
+		pos = tree_find(g_random_double() * total);
+		// rounding can land on the end or on an empty slot
+		if ((pos >= bag_n) || (weights[pos] <= 0)) pos = -1;
+	}
+
+	if (pos < 0) {
+		// every weight is 0, any tune will do
+		tree_rebuild();
+		do {
+			pos = g_random_int_range(0, bag_n);
+		} while (bag[pos] == 0);
+	}
+
+	// cool down now, a tune that fails to play shouldn't come up again right away
+	if ((formula.cooldown > 0) && (cooled_until[pos] <= now)) {
+		cooled_until[pos] = now + (int64_t)formula.cooldown;
+		cooling_push(bag[pos], cooled_until[pos]);
+		weight_set(pos, weights[pos] * formula.cooldown_factor);
+	}
+
+	return bag[pos];
+}
+
+void shuffle_rating_changed(sqlite3 *index_db, int64_t id) {
+	int64_t pos;
+	if (!weighted || !bag_lookup(id, &pos)) return;
+	weight_refresh(index_db, pos, time(NULL));
+}
+
+void shuffle_init(sqlite3 *index_db) {
+	bag_positions = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	char *mode = setting_get(index_db, "shuffle");
+	weighted = (strcmp(mode, "weighted") == 0);
+	if (!weighted && (strcmp(mode, "bag") != 0)) {
+		fprintf(stderr, "Unknown shuffle mode %s, using bag\n", mode);
+	}
+	free(mode);
+
+	if (weighted) {
+		cooling = g_queue_new();
+		weighted_load(index_db);
+		return;
+	}
+
+	bag_load();
+	// the index could have changed while the player wasn't running
+	bag_reconcile(index_db);
+}
+
+int64_t shuffle_next(sqlite3 *index_db) {
+	if (weighted) return weighted_next(index_db);
+
+	if (bag_cursor >= bag_n) {
+		// every tune was picked, the new round starts from what is in the index now
+		bag_cursor = 0;
+		bag_reconcile(index_db);
+	}
+
+	if (bag_n == 0) {
+		fprintf(stderr, "Nothing to play, the index is empty\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// one step of Fisher-Yates
+	int64_t pick = bag_cursor + g_random_int_range(0, bag_n - bag_cursor);
+	int64_t id = bag[pick];
+	if (pick != bag_cursor) {
+		bag_set(pick, bag[bag_cursor]);
+		bag_set(bag_cursor, id);
+		bag_write_slot(pick);
+		bag_write_slot(bag_cursor);
+	}
+	++bag_cursor;
+	bag_write_header();
+
+	return id;
+}
+
+void shuffle_return(int64_t id) {
+	int64_t pos;
+	// a weighted pick leaves the tune in, only cooled down
+	if (weighted || !bag_lookup(id, &pos) || (pos >= bag_cursor)) return;
+
+	// the last picked id takes its place, the cursor moves back over it
+	--bag_cursor;
+	if (pos != bag_cursor) {
+		bag_set(pos, bag[bag_cursor]);
+		bag_set(bag_cursor, id);
+		bag_write_slot(pos);
+		bag_write_slot(bag_cursor);
+	}
+	bag_write_header();
+}
+
+void shuffle_changes(sqlite3 *index_db, struct index_changes *changes) {
+	for (int i = 0; i < changes->n; ++i) {
+		int64_t pos;
+		bool present = bag_lookup(changes->v[i].id, &pos);
+
+		switch (changes->v[i].kind) {
+		case INDEX_ADDED:
+			if (present) break;
+			if (weighted) {
+				weighted_append(index_db, changes->v[i].id, time(NULL));
+			} else {
+				bag_append(changes->v[i].id);
+				bag_write_slot(bag_n-1);
+				bag_write_header();
+			}
+			break;
+		case INDEX_REMOVED:
+			if (!present) break;
+			if (weighted) {
+				weighted_remove(pos);
+			} else {
+				bag_remove(pos);
+			}
+			break;
+		case INDEX_UPDATED:
+			break;
+		}
+	}
+}
+
+void shuffle_close(void) {
+	if (weighted) {
+		g_queue_free_full(cooling, free);
+		cooling = NULL;
+		free(weights);
+		free(tree);
+		free(cooled_until);
+		weights = tree = NULL;
+		cooled_until = NULL;
+		weights_size = weighted_live = 0;
+		weighted = false;
+	}
+
+	if (bag_fd >= 0) close(bag_fd);
+	bag_fd = -1;
+	free(bag);
+	bag = NULL;
+	bag_n = bag_size = bag_cursor = 0;
+	g_hash_table_destroy(bag_positions);
+	bag_positions = NULL;
+}
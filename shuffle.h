@@ -0,0 +1,27 @@
+#ifndef __SHUFFLE__
+#define __SHUFFLE__
+
+#include <stdint.h>
+#include <sqlite3.h>
+
+#include "index.h"
+
+// Shuffle bag over every tune in the index: each pick is uniformly random
+// among the tunes not picked yet, no tune repeats until all were picked.
+// The bag is saved in the configuration directory after every pick.
+//
+// With the shuffle setting set to weighted tunes are picked with a
+// probability proportional to a weight computed from their rating (see the
+// weight.* settings), rating_init and, in the player, stats_start must be
+// called before shuffle_init.
+
+void shuffle_init(sqlite3 *index_db);
+int64_t shuffle_next(sqlite3 *index_db);
+// Puts id, picked and not played, back among the tunes left in the bag
+void shuffle_return(int64_t id);
+void shuffle_changes(sqlite3 *index_db, struct index_changes *changes);
+// to be called after the rating of id changed
+void shuffle_rating_changed(sqlite3 *index_db, int64_t id);
+void shuffle_close(void);
+
+#endif
@@ -1,12 +1,66 @@
 #include "stats.h"
 
 #include <stdlib.h>
-
-#include "queue.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <glib.h>
+
+#include "cache.h"
+#include "stmt.h"
 #include "util.h"
 
 sqlite3 *rating_db = NULL;
 
+// Entries are only dropped by stats_stop, the batches handed to the writer
+// point to their filenames
+struct stats_entry {
+	struct rating total; // what the rating db will hold once delta is written
+	struct rating delta; // not handed to the writer yet
+	bool dirty;
+	int64_t track_key;
+	char filename[];
+};
+
+struct stats_delta {
+	int64_t track_key;
+	const char *filename;
+	struct rating delta;
+};
+
+// one row of history
+struct stats_event {
+	const char *filename;
+	char *artist, *album;
+	int64_t time;
+	int kind;
+};
+
+struct stats_batch {
+	struct stats_delta *v;
+	int n;
+	struct stats_event *events;
+	int events_n;
+};
+
+// sent to the writer to make it exit
+static struct stats_batch end_of_batches;
+
+// track key -> struct stats_entry, NULL until stats_start, only accessed by the main loop
+static GHashTable *entries = NULL;
+static struct stats_entry **dirty = NULL;
+static int dirty_n = 0, dirty_size = 0;
+static struct stats_event *events = NULL;
+static int events_n = 0, events_size = 0;
+static gint64 dirty_first = 0, dirty_last = 0;
+static guint tick_source_id = 0;
+
+static GAsyncQueue *batches = NULL;
+static GThread *writer = NULL;
+// the history.* settings, read by stats_start for the writer
+static int64_t keep_events = 0, keep_daily = 0, keep_weekly = 0;
+
 void rating_init(void) {
 	char *errmsg;
 
@@ -18,7 +72,42 @@ void rating_init(void) {
 	sqlite3_exec(rating_db, "pragma synchronous = off;", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto rating_init_failure;
 
-	sqlite3_exec(rating_db, "CREATE TABLE IF NOT EXISTS rating(filename text primary key, listened integer default 0, added integer default 0);", NULL, NULL, &errmsg);
+	// the player's writer never blocks the commands reading the ratings
+	sqlite3_exec(rating_db, "pragma journal_mode = wal;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	// filename is the file's when it was last counted
+	sqlite3_exec(rating_db, "CREATE TABLE IF NOT EXISTS rating(track_key integer primary key, filename text, listened integer default 0, added integer default 0, skipped integer default 0, last_played integer);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	if (!sqlite3_has_column(rating_db, "rating", "skipped")) {
+		sqlite3_exec(rating_db, "ALTER TABLE rating ADD COLUMN skipped integer default 0; ALTER TABLE rating ADD COLUMN last_played integer;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto rating_init_failure;
+	}
+
+	if (!sqlite3_has_column(rating_db, "rating", "track_key")) {
+		sqlite3_exec(rating_db, "BEGIN; CREATE TABLE rating_v1(track_key integer primary key, filename text, listened integer default 0, added integer default 0, skipped integer default 0, last_played integer); "
+			"INSERT OR REPLACE INTO rating_v1 SELECT track_key(filename), filename, listened, added, skipped, last_played FROM rating; "
+			"DROP TABLE rating; ALTER TABLE rating_v1 RENAME TO rating; COMMIT;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto rating_init_failure;
+	}
+
+	// the most-* reports walk these in order
+	sqlite3_exec(rating_db, "CREATE INDEX IF NOT EXISTS rating_listened ON rating(listened); CREATE INDEX IF NOT EXISTS rating_added ON rating(added);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	// kind is one of enum stats_kind
+	sqlite3_exec(rating_db, "CREATE TABLE IF NOT EXISTS history(time integer not null, filename text not null, kind integer not null);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	sqlite3_exec(rating_db, "CREATE INDEX IF NOT EXISTS history_time ON history(time);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	// what is one of enum stats_rollup and name the filename, artist or album
+	sqlite3_exec(rating_db, "CREATE TABLE IF NOT EXISTS rollup_daily(what integer, day integer, name text, listened integer default 0, added integer default 0, skipped integer default 0, primary key(what, day, name));", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto rating_init_failure;
+
+	sqlite3_exec(rating_db, "CREATE TABLE IF NOT EXISTS rollup_weekly(what integer, week integer, name text, listened integer default 0, added integer default 0, skipped integer default 0, primary key(what, week, name));", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto rating_init_failure;
 
 	return;
@@ -27,67 +116,394 @@ rating_init_failure:
 
 	fprintf(stderr, "Sqlite error building rating db: %s\n", errmsg);
 	sqlite3_free(errmsg);
-	sqlite3_close(rating_db);
+	close_db(rating_db);
 	exit(EXIT_FAILURE);
 }
 
-void increment_listened(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id) {
-	const unsigned char *path;
-	sqlite3_stmt *update_stmt;
+static bool rollup_add(sqlite3_stmt *upsert, enum stats_rollup what, int64_t period, const char *name, enum stats_kind kind) {
+	if (name == NULL) return true;
+
+	sqlite3_reset(upsert);
+	if (sqlite3_bind_int(upsert, 1, what) != SQLITE_OK) return false;
+	if (sqlite3_bind_int64(upsert, 2, period) != SQLITE_OK) return false;
+	if (sqlite3_bind_text(upsert, 3, name, -1, SQLITE_STATIC) != SQLITE_OK) return false;
+	if (sqlite3_bind_int(upsert, 4, kind == STATS_LISTENED) != SQLITE_OK) return false;
+	if (sqlite3_bind_int(upsert, 5, kind == STATS_ADDED) != SQLITE_OK) return false;
+	if (sqlite3_bind_int(upsert, 6, kind == STATS_SKIPPED) != SQLITE_OK) return false;
+	return sqlite3_step(upsert) == SQLITE_DONE;
+}
 
-	go_to_tune(index_db, tune_select, id);
-	path = sqlite3_column_text(tune_select, 14);
+// Counts the event in the totals of its tune, artist and album
+static bool rollup_event(sqlite3_stmt *upsert, int64_t period, const struct stats_event *e) {
+	return rollup_add(upsert, ROLLUP_TUNE, period, e->filename, e->kind)
+		&& rollup_add(upsert, ROLLUP_ARTIST, period, e->artist, e->kind)
+		&& rollup_add(upsert, ROLLUP_ALBUM, period, e->album, e->kind);
+}
 
-	if (sqlite3_prepare_v2(rating_db, "insert or ignore into rating(filename) values (?)", -1, &update_stmt, NULL) != SQLITE_OK) goto increment_listened_failure;
+// Adds the deltas to the rating table, the events to the history and to
+// their day's and week's totals, all in one transaction
+static void stats_write(sqlite3 *db, const struct stats_delta *v, int n, const struct stats_event *ev, int m) {
+	sqlite3_stmt *upsert = NULL, *insert = NULL, *daily = NULL, *weekly = NULL;
+
+	if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) goto stats_write_failure;
+
+	upsert = stmt_get(db, "insert into rating(track_key, filename, listened, added, skipped, last_played) values (?, ?, ?, ?, ?, ?) "
+		"on conflict(track_key) do update set filename = excluded.filename, listened = listened + excluded.listened, added = added + excluded.added, "
+		"skipped = skipped + excluded.skipped, last_played = coalesce(excluded.last_played, last_played)");
+	if (upsert == NULL) goto stats_write_failure;
+
+	for (int i = 0; i < n; ++i) {
+		const struct rating *d = &v[i].delta;
+
+		sqlite3_reset(upsert);
+		if (sqlite3_bind_int64(upsert, 1, v[i].track_key) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_text(upsert, 2, v[i].filename, -1, SQLITE_STATIC) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_int64(upsert, 3, d->listened) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_int64(upsert, 4, d->added) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_int64(upsert, 5, d->skipped) != SQLITE_OK) goto stats_write_failure;
+		if (d->last_played != 0) {
+			if (sqlite3_bind_int64(upsert, 6, d->last_played) != SQLITE_OK) goto stats_write_failure;
+		} else {
+			if (sqlite3_bind_null(upsert, 6) != SQLITE_OK) goto stats_write_failure;
+		}
+		if (sqlite3_step(upsert) != SQLITE_DONE) goto stats_write_failure;
+	}
+
+	sqlite3_reset(upsert);
+
+	insert = stmt_get(db, "insert into history(time, filename, kind) values (?, ?, ?)");
+	if (insert == NULL) goto stats_write_failure;
+	daily = stmt_get(db, "insert into rollup_daily(what, day, name, listened, added, skipped) values (?, ?, ?, ?, ?, ?) "
+		"on conflict(what, day, name) do update set listened = listened + excluded.listened, "
+		"added = added + excluded.added, skipped = skipped + excluded.skipped");
+	if (daily == NULL) goto stats_write_failure;
+	weekly = stmt_get(db, "insert into rollup_weekly(what, week, name, listened, added, skipped) values (?, ?, ?, ?, ?, ?) "
+		"on conflict(what, week, name) do update set listened = listened + excluded.listened, "
+		"added = added + excluded.added, skipped = skipped + excluded.skipped");
+	if (weekly == NULL) goto stats_write_failure;
+
+	for (int i = 0; i < m; ++i) {
+		sqlite3_reset(insert);
+		if (sqlite3_bind_int64(insert, 1, ev[i].time) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_text(insert, 2, ev[i].filename, -1, SQLITE_STATIC) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_bind_int(insert, 3, ev[i].kind) != SQLITE_OK) goto stats_write_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto stats_write_failure;
+
+		if (!rollup_event(daily, stats_day(ev[i].time), &ev[i])) goto stats_write_failure;
+		if (!rollup_event(weekly, stats_week(ev[i].time), &ev[i])) goto stats_write_failure;
+	}
+
+	sqlite3_reset(insert);
+	sqlite3_reset(daily);
+	sqlite3_reset(weekly);
+	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) goto stats_write_failure;
 
-	if (sqlite3_bind_text(update_stmt, 1, (const char *)path, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto increment_listened_failure;
+	return;
 
-	if (sqlite3_step(update_stmt) != SQLITE_DONE) goto increment_listened_failure;
+stats_write_failure:
 
-	sqlite3_finalize(update_stmt);
+	fprintf(stderr, "Sqlite error writing %d ratings: %s\n", n, sqlite3_errmsg(db));
+	if (upsert != NULL) sqlite3_reset(upsert);
+	if (insert != NULL) sqlite3_reset(insert);
+	if (daily != NULL) sqlite3_reset(daily);
+	if (weekly != NULL) sqlite3_reset(weekly);
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+}
 
-	if (sqlite3_prepare_v2(rating_db, "update rating set listened = listened + 1 where filename = ?", -1, &update_stmt, NULL) != SQLITE_OK) goto increment_listened_failure;
+// Drops the history and the totals older than the history.* settings allow
+static void stats_expire(sqlite3 *db, int64_t now) {
+	const char *queries[] = {
+		"delete from history where time < ?",
+		"delete from rollup_daily where day < ?",
+		"delete from rollup_weekly where week < ?",
+	};
+	int64_t oldest[] = {
+		(keep_events > 0) ? now - keep_events * 86400 : 0,
+		(keep_daily > 0) ? stats_day(now) - keep_daily + 1 : 0,
+		(keep_weekly > 0) ? stats_week(now) - keep_weekly + 1 : 0,
+	};
+
+	for (int i = 0; i < sizeof(queries)/sizeof(const char *); ++i) {
+		if (oldest[i] <= 0) continue;
+
+		sqlite3_stmt *delete = stmt_get(db, queries[i]);
+		if (delete == NULL) goto stats_expire_failure;
+		if (sqlite3_bind_int64(delete, 1, oldest[i]) != SQLITE_OK) goto stats_expire_failure;
+		if (sqlite3_step(delete) != SQLITE_DONE) goto stats_expire_failure;
+		sqlite3_reset(delete);
+	}
+	return;
+
+stats_expire_failure:
+
+	fprintf(stderr, "Sqlite error expiring history: %s\n", sqlite3_errmsg(db));
+}
 
-	if (sqlite3_bind_text(update_stmt, 1, (const char *)path, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto increment_listened_failure;
+static void stats_events_free(struct stats_event *ev, int m) {
+	for (int i = 0; i < m; ++i) {
+		free(ev[i].artist);
+		free(ev[i].album);
+	}
+	free(ev);
+}
 
-	if (sqlite3_step(update_stmt) != SQLITE_DONE) goto increment_listened_failure;
+static gpointer stats_writer(gpointer data) {
+	sqlite3 *db = open_or_create_db("rating");
+	sqlite3_exec(db, "pragma synchronous = off;", NULL, NULL, NULL);
 
-	sqlite3_finalize(update_stmt);
+	// expired rows are dropped at start and then once a day
+	int64_t expired_day = 0;
 
-	return;
+	for (;;) {
+		int64_t now = time(NULL);
+		if (stats_day(now) != expired_day) {
+			stats_expire(db, now);
+			expired_day = stats_day(now);
+		}
 
-increment_listened_failure:
+		struct stats_batch *batch = g_async_queue_pop(batches);
+		if (batch == &end_of_batches) break;
 
-	fprintf(stderr, "could not increment listened count\n");
+		stats_write(db, batch->v, batch->n, batch->events, batch->events_n);
+		free(batch->v);
+		stats_events_free(batch->events, batch->events_n);
+		free(batch);
+	}
+
+	close_db(db);
+	return NULL;
+}
+
+static void stats_flush(void) {
+	if ((dirty_n == 0) && (events_n == 0)) return;
+
+	struct stats_batch *batch = malloc(sizeof(struct stats_batch));
+	oomp(batch);
+	batch->v = malloc(sizeof(struct stats_delta) * dirty_n);
+	oomp(batch->v);
+	batch->n = dirty_n;
+
+	for (int i = 0; i < dirty_n; ++i) {
+		struct stats_entry *e = dirty[i];
+		batch->v[i].track_key = e->track_key;
+		batch->v[i].filename = e->filename;
+		batch->v[i].delta = e->delta;
+		memset(&e->delta, 0, sizeof(struct rating));
+		e->dirty = false;
+	}
+	dirty_n = 0;
+
+	batch->events = events;
+	batch->events_n = events_n;
+	events = NULL;
+	events_n = events_size = 0;
+
+	g_async_queue_push(batches, batch);
 }
 
-void increment_added(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id) {
-	const unsigned char *path;
-	sqlite3_stmt *update_stmt;
+static gboolean stats_tick(gpointer data) {
+	gint64 now = g_get_monotonic_time();
+
+	if ((now - dirty_last < STATS_FLUSH_QUIET * G_USEC_PER_SEC) && (now - dirty_first < STATS_FLUSH_MAX_DELAY * G_USEC_PER_SEC)) {
+		return TRUE;
+	}
+
+	stats_flush();
+
+	tick_source_id = 0;
+	return FALSE;
+}
+
+static struct stats_entry *stats_entry_get(int64_t track_key, const char *filename) {
+	struct stats_entry *e = g_hash_table_lookup(entries, &track_key);
+	if (e != NULL) return e;
+
+	if (filename == NULL) filename = "";
+	e = calloc(1, sizeof(struct stats_entry) + strlen(filename) + 1);
+	oomp(e);
+	e->track_key = track_key;
+	strcpy(e->filename, filename);
+	g_hash_table_insert(entries, &e->track_key, e);
+	return e;
+}
+
+// Counts an event of the tune id
+static void stats_count(int64_t id, enum stats_kind kind) {
+	const struct tune *t = cache_get(id);
+	if (t == NULL) return;
+
+	int64_t now = time(NULL);
+	struct rating delta = { kind == STATS_LISTENED, kind == STATS_ADDED, kind == STATS_SKIPPED, (kind != STATS_ADDED) ? now : 0 };
+
+	struct stats_event ev = { t->filename, NULL, NULL, now, kind };
+	if (t->artist != NULL) {
+		ev.artist = strdup(t->artist);
+		oomp(ev.artist);
+	}
+	if (t->album != NULL) {
+		ev.album = strdup(t->album);
+		oomp(ev.album);
+	}
+
+	if (entries == NULL) {
+		struct stats_delta v = { t->track_key, t->filename, delta };
+		stats_write(rating_db, &v, 1, &ev, 1);
+		free(ev.artist);
+		free(ev.album);
+		return;
+	}
+
+	struct stats_entry *e = stats_entry_get(t->track_key, t->filename);
+	ev.filename = e->filename;
+
+	e->total.listened += delta.listened;
+	e->total.added += delta.added;
+	e->total.skipped += delta.skipped;
+	e->delta.listened += delta.listened;
+	e->delta.added += delta.added;
+	e->delta.skipped += delta.skipped;
+	if (delta.last_played != 0) {
+		e->total.last_played = delta.last_played;
+		e->delta.last_played = delta.last_played;
+	}
+
+	if (!e->dirty) {
+		if (dirty_n == dirty_size) {
+			dirty_size = (dirty_size > 0) ? 2 * dirty_size : 64;
+			dirty = realloc(dirty, sizeof(struct stats_entry *) * dirty_size);
+			oomp(dirty);
+		}
+		dirty[dirty_n++] = e;
+		e->dirty = true;
+	}
+
+	if (events_n == events_size) {
+		events_size = (events_size > 0) ? 2 * events_size : 64;
+		events = realloc(events, sizeof(struct stats_event) * events_size);
+		oomp(events);
+	}
+	events[events_n++] = ev;
+
+	gint64 tick = g_get_monotonic_time();
+	if (tick_source_id == 0) {
+		dirty_first = tick;
+		tick_source_id = g_timeout_add_seconds(1, stats_tick, NULL);
+	}
+	dirty_last = tick;
+}
+
+void stats_start(sqlite3 *index_db) {
+	int r;
+
+	keep_events = setting_get_double(index_db, "history.events");
+	keep_daily = setting_get_double(index_db, "history.daily");
+	keep_weekly = setting_get_double(index_db, "history.weekly");
 
-	go_to_tune(index_db, tune_select, id);
-	path = sqlite3_column_text(tune_select, 14);
+	entries = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, free);
 
-	if (sqlite3_prepare_v2(rating_db, "insert or ignore into rating(filename) values (?)", -1, &update_stmt, NULL) != SQLITE_OK) goto increment_added_failure;
+	sqlite3_stmt *select = stmt_get(rating_db, "select track_key, filename, listened, added, skipped, last_played from rating");
+	if (select == NULL) goto stats_start_failure;
 
-	if (sqlite3_bind_text(update_stmt, 1, (const char *)path, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto increment_added_failure;
+	while ((r = sqlite3_step(select)) == SQLITE_ROW) {
+		struct stats_entry *e = stats_entry_get(sqlite3_column_int64(select, 0), (const char *)sqlite3_column_text(select, 1));
+		e->total.listened = sqlite3_column_int64(select, 2);
+		e->total.added = sqlite3_column_int64(select, 3);
+		e->total.skipped = sqlite3_column_int64(select, 4);
+		e->total.last_played = sqlite3_column_int64(select, 5);
+	}
+	if (r != SQLITE_DONE) goto stats_start_failure;
 
-	if (sqlite3_step(update_stmt) != SQLITE_DONE) goto increment_added_failure;
+	sqlite3_reset(select);
 
-	sqlite3_finalize(update_stmt);
+	batches = g_async_queue_new();
+	writer = g_thread_new("stats", stats_writer, NULL);
+	return;
 
-	if (sqlite3_prepare_v2(rating_db, "update rating set added = added + 1 where filename = ?", -1, &update_stmt, NULL) != SQLITE_OK) goto increment_added_failure;
+stats_start_failure:
 
-	if (sqlite3_bind_text(update_stmt, 1, (const char *)path, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto increment_added_failure;
+	fprintf(stderr, "Sqlite error loading ratings: %s\n", sqlite3_errmsg(rating_db));
+	exit(EXIT_FAILURE);
+}
 
-	if (sqlite3_step(update_stmt) != SQLITE_DONE) goto increment_added_failure;
+void stats_stop(void) {
+	if (entries == NULL) return;
+
+	if (tick_source_id != 0) {
+		g_source_remove(tick_source_id);
+		tick_source_id = 0;
+	}
+	stats_flush();
+
+	g_async_queue_push(batches, &end_of_batches);
+	g_thread_join(writer);
+	writer = NULL;
+	g_async_queue_unref(batches);
+	batches = NULL;
+
+	g_hash_table_destroy(entries);
+	entries = NULL;
+	free(dirty);
+	dirty = NULL;
+	dirty_n = dirty_size = 0;
+}
 
-	sqlite3_finalize(update_stmt);
+void increment_listened(int64_t id) {
+	stats_count(id, STATS_LISTENED);
+}
+
+void increment_added(int64_t id) {
+	stats_count(id, STATS_ADDED);
+}
 
+void increment_skipped(int64_t id) {
+	stats_count(id, STATS_SKIPPED);
+}
+
+void rating_get(int64_t track_key, struct rating *r) {
+	memset(r, 0, sizeof(struct rating));
+
+	if (entries != NULL) {
+		struct stats_entry *e = g_hash_table_lookup(entries, &track_key);
+		if (e != NULL) *r = e->total;
+		return;
+	}
+
+	sqlite3_stmt *select = stmt_get(rating_db, "select listened, added, skipped, last_played from rating where track_key = ?");
+	if (select == NULL) goto rating_get_failure;
+	if (sqlite3_bind_int64(select, 1, track_key) != SQLITE_OK) goto rating_get_failure;
+
+	int s = sqlite3_step(select);
+	if (s == SQLITE_ROW) {
+		r->listened = sqlite3_column_int64(select, 0);
+		r->added = sqlite3_column_int64(select, 1);
+		r->skipped = sqlite3_column_int64(select, 2);
+		r->last_played = sqlite3_column_int64(select, 3);
+	} else if (s != SQLITE_DONE) {
+		goto rating_get_failure;
+	}
+
+	// a finished statement doesn't keep the read transaction open
+	sqlite3_reset(select);
 	return;
 
-increment_added_failure:
+rating_get_failure:
 
-	fprintf(stderr, "could not increment added count\n");
+	fprintf(stderr, "Sqlite3 error reading rating: %s\n", sqlite3_errmsg(rating_db));
+	exit(EXIT_FAILURE);
 }
 
+void rating_attach(sqlite3 *db) {
+	char *path = config_path("rating");
+	char *attach = sqlite3_mprintf("ATTACH DATABASE %Q AS rating;", path);
+	oomp(attach);
+	char *errmsg = NULL;
+
+	sqlite3_exec(db, attach, NULL, NULL, &errmsg);
+	if (errmsg != NULL) {
+		fprintf(stderr, "Sqlite error attaching rating db: %s\n", errmsg);
+		exit(EXIT_FAILURE);
+	}
+
+	sqlite3_free(attach);
+	free(path);
+}
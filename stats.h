@@ -5,10 +5,51 @@
 
 #include <sqlite3.h>
 
+// last_played is 0 if the tune was never played
+struct rating {
+	int64_t listened, added, skipped, last_played;
+};
+
+enum stats_kind {
+	STATS_LISTENED = 1,
+	STATS_ADDED = 2,
+	STATS_SKIPPED = 3,
+};
+
+enum stats_rollup {
+	ROLLUP_TUNE = 0,
+	ROLLUP_ARTIST = 1,
+	ROLLUP_ALBUM = 2,
+};
+
+// The history table logs every count with its time, rollup_daily and
+// rollup_weekly add them up per tune, artist and album for each day and week
+// (UTC, weeks start on monday) as they are written. The history.* settings
+// say for how long each is kept.
+#define stats_day(t) ((t) / 86400)
+#define stats_week(t) ((stats_day(t) + 3) / 7)
+
 extern sqlite3 *rating_db;
 
+#define STATS_FLUSH_QUIET 2
+#define STATS_FLUSH_MAX_DELAY 30
+
 void rating_init(void);
-void increment_listened(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id);
-void increment_added(sqlite3 *index_db, sqlite3_stmt *tune_select, int64_t id);
+// The player keeps the whole rating table in memory once started, the
+// counters only change it there and a writer thread adds the changes to the
+// rating db in one transaction: every STATS_FLUSH_MAX_DELAY seconds, once
+// no counter moved for STATS_FLUSH_QUIET seconds, and at stats_stop. Without
+// stats_start every increment is written right away.
+void stats_start(sqlite3 *index_db);
+void stats_stop(void);
+// the counters look the tune up in the cache, cache_init must be called first
+void increment_listened(int64_t id);
+void increment_added(int64_t id);
+void increment_skipped(int64_t id);
+// Fills r with the counters of the tune with track_key, all 0 if it has none
+void rating_get(int64_t track_key, struct rating *r);
+// Attaches the rating db to db as the rating schema, rating_init must have
+// created it
+void rating_attach(sqlite3 *db);
 
 #endif
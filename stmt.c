@@ -0,0 +1,70 @@
+#include "stmt.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "util.h"
+
+// connection -> (sql -> statement), connections can be used by different
+// threads (the library watcher has its own)
+static GHashTable *registry = NULL;
+static GMutex registry_mutex;
+static gint prepares = 0;
+
+static void stmt_free(gpointer stmt) {
+	sqlite3_finalize(stmt);
+}
+
+static void statements_free(gpointer statements) {
+	g_hash_table_destroy(statements);
+}
+
+sqlite3_stmt *stmt_get(sqlite3 *db, const char *sql) {
+	g_mutex_lock(&registry_mutex);
+
+	if (registry == NULL) {
+		registry = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, statements_free);
+	}
+
+	GHashTable *statements = g_hash_table_lookup(registry, db);
+	if (statements == NULL) {
+		statements = g_hash_table_new_full(g_str_hash, g_str_equal, free, stmt_free);
+		g_hash_table_insert(registry, db, statements);
+	}
+
+	sqlite3_stmt *stmt = g_hash_table_lookup(statements, sql);
+
+	g_mutex_unlock(&registry_mutex);
+
+	if (stmt != NULL) {
+		sqlite3_reset(stmt);
+		sqlite3_clear_bindings(stmt);
+		return stmt;
+	}
+
+	if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL) != SQLITE_OK) {
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+	g_atomic_int_inc(&prepares);
+
+	char *key = strdup(sql);
+	oomp(key);
+
+	g_mutex_lock(&registry_mutex);
+	g_hash_table_insert(statements, key, stmt);
+	g_mutex_unlock(&registry_mutex);
+
+	return stmt;
+}
+
+void stmt_close(sqlite3 *db) {
+	g_mutex_lock(&registry_mutex);
+	if (registry != NULL) g_hash_table_remove(registry, db);
+	g_mutex_unlock(&registry_mutex);
+}
+
+int stmt_prepares(void) {
+	return g_atomic_int_get(&prepares);
+}
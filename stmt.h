@@ -0,0 +1,21 @@
+#ifndef __STMT__
+#define __STMT__
+
+#include <sqlite3.h>
+
+// Prepared statements shared by every module, one set per connection keyed
+// by their SQL. A statement is prepared (with SQLITE_PREPARE_PERSISTENT) the
+// first time it is asked for and then reused for the life of the connection.
+//
+// A borrowed statement comes reset with its bindings cleared, the caller
+// must not finalize it and should reset it when done so it doesn't hold a
+// read transaction open. It can not be borrowed again while in use.
+
+// Returns NULL if the SQL doesn't compile, sqlite3_errmsg(db) tells why
+sqlite3_stmt *stmt_get(sqlite3 *db, const char *sql);
+// Finalizes the statements of db, close_db calls it
+void stmt_close(sqlite3 *db);
+// Statements prepared since the program started
+int stmt_prepares(void);
+
+#endif
@@ -0,0 +1,902 @@
+#include "tags.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "util.h"
+
+// reads are done in chunks of at least TAG_READ_CHUNK bytes, anything larger
+// than TAG_MAX_READ (embedded pictures, mostly) is skipped or makes us give up
+#define TAG_READ_CHUNK (64 * 1024)
+#define TAG_MAX_READ (4 * 1024 * 1024)
+
+// a pread based reader that serves small reads from its last chunk
+struct tag_reader {
+	int fd;
+	int64_t size;
+	uint8_t *buf;
+	size_t buf_size;
+	int64_t buf_off;
+	size_t buf_len;
+	size_t bytes_read;
+};
+
+// Returns a pointer to len bytes of the file at off, valid until the next call, or NULL
+static const uint8_t *tr_get(struct tag_reader *tr, int64_t off, size_t len) {
+	if ((off < 0) || (len > TAG_MAX_READ) || (off + (int64_t)len > tr->size)) return NULL;
+
+	if ((off >= tr->buf_off) && (off + (int64_t)len <= tr->buf_off + (int64_t)tr->buf_len)) {
+		return tr->buf + (off - tr->buf_off);
+	}
+
+	size_t want = (len > TAG_READ_CHUNK) ? len : TAG_READ_CHUNK;
+	if (want > tr->buf_size) {
+		tr->buf = realloc(tr->buf, want);
+		oomp(tr->buf);
+		tr->buf_size = want;
+	}
+
+	ssize_t n = pread(tr->fd, tr->buf, want, off);
+	if (n < 0) n = 0;
+	tr->bytes_read += n;
+	tr->buf_off = off;
+	tr->buf_len = n;
+
+	if ((size_t)n < len) return NULL;
+	return tr->buf;
+}
+
+static uint32_t be32(const uint8_t *p) {
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint32_t be24(const uint8_t *p) {
+	return ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+}
+
+static uint32_t le32(const uint8_t *p) {
+	return ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t syncsafe32(const uint8_t *p) {
+	return ((uint32_t)(p[0] & 0x7f) << 21) | ((uint32_t)(p[1] & 0x7f) << 14) | ((uint32_t)(p[2] & 0x7f) << 7) | (p[3] & 0x7f);
+}
+
+/* TEXT DECODING */
+
+static void utf8_put(char **out, uint32_t c) {
+	char *o = *out;
+	if (c < 0x80) {
+		*o++ = c;
+	} else if (c < 0x800) {
+		*o++ = 0xc0 | (c >> 6);
+		*o++ = 0x80 | (c & 0x3f);
+	} else if (c < 0x10000) {
+		*o++ = 0xe0 | (c >> 12);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	} else {
+		*o++ = 0xf0 | (c >> 18);
+		*o++ = 0x80 | ((c >> 12) & 0x3f);
+		*o++ = 0x80 | ((c >> 6) & 0x3f);
+		*o++ = 0x80 | (c & 0x3f);
+	}
+	*out = o;
+}
+
+// Strips trailing spaces, returns NULL (and frees s) if nothing is left
+static char *text_finish(char *s) {
+	size_t n = strlen(s);
+	while ((n > 0) && (s[n-1] == ' ')) --n;
+	s[n] = '\0';
+	if (n == 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+static char *text_utf8(const uint8_t *p, size_t len) {
+	size_t n = 0;
+	while ((n < len) && (p[n] != '\0')) ++n;
+	char *r = malloc(n + 1);
+	oomp(r);
+	memcpy(r, p, n);
+	r[n] = '\0';
+	return text_finish(r);
+}
+
+static char *text_latin1(const uint8_t *p, size_t len) {
+	char *r = malloc(len * 2 + 1);
+	oomp(r);
+	char *o = r;
+	for (size_t i = 0; (i < len) && (p[i] != '\0'); ++i) {
+		utf8_put(&o, p[i]);
+	}
+	*o = '\0';
+	return text_finish(r);
+}
+
+// big_endian is only a default, a byte order mark overrides it
+static char *text_utf16(const uint8_t *p, size_t len, bool big_endian) {
+	if (len >= 2) {
+		if ((p[0] == 0xff) && (p[1] == 0xfe)) {
+			big_endian = false;
+			p += 2; len -= 2;
+		} else if ((p[0] == 0xfe) && (p[1] == 0xff)) {
+			big_endian = true;
+			p += 2; len -= 2;
+		}
+	}
+
+	char *r = malloc(len * 2 + 1);
+	oomp(r);
+	char *o = r;
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		uint32_t c = big_endian ? ((p[i] << 8) | p[i+1]) : ((p[i+1] << 8) | p[i]);
+		if (c == 0) break;
+		if ((c >= 0xd800) && (c < 0xdc00) && (i + 3 < len)) {
+			uint32_t c2 = big_endian ? ((p[i+2] << 8) | p[i+3]) : ((p[i+3] << 8) | p[i+2]);
+			if ((c2 >= 0xdc00) && (c2 < 0xe000)) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				i += 2;
+			}
+		}
+		utf8_put(&o, c);
+	}
+	*o = '\0';
+	return text_finish(r);
+}
+
+static void tag_set(char **field, char *value) {
+	if (value == NULL) return;
+	if (*field != NULL) {
+		// first value wins
+		free(value);
+		return;
+	}
+	*field = value;
+}
+
+static bool tags_empty(struct tags *t) {
+	return (t->album == NULL) && (t->artist == NULL) && (t->album_artist == NULL)
+		&& (t->comment == NULL) && (t->composer == NULL) && (t->copyright == NULL)
+		&& (t->date == NULL) && (t->disc == NULL) && (t->encoder == NULL)
+		&& (t->genre == NULL) && (t->performer == NULL) && (t->publisher == NULL)
+		&& (t->title == NULL) && (t->track == NULL);
+}
+
+/* ID3 */
+
+static const char *ID3_GENRES[] = {
+	"Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop",
+	"Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap",
+	"Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska", "Death Metal", "Pranks",
+	"Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance",
+	"Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+	"AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+	"Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+	"Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+	"Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+	"Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock",
+	"Folk", "Folk-Rock", "National Folk", "Swing", "Fast Fusion", "Bebob", "Latin", "Revival",
+	"Celtic", "Bluegrass", "Avantgarde", "Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
+	"Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
+	"Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam",
+	"Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul", "Freestyle",
+	"Duet", "Punk Rock", "Drum Solo", "A capella", "Euro-House", "Dance Hall",
+};
+
+#define ID3_GENRE_COUNT (sizeof(ID3_GENRES)/sizeof(const char *))
+
+static char *id3_genre_name(int n) {
+	if ((n < 0) || (n >= ID3_GENRE_COUNT)) return NULL;
+	char *r = strdup(ID3_GENRES[n]);
+	oomp(r);
+	return r;
+}
+
+// Replaces numeric ID3 genres, "13" or "(13)", with their name
+static char *id3_genre(char *genre) {
+	if (genre == NULL) return NULL;
+
+	const char *p = genre;
+	bool paren = (*p == '(');
+	if (paren) ++p;
+	if ((*p < '0') || (*p > '9')) return genre;
+
+	char *end;
+	long n = strtol(p, &end, 10);
+	if (paren) {
+		if (*end != ')') return genre;
+		++end;
+	}
+	if (*end != '\0') return genre;
+
+	char *name = id3_genre_name(n);
+	if (name == NULL) return genre;
+	free(genre);
+	return name;
+}
+
+static char *id3_text(const uint8_t *p, size_t len) {
+	if (len < 1) return NULL;
+	switch (p[0]) {
+	case 0:
+		return text_latin1(p+1, len-1);
+	case 1:
+		return text_utf16(p+1, len-1, false);
+	case 2:
+		return text_utf16(p+1, len-1, true);
+	case 3:
+		return text_utf8(p+1, len-1);
+	default:
+		return NULL;
+	}
+}
+
+// COMM frames: encoding, language, description, text
+static char *id3_comment(const uint8_t *p, size_t len, bool *has_description) {
+	if (len < 5) return NULL;
+	uint8_t encoding = p[0];
+	size_t i = 4;
+	bool wide = (encoding == 1) || (encoding == 2);
+
+	*has_description = false;
+	if (wide) {
+		for (; i + 1 < len; i += 2) {
+			if ((p[i] == 0) && (p[i+1] == 0)) break;
+			// a lone byte order mark is an empty description
+			if (!(((p[i] == 0xff) && (p[i+1] == 0xfe)) || ((p[i] == 0xfe) && (p[i+1] == 0xff)))) *has_description = true;
+		}
+		i += 2;
+	} else {
+		for (; i < len; ++i) {
+			if (p[i] == 0) break;
+			*has_description = true;
+		}
+		i += 1;
+	}
+	if (i >= len) return NULL;
+
+	// reuse id3_text by faking the encoding byte in front of the text
+	uint8_t *buf = malloc(len - i + 1);
+	oomp(buf);
+	buf[0] = encoding;
+	memcpy(buf+1, p+i, len-i);
+	char *r = id3_text(buf, len-i+1);
+	free(buf);
+	return r;
+}
+
+static char **id3_field(struct tags *t, const char *id, int version) {
+	if (version == 2) {
+		if (strcmp(id, "TAL") == 0) return &t->album;
+		if (strcmp(id, "TP1") == 0) return &t->artist;
+		if (strcmp(id, "TP2") == 0) return &t->album_artist;
+		if (strcmp(id, "TCM") == 0) return &t->composer;
+		if (strcmp(id, "TCR") == 0) return &t->copyright;
+		if (strcmp(id, "TYE") == 0) return &t->date;
+		if (strcmp(id, "TPA") == 0) return &t->disc;
+		if (strcmp(id, "TSS") == 0) return &t->encoder;
+		if (strcmp(id, "TCO") == 0) return &t->genre;
+		if (strcmp(id, "TP3") == 0) return &t->performer;
+		if (strcmp(id, "TPB") == 0) return &t->publisher;
+		if (strcmp(id, "TT2") == 0) return &t->title;
+		if (strcmp(id, "TRK") == 0) return &t->track;
+		return NULL;
+	}
+
+	if (strcmp(id, "TALB") == 0) return &t->album;
+	if (strcmp(id, "TPE1") == 0) return &t->artist;
+	if (strcmp(id, "TPE2") == 0) return &t->album_artist;
+	if (strcmp(id, "TCOM") == 0) return &t->composer;
+	if (strcmp(id, "TCOP") == 0) return &t->copyright;
+	if ((strcmp(id, "TDRC") == 0) || (strcmp(id, "TYER") == 0)) return &t->date;
+	if (strcmp(id, "TPOS") == 0) return &t->disc;
+	if (strcmp(id, "TSSE") == 0) return &t->encoder;
+	if (strcmp(id, "TCON") == 0) return &t->genre;
+	if (strcmp(id, "TPE3") == 0) return &t->performer;
+	if (strcmp(id, "TPUB") == 0) return &t->publisher;
+	if (strcmp(id, "TIT2") == 0) return &t->title;
+	if (strcmp(id, "TRCK") == 0) return &t->track;
+	return NULL;
+}
+
+// Removes the 0x00 inserted after every 0xff by unsynchronisation, returns the new length
+static size_t id3_unsync(uint8_t *p, size_t len) {
+	size_t o = 0;
+	for (size_t i = 0; i < len; ++i) {
+		p[o++] = p[i];
+		if ((p[i] == 0xff) && (i + 1 < len) && (p[i+1] == 0x00)) ++i;
+	}
+	return o;
+}
+
+static void id3_frame(struct tags *t, const char *id, int version, const uint8_t *p, size_t len) {
+	bool is_comment = (strcmp(id, (version == 2) ? "COM" : "COMM") == 0);
+
+	if (is_comment) {
+		bool has_description;
+		char *comment = id3_comment(p, len, &has_description);
+		if ((comment != NULL) && has_description && (t->comment != NULL)) {
+			free(comment);
+			return;
+		}
+		if ((comment != NULL) && !has_description && (t->comment != NULL)) {
+			// a comment without description is preferred over an earlier one with it
+			free(t->comment);
+			t->comment = NULL;
+		}
+		tag_set(&t->comment, comment);
+		return;
+	}
+
+	char **field = id3_field(t, id, version);
+	if (field == NULL) return;
+	tag_set(field, id3_text(p, len));
+}
+
+// Parses an ID3v2 tag at off, returns its total size or 0 if there isn't one
+static int64_t id3v2_read(struct tag_reader *tr, int64_t off, struct tags *t) {
+	const uint8_t *h = tr_get(tr, off, 10);
+	if ((h == NULL) || (memcmp(h, "ID3", 3) != 0)) return 0;
+
+	int version = h[3];
+	uint8_t flags = h[5];
+	int64_t size = syncsafe32(h+6);
+	int64_t total = 10 + size + ((flags & 0x10) ? 10 : 0);
+
+	if ((version < 2) || (version > 4)) return total;
+	// compressed v2.2 tags
+	if ((version == 2) && (flags & 0x40)) return total;
+
+	int64_t pos = off + 10;
+	int64_t end = off + 10 + size;
+	uint8_t *whole = NULL;
+
+	if ((flags & 0x80) && (version < 4)) {
+		// tag level unsynchronisation, the frames can only be parsed after undoing it
+		const uint8_t *p = tr_get(tr, pos, size);
+		if (p == NULL) return total;
+		whole = malloc(size);
+		oomp(whole);
+		memcpy(whole, p, size);
+		size = id3_unsync(whole, size);
+		pos = 0;
+		end = size;
+	}
+
+	// extended header
+	if ((version >= 3) && (flags & 0x40)) {
+		const uint8_t *e = (whole != NULL) ? ((pos + 4 <= end) ? whole + pos : NULL) : tr_get(tr, pos, 4);
+		if (e == NULL) goto id3v2_read_done;
+		pos += (version == 3) ? (4 + be32(e)) : syncsafe32(e);
+	}
+
+	int header_len = (version == 2) ? 6 : 10;
+
+	while (pos + header_len <= end) {
+		const uint8_t *fh = (whole != NULL) ? whole + pos : tr_get(tr, pos, header_len);
+		if ((fh == NULL) || (fh[0] == 0)) break; // padding
+
+		char id[5];
+		int64_t fsize;
+		uint16_t fflags = 0;
+
+		if (version == 2) {
+			memcpy(id, fh, 3);
+			id[3] = '\0';
+			fsize = be24(fh+3);
+		} else {
+			memcpy(id, fh, 4);
+			id[4] = '\0';
+			fsize = (version == 4) ? syncsafe32(fh+4) : be32(fh+4);
+			fflags = (fh[8] << 8) | fh[9];
+		}
+
+		pos += header_len;
+		if (pos + fsize > end) break;
+
+		bool wanted = (id[0] == 'T') || (strcmp(id, (version == 2) ? "COM" : "COMM") == 0);
+		// compressed or encrypted frames
+		bool unsupported = (version == 3) ? (fflags & 0x00c0) : (version == 4) ? (fflags & 0x000c) : false;
+
+		if (wanted && !unsupported && (fsize > 0)) {
+			const uint8_t *p = (whole != NULL) ? whole + pos : tr_get(tr, pos, fsize);
+			if (p != NULL) {
+				if ((version == 4) && (fflags & 0x0003)) {
+					// data length indicator and/or frame level unsynchronisation
+					uint8_t *copy = malloc(fsize);
+					oomp(copy);
+					memcpy(copy, p, fsize);
+					size_t len = fsize;
+					uint8_t *data = copy;
+					if (fflags & 0x0001) {
+						data += 4;
+						len = (len >= 4) ? len - 4 : 0;
+					}
+					if (fflags & 0x0002) len = id3_unsync(data, len);
+					id3_frame(t, id, version, data, len);
+					free(copy);
+				} else {
+					id3_frame(t, id, version, p, fsize);
+				}
+			}
+		}
+
+		pos += fsize;
+	}
+
+id3v2_read_done:
+	free(whole);
+	t->genre = id3_genre(t->genre);
+	return total;
+}
+
+static void id3v1_read(struct tag_reader *tr, struct tags *t) {
+	const uint8_t *p = tr_get(tr, tr->size - 128, 128);
+	if ((p == NULL) || (memcmp(p, "TAG", 3) != 0)) return;
+
+	tag_set(&t->title, text_latin1(p+3, 30));
+	tag_set(&t->artist, text_latin1(p+33, 30));
+	tag_set(&t->album, text_latin1(p+63, 30));
+	tag_set(&t->date, text_latin1(p+93, 4));
+	if ((p[125] == 0) && (p[126] != 0)) {
+		// ID3v1.1, the last two bytes of the comment are a track number
+		tag_set(&t->comment, text_latin1(p+97, 28));
+		char *track;
+		asprintf(&track, "%d", p[126]);
+		oomp(track);
+		tag_set(&t->track, track);
+	} else {
+		tag_set(&t->comment, text_latin1(p+97, 30));
+	}
+	tag_set(&t->genre, id3_genre_name(p[127]));
+}
+
+static bool mp3_read(struct tag_reader *tr, struct tags *t) {
+	id3v2_read(tr, 0, t);
+	// like libavformat ID3v1 is only used when there is nothing else
+	if (tags_empty(t)) id3v1_read(tr, t);
+	return !tags_empty(t);
+}
+
+/* VORBIS COMMENTS */
+
+static char **vorbis_field(struct tags *t, const char *key, size_t len) {
+	static const struct { const char *key; size_t offset; } fields[] = {
+		{ "ALBUM", offsetof(struct tags, album) },
+		{ "ARTIST", offsetof(struct tags, artist) },
+		{ "ALBUMARTIST", offsetof(struct tags, album_artist) },
+		{ "ALBUM_ARTIST", offsetof(struct tags, album_artist) },
+		{ "COMMENT", offsetof(struct tags, comment) },
+		{ "DESCRIPTION", offsetof(struct tags, comment) },
+		{ "COMPOSER", offsetof(struct tags, composer) },
+		{ "COPYRIGHT", offsetof(struct tags, copyright) },
+		{ "DATE", offsetof(struct tags, date) },
+		{ "DISCNUMBER", offsetof(struct tags, disc) },
+		{ "DISC", offsetof(struct tags, disc) },
+		{ "ENCODER", offsetof(struct tags, encoder) },
+		{ "GENRE", offsetof(struct tags, genre) },
+		{ "PERFORMER", offsetof(struct tags, performer) },
+		{ "PUBLISHER", offsetof(struct tags, publisher) },
+		{ "TITLE", offsetof(struct tags, title) },
+		{ "TRACKNUMBER", offsetof(struct tags, track) },
+		{ "TRACK", offsetof(struct tags, track) },
+	};
+
+	for (int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i) {
+		if ((strlen(fields[i].key) == len) && (strncasecmp(fields[i].key, key, len) == 0)) {
+			return (char **)((char *)t + fields[i].offset);
+		}
+	}
+	return NULL;
+}
+
+static void vorbis_comment_parse(const uint8_t *p, size_t len, struct tags *t) {
+	if (len < 8) return;
+	size_t vendor = le32(p);
+	if (vendor > len - 8) return;
+	size_t pos = 4 + vendor;
+	uint32_t count = le32(p + pos);
+	pos += 4;
+
+	for (uint32_t i = 0; i < count; ++i) {
+		if (pos + 4 > len) return;
+		size_t clen = le32(p + pos);
+		pos += 4;
+		if (clen > len - pos) return;
+
+		const char *c = (const char *)(p + pos);
+		const char *eq = memchr(c, '=', clen);
+		if (eq != NULL) {
+			char **field = vorbis_field(t, c, eq - c);
+			if (field != NULL) tag_set(field, text_utf8((const uint8_t *)eq + 1, clen - (eq - c) - 1));
+		}
+
+		pos += clen;
+	}
+}
+
+static bool flac_read(struct tag_reader *tr, int64_t off, struct tags *t) {
+	const uint8_t *magic = tr_get(tr, off, 4);
+	if ((magic == NULL) || (memcmp(magic, "fLaC", 4) != 0)) return false;
+
+	int64_t pos = off + 4;
+	for (;;) {
+		const uint8_t *h = tr_get(tr, pos, 4);
+		if (h == NULL) break;
+		bool last = h[0] & 0x80;
+		int type = h[0] & 0x7f;
+		uint32_t len = be24(h+1);
+		pos += 4;
+
+		if (type == 4) {
+			const uint8_t *p = tr_get(tr, pos, len);
+			if (p != NULL) vorbis_comment_parse(p, len, t);
+			break;
+		}
+
+		// pictures and seek tables are never read
+		pos += len;
+		if (last) break;
+	}
+
+	return !tags_empty(t);
+}
+
+// Reassembles the second packet of the first logical stream, the one with the comments
+static uint8_t *ogg_second_packet(struct tag_reader *tr, size_t *packet_len) {
+	int64_t pos = 0;
+	uint32_t serial = 0;
+	bool first_page = true;
+	int packet = 0;
+	uint8_t *buf = NULL;
+	size_t len = 0;
+
+	for (int pages = 0; pages < 64; ++pages) {
+		const uint8_t *h = tr_get(tr, pos, 27);
+		if ((h == NULL) || (memcmp(h, "OggS", 4) != 0)) break;
+
+		uint32_t page_serial = le32(h+14);
+		int nsegs = h[26];
+
+		const uint8_t *segs = tr_get(tr, pos + 27, nsegs);
+		if (segs == NULL) break;
+		uint8_t lacing[255];
+		memcpy(lacing, segs, nsegs);
+
+		int64_t data = pos + 27 + nsegs;
+		int64_t data_len = 0;
+		for (int i = 0; i < nsegs; ++i) data_len += lacing[i];
+
+		if (first_page) {
+			serial = page_serial;
+			first_page = false;
+		}
+
+		if (page_serial == serial) {
+			int64_t seg_off = data;
+			for (int i = 0; i < nsegs; ++i) {
+				if (packet == 1) {
+					if (len + lacing[i] > TAG_MAX_READ) goto ogg_second_packet_failure;
+					const uint8_t *p = tr_get(tr, seg_off, lacing[i]);
+					if (p == NULL) goto ogg_second_packet_failure;
+					buf = realloc(buf, len + lacing[i] + 1);
+					oomp(buf);
+					memcpy(buf + len, p, lacing[i]);
+					len += lacing[i];
+				}
+				seg_off += lacing[i];
+				if (lacing[i] < 255) {
+					if (packet == 1) {
+						*packet_len = len;
+						return buf;
+					}
+					++packet;
+				}
+			}
+		}
+
+		pos = data + data_len;
+	}
+
+ogg_second_packet_failure:
+	free(buf);
+	return NULL;
+}
+
+static bool ogg_read(struct tag_reader *tr, struct tags *t) {
+	const uint8_t *h = tr_get(tr, 0, 27);
+	if ((h == NULL) || (memcmp(h, "OggS", 4) != 0)) return false;
+
+	// the start of the first packet identifies the codec
+	uint8_t first[8];
+	size_t first_len = 0;
+	const uint8_t *p = tr_get(tr, 27 + h[26], sizeof(first));
+	if (p != NULL) {
+		memcpy(first, p, sizeof(first));
+		first_len = sizeof(first);
+	}
+
+	size_t len = 0;
+	uint8_t *packet = ogg_second_packet(tr, &len);
+	if (packet == NULL) return false;
+	p = packet;
+
+	if ((first_len >= 7) && (memcmp(first, "\x01vorbis", 7) == 0)) {
+		if ((len >= 7) && (memcmp(p, "\x03vorbis", 7) == 0)) vorbis_comment_parse(p+7, len-7, t);
+	} else if ((first_len >= 8) && (memcmp(first, "OpusHead", 8) == 0)) {
+		if ((len >= 8) && (memcmp(p, "OpusTags", 8) == 0)) vorbis_comment_parse(p+8, len-8, t);
+	} else if ((first_len >= 5) && (memcmp(first, "\x7f" "FLAC", 5) == 0)) {
+		// the first metadata block after STREAMINFO must be the comments
+		if ((len >= 4) && ((p[0] & 0x7f) == 4)) vorbis_comment_parse(p+4, len-4, t);
+	} else if ((first_len >= 8) && (memcmp(first, "Speex   ", 8) == 0)) {
+		vorbis_comment_parse(p, len, t);
+	}
+
+	free(packet);
+	return !tags_empty(t);
+}
+
+/* MP4 */
+
+struct atom {
+	int64_t off; // of the contents
+	int64_t len;
+	char type[5];
+};
+
+// Reads the header of the atom at pos, end is the end of its parent
+static bool atom_at(struct tag_reader *tr, int64_t pos, int64_t end, struct atom *a) {
+	if (pos + 8 > end) return false;
+	const uint8_t *h = tr_get(tr, pos, 8);
+	if (h == NULL) return false;
+
+	int64_t size = be32(h);
+	memcpy(a->type, h+4, 4);
+	a->type[4] = '\0';
+	int header = 8;
+
+	if (size == 1) {
+		h = tr_get(tr, pos + 8, 8);
+		if (h == NULL) return false;
+		size = ((int64_t)be32(h) << 32) | be32(h+4);
+		header = 16;
+	} else if (size == 0) {
+		size = end - pos;
+	}
+
+	if ((size < header) || (pos + size > end)) return false;
+
+	a->off = pos + header;
+	a->len = size - header;
+	return true;
+}
+
+static bool atom_find(struct tag_reader *tr, int64_t pos, int64_t end, const char *type, struct atom *a) {
+	while (atom_at(tr, pos, end, a)) {
+		if (memcmp(a->type, type, 4) == 0) return true;
+		pos = a->off + a->len;
+	}
+	return false;
+}
+
+// "N" or "N/M" from the binary trkn and disk items
+static char *mp4_number(const uint8_t *p, size_t len) {
+	if (len < 6) return NULL;
+	int n = (p[2] << 8) | p[3];
+	int total = (p[4] << 8) | p[5];
+	if (n == 0) return NULL;
+	char *r;
+	if (total > 0) {
+		asprintf(&r, "%d/%d", n, total);
+	} else {
+		asprintf(&r, "%d", n);
+	}
+	oomp(r);
+	return r;
+}
+
+static void mp4_item(struct tag_reader *tr, struct atom *item, struct tags *t) {
+	static const struct { const char *type; size_t offset; } fields[] = {
+		{ "\251alb", offsetof(struct tags, album) },
+		{ "\251ART", offsetof(struct tags, artist) },
+		{ "aART", offsetof(struct tags, album_artist) },
+		{ "\251cmt", offsetof(struct tags, comment) },
+		{ "\251wrt", offsetof(struct tags, composer) },
+		{ "cprt", offsetof(struct tags, copyright) },
+		{ "\251day", offsetof(struct tags, date) },
+		{ "disk", offsetof(struct tags, disc) },
+		{ "\251too", offsetof(struct tags, encoder) },
+		{ "\251gen", offsetof(struct tags, genre) },
+		{ "gnre", offsetof(struct tags, genre) },
+		{ "\251nam", offsetof(struct tags, title) },
+		{ "trkn", offsetof(struct tags, track) },
+	};
+
+	char **field = NULL;
+	for (int i = 0; i < sizeof(fields)/sizeof(fields[0]); ++i) {
+		if (memcmp(item->type, fields[i].type, 4) == 0) {
+			field = (char **)((char *)t + fields[i].offset);
+			break;
+		}
+	}
+	if (field == NULL) return;
+
+	struct atom data;
+	if (!atom_find(tr, item->off, item->off + item->len, "data", &data)) return;
+	if ((data.len < 8) || (data.len > TAG_READ_CHUNK)) return;
+
+	const uint8_t *p = tr_get(tr, data.off, data.len);
+	if (p == NULL) return;
+
+	uint32_t kind = be32(p) & 0xffffff;
+	p += 8;
+	size_t len = data.len - 8;
+
+	if ((memcmp(item->type, "trkn", 4) == 0) || (memcmp(item->type, "disk", 4) == 0)) {
+		tag_set(field, mp4_number(p, len));
+	} else if (memcmp(item->type, "gnre", 4) == 0) {
+		if (len >= 2) tag_set(field, id3_genre_name(((p[0] << 8) | p[1]) - 1));
+	} else if (kind == 1) {
+		tag_set(field, text_utf8(p, len));
+	}
+}
+
+static bool mp4_read(struct tag_reader *tr, struct tags *t) {
+	struct atom a;
+	if (!atom_at(tr, 0, tr->size, &a) || (memcmp(a.type, "ftyp", 4) != 0)) return false;
+
+	// moov is often after mdat, which atom_find skips over without reading it
+	struct atom moov, udta, meta, ilst;
+	if (!atom_find(tr, 0, tr->size, "moov", &moov)) return false;
+
+	int64_t meta_parent = moov.off, meta_end = moov.off + moov.len;
+	if (atom_find(tr, moov.off, moov.off + moov.len, "udta", &udta)) {
+		meta_parent = udta.off;
+		meta_end = udta.off + udta.len;
+	}
+	if (!atom_find(tr, meta_parent, meta_end, "meta", &meta)) return false;
+
+	// meta is a full atom (4 bytes of version and flags) except in some QuickTime files
+	int64_t children = meta.off + 4;
+	struct atom probe;
+	if (atom_at(tr, meta.off, meta.off + meta.len, &probe) && (memcmp(probe.type, "hdlr", 4) == 0)) {
+		children = meta.off;
+	}
+
+	if (!atom_find(tr, children, meta.off + meta.len, "ilst", &ilst)) return false;
+
+	struct atom item;
+	for (int64_t pos = ilst.off; atom_at(tr, pos, ilst.off + ilst.len, &item); pos = item.off + item.len) {
+		// covr items are skipped without being read
+		if (memcmp(item.type, "covr", 4) == 0) continue;
+		mp4_item(tr, &item, t);
+	}
+
+	return !tags_empty(t);
+}
+
+/* ENTRY POINTS */
+
+static const char *extension(const char *filename) {
+	const char *dot = strrchr(filename, '.');
+	const char *slash = strrchr(filename, '/');
+	if ((dot == NULL) || ((slash != NULL) && (dot < slash))) return "";
+	return dot + 1;
+}
+
+bool tags_read(const char *filename, struct tags *t, size_t *bytes_read) {
+	memset(t, 0, sizeof(struct tags));
+
+	const char *ext = extension(filename);
+	enum { MP3, OGG, FLAC, MP4, OTHER } kind = OTHER;
+
+	if (strcasecmp(ext, "mp3") == 0) {
+		kind = MP3;
+	} else if ((strcasecmp(ext, "ogg") == 0) || (strcasecmp(ext, "oga") == 0) || (strcasecmp(ext, "opus") == 0)) {
+		kind = OGG;
+	} else if (strcasecmp(ext, "flac") == 0) {
+		kind = FLAC;
+	} else if ((strcasecmp(ext, "m4a") == 0) || (strcasecmp(ext, "mp4") == 0) || (strcasecmp(ext, "m4b") == 0) || (strcasecmp(ext, "m4p") == 0) || (strcasecmp(ext, "alac") == 0)) {
+		kind = MP4;
+	}
+
+	if (kind == OTHER) return false;
+
+	struct tag_reader tr;
+	memset(&tr, 0, sizeof(tr));
+	tr.fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (tr.fd < 0) return false;
+
+	struct stat st;
+	if (fstat(tr.fd, &st) < 0) {
+		close(tr.fd);
+		return false;
+	}
+	tr.size = st.st_size;
+	tr.buf_off = -1;
+
+	bool ok = false;
+
+	switch (kind) {
+	case MP3:
+		ok = mp3_read(&tr, t);
+		break;
+	case OGG:
+		ok = ogg_read(&tr, t);
+		break;
+	case FLAC: {
+		// flac files can start with an ID3v2 tag
+		struct tags id3;
+		memset(&id3, 0, sizeof(id3));
+		int64_t off = id3v2_read(&tr, 0, &id3);
+		tags_free(&id3);
+		ok = flac_read(&tr, off, t);
+		break;
+	}
+	case MP4:
+		ok = mp4_read(&tr, t);
+		break;
+	default:
+		break;
+	}
+
+	close(tr.fd);
+	free(tr.buf);
+
+	if (bytes_read != NULL) *bytes_read += tr.bytes_read;
+
+	if (!ok) {
+		tags_free(t);
+		return false;
+	}
+
+	return true;
+}
+
+static void tag_trim(char **field) {
+	char *s = *field;
+	if (s == NULL) return;
+
+	char *start = s;
+	while ((*start != '\0') && isspace((unsigned char)*start)) ++start;
+	size_t n = strlen(start);
+	while ((n > 0) && isspace((unsigned char)start[n-1])) --n;
+
+	if (n == 0) {
+		free(s);
+		*field = NULL;
+		return;
+	}
+
+	memmove(s, start, n);
+	s[n] = '\0';
+}
+
+void tags_trim(struct tags *t) {
+	tag_trim(&t->album); tag_trim(&t->artist); tag_trim(&t->album_artist);
+	tag_trim(&t->comment); tag_trim(&t->composer); tag_trim(&t->copyright);
+	tag_trim(&t->date); tag_trim(&t->disc); tag_trim(&t->encoder);
+	tag_trim(&t->genre); tag_trim(&t->performer); tag_trim(&t->publisher);
+	tag_trim(&t->title); tag_trim(&t->track);
+}
+
+void tags_free(struct tags *t) {
+	free(t->album); free(t->artist); free(t->album_artist);
+	free(t->comment); free(t->composer); free(t->copyright);
+	free(t->date); free(t->disc); free(t->encoder);
+	free(t->genre); free(t->performer); free(t->publisher);
+	free(t->title); free(t->track);
+	memset(t, 0, sizeof(struct tags));
+}
@@ -0,0 +1,25 @@
+#ifndef __TAGS__
+#define __TAGS__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// the tags index_file_ex stores, all fields are NULL or malloc'd UTF-8 strings
+struct tags {
+	char *album, *artist, *album_artist;
+	char *comment, *composer, *copyright;
+	char *date, *disc, *encoder;
+	char *genre, *performer, *publisher;
+	char *title, *track;
+};
+
+// Reads the tags of filename without libavformat, supports ID3v2/ID3v1 (mp3),
+// vorbis comments (ogg, opus, flac) and MP4 ilst atoms (m4a). Returns false if
+// the format isn't recognized or no tag was found, in which case t is left
+// empty. If bytes_read isn't NULL the number of bytes read is added to it.
+bool tags_read(const char *filename, struct tags *t, size_t *bytes_read);
+// Strips leading and trailing whitespace, empty fields become NULL
+void tags_trim(struct tags *t);
+void tags_free(struct tags *t);
+
+#endif
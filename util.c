@@ -1,4 +1,6 @@
 #include "util.h"
+#include "stmt.h"
+#include "fuzzy.h"
 
 #include <stdlib.h>
 
@@ -15,24 +17,65 @@ bool sqlite3_has_table(sqlite3 *db, const char *name) {
 	sqlite3_stmt *statement = NULL;
 	int r;
 
-	r = sqlite3_prepare_v2(db, "select name from sqlite_master where name = ?", -1, &statement, NULL);
-	if (r != SQLITE_OK) goto sqlite3_has_table_failure;
+	statement = stmt_get(db, "select name from sqlite_master where name = ?");
+	if (statement == NULL) goto sqlite3_has_table_failure;
 
 	r = sqlite3_bind_text(statement, 1, name, -1, SQLITE_TRANSIENT);
 	if (r != SQLITE_OK) goto sqlite3_has_table_failure;
 
 	r = sqlite3_step(statement);
 	bool ret = (r == SQLITE_ROW);
-	sqlite3_finalize(statement);
+	sqlite3_reset(statement);
 	return ret;
 
 sqlite3_has_table_failure:
 
 	fprintf(stderr, "Sqlite3 error on has_table: %s\n", sqlite3_errmsg(db));
-	if (statement == NULL) sqlite3_finalize(statement);
 	exit(EXIT_FAILURE);
 }
 
+bool sqlite3_has_column(sqlite3 *db, const char *table, const char *column) {
+	sqlite3_stmt *statement = NULL;
+	int r;
+
+	statement = stmt_get(db, "select name from pragma_table_info(?) where name = ?");
+	if (statement == NULL) goto sqlite3_has_column_failure;
+
+	r = sqlite3_bind_text(statement, 1, table, -1, SQLITE_TRANSIENT);
+	if (r != SQLITE_OK) goto sqlite3_has_column_failure;
+
+	r = sqlite3_bind_text(statement, 2, column, -1, SQLITE_TRANSIENT);
+	if (r != SQLITE_OK) goto sqlite3_has_column_failure;
+
+	r = sqlite3_step(statement);
+	bool ret = (r == SQLITE_ROW);
+	sqlite3_reset(statement);
+	return ret;
+
+sqlite3_has_column_failure:
+
+	fprintf(stderr, "Sqlite3 error on has_column: %s\n", sqlite3_errmsg(db));
+	exit(EXIT_FAILURE);
+}
+
+static int sqlite3_user_version(sqlite3 *db) {
+	sqlite3_stmt *statement = NULL;
+	int version = 0;
+
+	statement = stmt_get(db, "pragma user_version");
+	if (statement == NULL) {
+		fprintf(stderr, "Sqlite3 error reading schema version: %s\n", sqlite3_errmsg(db));
+		exit(EXIT_FAILURE);
+	}
+
+	if (sqlite3_step(statement) == SQLITE_ROW) {
+		version = sqlite3_column_int(statement, 0);
+	}
+
+	sqlite3_reset(statement);
+	return version;
+}
+
 bool strstart(const char *haystack, const char *needle) {
     return strncmp(needle, haystack, strlen(needle)) == 0;
 }
@@ -44,17 +87,31 @@ const char *tag_get(AVFormatContext *fmt_ctx, const char *key) {
 	return tag->value;
 }
 
+char *config_path(const char *name) {
+	char *path;
+	if (getenv("XDG_CONFIG_HOME") != NULL) {
+		asprintf(&path, "%s/minstrel/%s", getenv("XDG_CONFIG_HOME"), name);
+	} else {
+		asprintf(&path, "%s/.config/minstrel/%s", getenv("HOME"), name);
+	}
+	oomp(path);
+	return path;
+}
+
+static void sql_track_key(sqlite3_context *ctx, int argc, sqlite3_value **argv) {
+	const char *filename = (const char *)sqlite3_value_text(argv[0]);
+	if (filename == NULL) {
+		sqlite3_result_null(ctx);
+		return;
+	}
+	sqlite3_result_int64(ctx, track_key(filename));
+}
+
 sqlite3 *open_or_create_db(char *name) {
 	sqlite3 *db;
 	int r;
 
-	char *index_file_name;
-	if (getenv("XDG_CONFIG_HOME") != NULL) {
-		asprintf(&index_file_name, "%s/minstrel/%s", getenv("XDG_CONFIG_HOME"), name);
-	} else {
-		asprintf(&index_file_name, "%s/.config/minstrel/%s", getenv("HOME"), name);
-	}
-	oomp(index_file_name);
+	char *index_file_name = config_path(name);
 
 	r = sqlite3_open_v2(index_file_name, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL);
 
@@ -67,9 +124,19 @@ sqlite3 *open_or_create_db(char *name) {
 
 	free(index_file_name);
 
+	sqlite3_busy_timeout(db, 5000);
+
+	// migrations and inserts compute keys in sql
+	sqlite3_create_function(db, "track_key", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, sql_track_key, NULL, NULL);
+
 	return db;
 }
 
+void close_db(sqlite3 *db) {
+	stmt_close(db);
+	sqlite3_close(db);
+}
+
 sqlite3 *open_or_create_index_db() {
 	char *errmsg;
 	sqlite3 *index_db;
@@ -82,27 +149,244 @@ sqlite3 *open_or_create_index_db() {
 	sqlite3_exec(index_db, "pragma synchronous = off;", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
 
+	// the library watcher writes while the player reads
+	sqlite3_exec(index_db, "pragma journal_mode = wal;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+	// insert or replace runs the delete trigger that keeps fidx in sync
+	sqlite3_exec(index_db, "pragma recursive_triggers = on;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
 	sqlite3_exec(index_db, "CREATE TABLE IF NOT EXISTS config(key text, value text);", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
 
-	sqlite3_exec(index_db, "CREATE TABLE IF NOT EXISTS tunes(id integer primary key autoincrement, album text, artist text, album_artist text, comment text, composer text, copyright text, date text, disc text, encoder text, genre text, performer text, publisher text, title text, track text, filename text);", NULL, NULL, &errmsg);
+	sqlite3_exec(index_db, "CREATE TABLE IF NOT EXISTS tunes(id integer primary key autoincrement, album text, artist text, album_artist text, comment text, composer text, copyright text, date text, disc text, encoder text, genre text, performer text, publisher text, title text, track text, filename text, mtime integer, size integer, inode integer, track_no integer, disc_no integer, sort_artist text, sort_album text, track_key integer);", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
 
 	sqlite3_exec(index_db, "CREATE TABLE IF NOT EXISTS search_save(counter integer primary key autoincrement, id integer);", NULL, NULL, &errmsg);
 	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
 
-	if (!sqlite3_has_table(index_db, "ridx")) {
-		sqlite3_exec(index_db, "CREATE VIRTUAL TABLE ridx USING fts3(id integer, any text, foreign key (id) references tunes(id) on delete cascade deferrable initially deferred);", NULL, NULL, &errmsg);
+	int version = sqlite3_user_version(index_db);
+
+	// the versions before 4 kept the full text index in ridx
+	if ((version < 4) && !sqlite3_has_table(index_db, "ridx")) {
+		sqlite3_exec(index_db, "CREATE VIRTUAL TABLE ridx USING fts3(id integer, any text);", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+	}
+
+	if (version < 1) {
+		// version 1: stat data for incremental updates, ridx rows keyed by their tune's id
+		sqlite3_exec(index_db, "BEGIN;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		if (!sqlite3_has_column(index_db, "tunes", "mtime")) {
+			sqlite3_exec(index_db, "ALTER TABLE tunes ADD COLUMN mtime integer; ALTER TABLE tunes ADD COLUMN size integer; ALTER TABLE tunes ADD COLUMN inode integer;", NULL, NULL, &errmsg);
+			if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+		}
+
+		sqlite3_exec(index_db, "CREATE VIRTUAL TABLE ridx_v1 USING fts3(id integer, any text); INSERT INTO ridx_v1(docid, id, any) SELECT id, id, any FROM ridx; DROP TABLE ridx; ALTER TABLE ridx_v1 RENAME TO ridx;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db, "PRAGMA user_version = 1; COMMIT;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+	}
+
+	if (version < 2) {
+		// version 2: one row per file, tags stored trimmed, numeric track and disc and sort keys
+		sqlite3_exec(index_db, "BEGIN;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		// nothing stopped the same file from being indexed twice, the newest row is kept
+		sqlite3_exec(index_db, "CREATE TEMP TABLE duplicates AS SELECT id FROM tunes WHERE id NOT IN (SELECT max(id) FROM tunes GROUP BY filename); DELETE FROM tunes WHERE id IN (SELECT id FROM duplicates); DELETE FROM ridx WHERE docid IN (SELECT id FROM duplicates); DROP TABLE duplicates;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		if (!sqlite3_has_column(index_db, "tunes", "track_no")) {
+			sqlite3_exec(index_db, "ALTER TABLE tunes ADD COLUMN track_no integer; ALTER TABLE tunes ADD COLUMN disc_no integer; ALTER TABLE tunes ADD COLUMN sort_artist text; ALTER TABLE tunes ADD COLUMN sort_album text;", NULL, NULL, &errmsg);
+			if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+		}
+
+		sqlite3_exec(index_db, "UPDATE tunes SET album = nullif(trim(album), ''), artist = nullif(trim(artist), ''), album_artist = nullif(trim(album_artist), ''), comment = nullif(trim(comment), ''), composer = nullif(trim(composer), ''), copyright = nullif(trim(copyright), ''), date = nullif(trim(date), ''), disc = nullif(trim(disc), ''), encoder = nullif(trim(encoder), ''), genre = nullif(trim(genre), ''), performer = nullif(trim(performer), ''), publisher = nullif(trim(publisher), ''), title = nullif(trim(title), ''), track = nullif(trim(track), '');", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		// keep in sync with the insert statement in index.c
+		sqlite3_exec(index_db, "UPDATE tunes SET track_no = cast(track as integer), disc_no = cast(disc as integer), sort_artist = lower(artist), sort_album = lower(album);", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db, "PRAGMA user_version = 2; COMMIT;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+	}
+
+	if (version < 3) {
+		// version 3: the key ratings are stored under
+		sqlite3_exec(index_db, "BEGIN;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		if (!sqlite3_has_column(index_db, "tunes", "track_key")) {
+			sqlite3_exec(index_db, "ALTER TABLE tunes ADD COLUMN track_key integer;", NULL, NULL, &errmsg);
+			if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+		}
+
+		sqlite3_exec(index_db, "UPDATE tunes SET track_key = track_key(filename);", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db, "PRAGMA user_version = 3; COMMIT;", NULL, NULL, &errmsg);
 		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
 	}
 
+	if (version < 4) {
+		// version 4: fidx, an fts5 index of the tags that reads them from
+		// tunes, kept in sync by triggers
+		sqlite3_exec(index_db, "BEGIN; DROP TABLE IF EXISTS ridx;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db, "CREATE VIRTUAL TABLE fidx USING fts5(" FIDX_COLUMNS ", content='tunes', content_rowid='id', prefix='2 3', tokenize='unicode61 remove_diacritics 2');", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db,
+			"CREATE TRIGGER tunes_fidx_insert AFTER INSERT ON tunes BEGIN "
+				"INSERT INTO fidx(rowid, " FIDX_COLUMNS ") VALUES (new.id, new.album, new.artist, new.album_artist, new.comment, new.composer, new.copyright, new.date, new.disc, new.encoder, new.genre, new.performer, new.publisher, new.title, new.track); "
+			"END; "
+			"CREATE TRIGGER tunes_fidx_delete AFTER DELETE ON tunes BEGIN "
+				"INSERT INTO fidx(fidx, rowid, " FIDX_COLUMNS ") VALUES ('delete', old.id, old.album, old.artist, old.album_artist, old.comment, old.composer, old.copyright, old.date, old.disc, old.encoder, old.genre, old.performer, old.publisher, old.title, old.track); "
+			"END; "
+			"CREATE TRIGGER tunes_fidx_update AFTER UPDATE OF " FIDX_COLUMNS " ON tunes BEGIN "
+				"INSERT INTO fidx(fidx, rowid, " FIDX_COLUMNS ") VALUES ('delete', old.id, old.album, old.artist, old.album_artist, old.comment, old.composer, old.copyright, old.date, old.disc, old.encoder, old.genre, old.performer, old.publisher, old.title, old.track); "
+				"INSERT INTO fidx(rowid, " FIDX_COLUMNS ") VALUES (new.id, new.album, new.artist, new.album_artist, new.comment, new.composer, new.copyright, new.date, new.disc, new.encoder, new.genre, new.performer, new.publisher, new.title, new.track); "
+			"END;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		sqlite3_exec(index_db, "INSERT INTO fidx(fidx) VALUES ('rebuild'); PRAGMA user_version = 4; COMMIT;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+	}
+
+	if (version < 5) {
+		// version 5: the terms of fidx indexed by their trigrams for fuzzy
+		// search, refreshed after the index changes
+		sqlite3_exec(index_db,
+			"BEGIN; "
+			"CREATE VIRTUAL TABLE fidx_vocab USING fts5vocab(fidx, 'row'); "
+			"CREATE TABLE fuzzy_term(term text primary key, len integer) without rowid; "
+			"CREATE TABLE fuzzy_trigram(gram text, len integer, term text, primary key(gram, len, term)) without rowid;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+		if (!fuzzy_refresh(index_db)) {
+			errmsg = sqlite3_mprintf("%s", sqlite3_errmsg(index_db));
+			goto open_or_create_index_db_sqlite3_failure;
+		}
+
+		sqlite3_exec(index_db, "PRAGMA user_version = 5; COMMIT;", NULL, NULL, &errmsg);
+		if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+	}
+
+	// lookups by file when indexing, result sets in the order search and where print them
+	sqlite3_exec(index_db, "CREATE UNIQUE INDEX IF NOT EXISTS tunes_filename ON tunes(filename);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+	sqlite3_exec(index_db, "CREATE INDEX IF NOT EXISTS tunes_sort ON tunes(sort_artist, sort_album, disc_no, track_no);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
+	// ratings joined to their tunes
+	sqlite3_exec(index_db, "CREATE INDEX IF NOT EXISTS tunes_track_key ON tunes(track_key);", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto open_or_create_index_db_sqlite3_failure;
+
 	return index_db;
 
 open_or_create_index_db_sqlite3_failure:
 
 	fprintf(stderr, "Sqlite error building index: %s\n", errmsg);
 	sqlite3_free(errmsg);
-	sqlite3_close(index_db);
+	close_db(index_db);
+	exit(EXIT_FAILURE);
+}
+
+const struct setting SETTINGS[] = {
+	{ "shuffle", "bag", "how random tunes are picked: bag (each tune once per round) or weighted" },
+	{ "weight.base", "1", "weighted shuffle: weight of a tune never listened, added or skipped" },
+	{ "weight.listened", "0.1", "weighted shuffle: added to the weight for each time the tune was listened to the end" },
+	{ "weight.added", "0.5", "weighted shuffle: added to the weight for each time the tune was added to the queue" },
+	{ "weight.skipped", "1", "weighted shuffle: the weight is divided by 1 + this times the number of skips" },
+	{ "weight.cooldown", "86400", "weighted shuffle: seconds after a tune is played during which its weight is reduced" },
+	{ "weight.cooldown_factor", "0.01", "weighted shuffle: the weight is multiplied by this during the cooldown" },
+	{ "queue.history", "1000", "played tunes kept in the queue, older ones are forgotten" },
+	{ "history.events", "365", "days each listen, add and skip is kept in the history, 0 keeps them forever" },
+	{ "history.daily", "400", "days the daily totals of the history are kept, 0 keeps them forever" },
+	{ "history.weekly", "0", "weeks the weekly totals of the history are kept, 0 keeps them forever" },
+	{ NULL, NULL, NULL }
+};
+
+const struct setting *setting_find(const char *key) {
+	for (const struct setting *s = SETTINGS; s->key != NULL; ++s) {
+		if (strcmp(s->key, key) == 0) return s;
+	}
+	return NULL;
+}
+
+char *setting_get(sqlite3 *index_db, const char *key) {
+	sqlite3_stmt *select = NULL;
+	char *value = NULL;
+
+	select = stmt_get(index_db, "select value from config where key = ?");
+	if (select == NULL) goto setting_get_failure;
+	if (sqlite3_bind_text(select, 1, key, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto setting_get_failure;
+
+	int r = sqlite3_step(select);
+	if (r == SQLITE_ROW) {
+		value = strdup((const char *)sqlite3_column_text(select, 0));
+	} else if (r == SQLITE_DONE) {
+		const struct setting *s = setting_find(key);
+		value = strdup((s != NULL) ? s->default_value : "");
+	} else {
+		goto setting_get_failure;
+	}
+	oomp(value);
+
+	sqlite3_reset(select);
+	return value;
+
+setting_get_failure:
+
+	fprintf(stderr, "Sqlite3 error reading setting %s: %s\n", key, sqlite3_errmsg(index_db));
+	exit(EXIT_FAILURE);
+}
+
+double setting_get_double(sqlite3 *index_db, const char *key) {
+	char *value = setting_get(index_db, key);
+	double r = strtod(value, NULL);
+	free(value);
+	return r;
+}
+
+void setting_set(sqlite3 *index_db, const char *key, const char *value) {
+	sqlite3_stmt *delete = NULL, *insert = NULL;
+	char *errmsg = NULL;
+
+	sqlite3_exec(index_db, "BEGIN;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto setting_set_failure;
+
+	delete = stmt_get(index_db, "delete from config where key = ?");
+	if (delete == NULL) goto setting_set_failure;
+	if (sqlite3_bind_text(delete, 1, key, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto setting_set_failure;
+	if (sqlite3_step(delete) != SQLITE_DONE) goto setting_set_failure;
+
+	if (value != NULL) {
+		insert = stmt_get(index_db, "insert into config(key, value) values (?, ?)");
+		if (insert == NULL) goto setting_set_failure;
+		if (sqlite3_bind_text(insert, 1, key, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto setting_set_failure;
+		if (sqlite3_bind_text(insert, 2, value, -1, SQLITE_TRANSIENT) != SQLITE_OK) goto setting_set_failure;
+		if (sqlite3_step(insert) != SQLITE_DONE) goto setting_set_failure;
+		sqlite3_reset(insert);
+	}
+
+	sqlite3_reset(delete);
+
+	sqlite3_exec(index_db, "COMMIT;", NULL, NULL, &errmsg);
+	if (errmsg != NULL) goto setting_set_failure;
+
+	return;
+
+setting_set_failure:
+
+	fprintf(stderr, "Sqlite3 error saving setting %s: %s\n", key, (errmsg != NULL) ? errmsg : sqlite3_errmsg(index_db));
 	exit(EXIT_FAILURE);
 }
 
@@ -113,6 +397,15 @@ void term_init(void) {
 	}
 }
 
+int64_t track_key(const char *filename) {
+	uint64_t h = 14695981039346656037ULL;
+	for (const unsigned char *c = (const unsigned char *)filename; *c != '\0'; ++c) {
+		h ^= *c;
+		h *= 1099511628211ULL;
+	}
+	return (int64_t)h;
+}
+
 int64_t checksum(const char *a) {
 	int64_t r = 0;
 
@@ -7,11 +7,37 @@
 
 void oomp(void *ptr);
 bool sqlite3_has_table(sqlite3 *db, const char *name);
+bool sqlite3_has_column(sqlite3 *db, const char *table, const char *column);
 bool strstart(const char *haystack, const char *needle);
 const char *tag_get(AVFormatContext *fmt_ctx, const char *key);
+// path of name in minstrel's configuration directory, malloc'd
+char *config_path(const char *name);
 sqlite3 *open_or_create_db(char *name);
+// The columns of fidx, the full text index of tunes: every tag, in the order
+// of tunes
+#define FIDX_COLUMNS "album, artist, album_artist, comment, composer, copyright, date, disc, encoder, genre, performer, publisher, title, track"
 sqlite3 *open_or_create_index_db(void);
+// finalizes the statements borrowed from db (see stmt.h) and closes it
+void close_db(sqlite3 *db);
+// settings stored in the config table of the index, with their defaults
+struct setting {
+	const char *key;
+	const char *default_value;
+	const char *description;
+};
+extern const struct setting SETTINGS[];
+
+const struct setting *setting_find(const char *key);
+// malloc'd value of key, its default if it was never set
+char *setting_get(sqlite3 *index_db, const char *key);
+double setting_get_double(sqlite3 *index_db, const char *key);
+// a NULL value restores the default
+void setting_set(sqlite3 *index_db, const char *key, const char *value);
+
 void term_init(void);
+// Key of the ratings of a file, FNV-1a of its name: unlike its id it survives
+// indexing the library again. The track_key sql function computes it too.
+int64_t track_key(const char *filename);
 int64_t checksum(const char *a);
 void putctlcod(const char *ctlcod, FILE *out);
 
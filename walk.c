@@ -0,0 +1,244 @@
+#include "walk.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <glib.h>
+
+#include "util.h"
+
+#define WALK_BUFFER (32 * 1024)
+#define WALK_MAX_DEPTH 256
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+// a directory being read, there is one for each directory in the current path
+struct walk_level {
+	int fd;
+	char *buf;
+	long pos, len;
+	size_t path_len;
+};
+
+struct walk_state {
+	struct walk *w;
+	struct walk_level *levels;
+	int depth, levels_size;
+	// path of the current entry, every level appends its name to the path of its parent
+	char *path;
+	size_t path_size;
+	GHashTable *visited;
+};
+
+struct dir_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+static guint dir_id_hash(gconstpointer p) {
+	const struct dir_id *id = p;
+	return (guint)(id->ino ^ (id->ino >> 32) ^ id->dev);
+}
+
+static gboolean dir_id_equal(gconstpointer a, gconstpointer b) {
+	const struct dir_id *ida = a, *idb = b;
+	return (ida->dev == idb->dev) && (ida->ino == idb->ino);
+}
+
+// Writes "/name" at position len of the path, returns the new length
+static size_t walk_path_append(struct walk_state *s, size_t len, const char *name) {
+	size_t namelen = strlen(name);
+
+	// only happens when the root is /
+	if (s->path[len-1] == '/') --len;
+
+	if (len + namelen + 2 > s->path_size) {
+		while (len + namelen + 2 > s->path_size) s->path_size *= 2;
+		s->path = realloc(s->path, s->path_size);
+		oomp(s->path);
+	}
+
+	s->path[len] = '/';
+	memcpy(s->path + len + 1, name, namelen + 1);
+
+	return len + namelen + 1;
+}
+
+static void walk_failed(struct walk_state *s, const char *path) {
+	if (s->w->failed != NULL) {
+		s->w->failed(s->w->data, path);
+	}
+}
+
+// Pushes the directory open in fd, whose path is the first path_len characters of s->path
+static void walk_enter(struct walk_state *s, int fd, size_t path_len) {
+	s->path[path_len] = '\0';
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		walk_failed(s, s->path);
+		close(fd);
+		return;
+	}
+
+	// a symlink loop or a directory linked from two places
+	struct dir_id id = { st.st_dev, st.st_ino };
+	if (g_hash_table_contains(s->visited, &id)) {
+		close(fd);
+		return;
+	}
+
+	struct dir_id *key = malloc(sizeof(struct dir_id));
+	oomp(key);
+	*key = id;
+	g_hash_table_add(s->visited, key);
+
+	if (s->depth >= WALK_MAX_DEPTH) {
+		fprintf(stderr, "Not descending into %s, too deep\n", s->path);
+		walk_failed(s, s->path);
+		close(fd);
+		return;
+	}
+
+	if (s->depth >= s->levels_size) {
+		s->levels_size *= 2;
+		s->levels = realloc(s->levels, sizeof(struct walk_level) * s->levels_size);
+		oomp(s->levels);
+		memset(s->levels + s->depth, 0, sizeof(struct walk_level) * (s->levels_size - s->depth));
+	}
+
+	struct walk_level *l = &s->levels[s->depth];
+	if (l->buf == NULL) {
+		l->buf = malloc(WALK_BUFFER);
+		oomp(l->buf);
+	}
+	l->fd = fd;
+	l->pos = l->len = 0;
+	l->path_len = path_len;
+	++s->depth;
+
+	if (s->w->dir != NULL) {
+		s->w->dir(s->w->data, s->path);
+	}
+}
+
+static void walk_entry(struct walk_state *s, struct linux_dirent64 *d) {
+	// s->levels can move in walk_enter, d points in the level's buffer, which doesn't
+	int dirfd = s->levels[s->depth-1].fd;
+	size_t len = walk_path_append(s, s->levels[s->depth-1].path_len, d->d_name);
+	unsigned char type = d->d_type;
+	bool have_stat = false;
+	struct stat st;
+
+	// NFS, XFS and some FUSE filesystems don't fill d_type, symlinks are followed
+	if ((type == DT_UNKNOWN) || (type == DT_LNK)) {
+		if (fstatat(dirfd, d->d_name, &st, 0) < 0) {
+			// a dangling symlink too: its target may be on a drive that isn't mounted
+			walk_failed(s, s->path);
+			return;
+		}
+		have_stat = true;
+		if (S_ISDIR(st.st_mode)) {
+			type = DT_DIR;
+		} else if (S_ISREG(st.st_mode)) {
+			type = DT_REG;
+		}
+	}
+
+	if (type == DT_DIR) {
+		int fd = openat(dirfd, d->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "Can not open directory %s: %s\n", s->path, strerror(errno));
+			walk_failed(s, s->path);
+			return;
+		}
+		walk_enter(s, fd, len);
+	} else if ((type == DT_REG) && (s->w->file != NULL)) {
+		if ((s->w->accept != NULL) && !s->w->accept(s->w->data, s->path)) return;
+		if (!have_stat && (fstatat(dirfd, d->d_name, &st, 0) < 0)) {
+			fprintf(stderr, "Can not stat %s: %s\n", s->path, strerror(errno));
+			walk_failed(s, s->path);
+			return;
+		}
+		s->w->file(s->w->data, s->path, &st);
+	}
+	// things that are not regular files or directories are ignored
+}
+
+void walk_tree(struct walk *w, const char *root) {
+	struct walk_state s;
+
+	s.w = w;
+	s.depth = 0;
+	s.levels_size = 16;
+	s.levels = calloc(s.levels_size, sizeof(struct walk_level));
+	oomp(s.levels);
+	s.path_size = 4096;
+	s.path = malloc(s.path_size);
+	oomp(s.path);
+	s.visited = g_hash_table_new_full(dir_id_hash, dir_id_equal, free, NULL);
+
+	size_t len = strlen(root);
+	while ((len > 1) && (root[len-1] == '/')) --len;
+	if (len + 1 > s.path_size) {
+		s.path_size = len + 1;
+		s.path = realloc(s.path, s.path_size);
+		oomp(s.path);
+	}
+	memcpy(s.path, root, len);
+	s.path[len] = '\0';
+
+	int fd = open(s.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Can not open directory %s: %s\n", s.path, strerror(errno));
+		walk_failed(&s, s.path);
+	} else {
+		walk_enter(&s, fd, len);
+	}
+
+	while (s.depth > 0) {
+		struct walk_level *l = &s.levels[s.depth-1];
+
+		if (l->pos >= l->len) {
+			long n = syscall(SYS_getdents64, l->fd, l->buf, WALK_BUFFER);
+			if (n <= 0) {
+				if (n < 0) {
+					s.path[l->path_len] = '\0';
+					fprintf(stderr, "Can not read directory %s: %s\n", s.path, strerror(errno));
+					walk_failed(&s, s.path);
+				}
+				close(l->fd);
+				--s.depth;
+				continue;
+			}
+			l->pos = 0;
+			l->len = n;
+		}
+
+		struct linux_dirent64 *d = (struct linux_dirent64 *)(l->buf + l->pos);
+		l->pos += d->d_reclen;
+
+		if (d->d_name[0] == '.') continue;
+
+		walk_entry(&s, d);
+	}
+
+	for (int i = 0; i < s.levels_size; ++i) {
+		free(s.levels[i].buf);
+	}
+	free(s.levels);
+	free(s.path);
+	g_hash_table_destroy(s.visited);
+}
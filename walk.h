@@ -0,0 +1,26 @@
+#ifndef __WALK__
+#define __WALK__
+
+#include <stdbool.h>
+#include <sys/stat.h>
+
+// Callbacks of walk_tree, any of them can be NULL
+struct walk {
+	void *data;
+	// called for every directory entered, the root included
+	void (*dir)(void *data, const char *path);
+	// called with the path of every regular file before it is stat-ed, return false to skip it
+	bool (*accept)(void *data, const char *path);
+	// called for every regular file accepted
+	void (*file)(void *data, const char *path, const struct stat *st);
+	// called with a directory, or a file, the walk couldn't read: what is
+	// under it may be missing from the walk
+	void (*failed)(void *data, const char *path);
+};
+
+// Walks the directory tree under root, without recursion, following symlinks.
+// Every directory is entered once, even if more than one symlink points to it.
+// Names starting with a dot are skipped.
+void walk_tree(struct walk *w, const char *root);
+
+#endif
@@ -0,0 +1,306 @@
+#include "watch.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <libavformat/avformat.h>
+#include <glib.h>
+
+#include "util.h"
+#include "walk.h"
+
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// a batch is handed to the worker once no event arrived for WATCH_QUIET_MS,
+// or WATCH_MAX_DELAY_MS after its first event if events keep coming
+#define WATCH_TICK_MS 500
+#define WATCH_QUIET_MS 2000
+#define WATCH_MAX_DELAY_MS 10000
+#define WATCH_MAX_BATCH 10000
+
+struct watch_batch {
+	char **paths;
+	int n;
+	bool rescan; // events were lost, rescan all the roots
+};
+
+// sent to the worker to make it exit
+static struct watch_batch end_of_batches;
+
+static int inotify_fd = -1;
+static GIOChannel *inotify_channel = NULL;
+static guint inotify_source_id;
+
+// wd -> directory path, written by the worker when it adds watches, read by the main loop
+static GHashTable *watched_dirs = NULL;
+static GMutex watched_dirs_mutex;
+
+// paths touched since the last batch, only accessed by the main loop
+static GHashTable *pending = NULL;
+static bool pending_rescan = false;
+static gint64 pending_first = 0, pending_last = 0;
+static guint tick_source_id = 0;
+
+static GAsyncQueue *batches = NULL;
+static GThread *worker = NULL;
+static void (*changes_callback)(struct index_changes *changes) = NULL;
+
+static void watch_add(const char *dir) {
+	int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			fprintf(stderr, "Can not watch %s, raise fs.inotify.max_user_watches\n", dir);
+		}
+		return;
+	}
+
+	char *d = strdup(dir);
+	oomp(d);
+
+	// a directory moved inside the library keeps its wd, this updates its path
+	g_mutex_lock(&watched_dirs_mutex);
+	g_hash_table_insert(watched_dirs, GINT_TO_POINTER(wd), d);
+	g_mutex_unlock(&watched_dirs_mutex);
+}
+
+static void watch_add_dir(void *data, const char *dir) {
+	watch_add(dir);
+}
+
+static void watch_add_recursive(const char *dir_name) {
+	struct walk w = { NULL, watch_add_dir, NULL, NULL };
+	walk_tree(&w, dir_name);
+}
+
+static gboolean watch_deliver_changes(gpointer data) {
+	struct index_changes *changes = data;
+	if (changes_callback != NULL) {
+		changes_callback(changes);
+	}
+	index_changes_free(changes);
+	free(changes);
+	return FALSE;
+}
+
+static void watch_batch_free(struct watch_batch *batch) {
+	for (int i = 0; i < batch->n; ++i) {
+		free(batch->paths[i]);
+	}
+	free(batch->paths);
+	free(batch);
+}
+
+static gpointer watch_worker(gpointer data) {
+	sqlite3 *index_db = open_or_create_index_db();
+
+	char **roots = NULL;
+	int rootcount = index_roots(index_db, &roots);
+
+	for (int i = 0; i < rootcount; ++i) {
+		watch_add_recursive(roots[i]);
+	}
+
+	for (;;) {
+		struct watch_batch *batch = g_async_queue_pop(batches);
+		if (batch == &end_of_batches) break;
+
+		struct index_changes *changes = calloc(1, sizeof(struct index_changes));
+		oomp(changes);
+
+		if (batch->rescan) {
+			for (int i = 0; i < rootcount; ++i) {
+				watch_add_recursive(roots[i]);
+			}
+			// events were lost, deletions among them
+			index_rescan(index_db, roots, rootcount, changes);
+		} else {
+			for (int i = 0; i < batch->n; ++i) {
+				struct stat st;
+				if ((stat(batch->paths[i], &st) == 0) && S_ISDIR(st.st_mode)) {
+					watch_add_recursive(batch->paths[i]);
+				}
+			}
+			index_update_paths(index_db, batch->paths, batch->n, changes);
+		}
+
+		watch_batch_free(batch);
+
+		if (changes->n > 0) {
+			g_idle_add(watch_deliver_changes, changes);
+		} else {
+			index_changes_free(changes);
+			free(changes);
+		}
+	}
+
+	for (int i = 0; i < rootcount; ++i) {
+		free(roots[i]);
+	}
+	free(roots);
+	close_db(index_db);
+
+	return NULL;
+}
+
+static void watch_flush(void) {
+	struct watch_batch *batch = malloc(sizeof(struct watch_batch));
+	oomp(batch);
+
+	batch->rescan = pending_rescan;
+	batch->n = 0;
+	batch->paths = malloc(sizeof(char *) * (g_hash_table_size(pending) + 1));
+	oomp(batch->paths);
+
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		batch->paths[batch->n] = strdup(key);
+		oomp(batch->paths[batch->n]);
+		++batch->n;
+	}
+
+	g_hash_table_remove_all(pending);
+	pending_rescan = false;
+
+	g_async_queue_push(batches, batch);
+}
+
+static gboolean watch_tick(gpointer data) {
+	gint64 now = g_get_monotonic_time();
+
+	if ((now - pending_last < WATCH_QUIET_MS * 1000) && (now - pending_first < WATCH_MAX_DELAY_MS * 1000)) {
+		return TRUE;
+	}
+
+	watch_flush();
+
+	tick_source_id = 0;
+	return FALSE;
+}
+
+static void watch_touch(char *path) {
+	gint64 now = g_get_monotonic_time();
+
+	if (path != NULL) {
+		g_hash_table_add(pending, path);
+	} else {
+		pending_rescan = true;
+	}
+
+	if (tick_source_id == 0) {
+		pending_first = now;
+		tick_source_id = g_timeout_add(WATCH_TICK_MS, watch_tick, NULL);
+	}
+	pending_last = now;
+
+	if (g_hash_table_size(pending) >= WATCH_MAX_BATCH) {
+		g_source_remove(tick_source_id);
+		tick_source_id = 0;
+		watch_flush();
+	}
+}
+
+static gboolean watch_inotify(GIOChannel *source, GIOCondition condition, void *ignored) {
+	char buf[64 * 1024] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+	ssize_t len = read(inotify_fd, buf, sizeof(buf));
+	if (len <= 0) return TRUE;
+
+	for (char *p = buf; p < buf + len; ) {
+		struct inotify_event *event = (struct inotify_event *)p;
+		p += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			watch_touch(NULL);
+			continue;
+		}
+
+		if (event->mask & IN_IGNORED) {
+			g_mutex_lock(&watched_dirs_mutex);
+			g_hash_table_remove(watched_dirs, GINT_TO_POINTER(event->wd));
+			g_mutex_unlock(&watched_dirs_mutex);
+			continue;
+		}
+
+		// temporary files (rsync, editors) are picked up when they are renamed
+		if ((event->len == 0) || (event->name[0] == '.')) continue;
+
+		// new files are indexed once they are closed
+		if ((event->mask & IN_CREATE) && !(event->mask & IN_ISDIR)) continue;
+
+		char *path = NULL;
+
+		g_mutex_lock(&watched_dirs_mutex);
+		const char *dir = g_hash_table_lookup(watched_dirs, GINT_TO_POINTER(event->wd));
+		if (dir != NULL) {
+			asprintf(&path, "%s/%s", dir, event->name);
+			oomp(path);
+		}
+		g_mutex_unlock(&watched_dirs_mutex);
+
+		if (path == NULL) continue;
+
+		if (g_hash_table_contains(pending, path)) {
+			free(path);
+			pending_last = g_get_monotonic_time();
+			continue;
+		}
+
+		watch_touch(path);
+	}
+
+	return TRUE;
+}
+
+bool watch_start(void (*on_changes)(struct index_changes *changes)) {
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) {
+		perror("Could not start watching the library");
+		return false;
+	}
+
+	av_register_all();
+
+	changes_callback = on_changes;
+	g_mutex_init(&watched_dirs_mutex);
+	watched_dirs = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, free);
+	pending = g_hash_table_new_full(g_str_hash, g_str_equal, free, NULL);
+	batches = g_async_queue_new();
+
+	// the worker adds the initial watches, on a large library that takes a while
+	worker = g_thread_new("library-watch", watch_worker, NULL);
+
+	inotify_channel = g_io_channel_unix_new(inotify_fd);
+	inotify_source_id = g_io_add_watch(inotify_channel, G_IO_IN, (GIOFunc)watch_inotify, NULL);
+
+	return true;
+}
+
+void watch_stop(void) {
+	if (worker == NULL) return;
+
+	g_source_remove(inotify_source_id);
+	if (tick_source_id != 0) {
+		g_source_remove(tick_source_id);
+		tick_source_id = 0;
+	}
+
+	g_async_queue_push(batches, &end_of_batches);
+	g_thread_join(worker);
+	worker = NULL;
+
+	g_io_channel_unref(inotify_channel);
+	close(inotify_fd);
+	inotify_fd = -1;
+
+	g_async_queue_unref(batches);
+	g_hash_table_destroy(pending);
+	g_hash_table_destroy(watched_dirs);
+	g_mutex_clear(&watched_dirs_mutex);
+}
@@ -0,0 +1,11 @@
+#ifndef __WATCH__
+#define __WATCH__
+
+#include <stdbool.h>
+
+#include "index.h"
+
+bool watch_start(void (*on_changes)(struct index_changes *changes));
+void watch_stop(void);
+
+#endif